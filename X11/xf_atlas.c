@@ -0,0 +1,225 @@
+/*
+   Copyright (c) 2010 FreeRDP project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xf_types.h"
+#include "xf_atlas.h"
+
+/*
+   Cache bitmaps are at most 64x64, creating one server pixmap for each
+   gives the X server thousands of tiny resources to allocate and free.
+   Instead they are packed into ATLAS_SIZE square pages, one set of pages
+   per cell size (16, 32 and 64 pixels).  A page hands out cells from a
+   free stack and is released once empty, unless it is the last page of
+   its size.  Anything larger gets a pixmap of its own.
+*/
+
+#define ATLAS_SIZE 1024
+#define ATLAS_MIN_CELL 16
+#define ATLAS_MAX_CELL 64
+#define ATLAS_CLASSES 3
+
+struct xf_atlas_page
+{
+	Pixmap pixmap;
+	int class;
+	int cell_size;
+	int cells;
+	int used;
+	int free_count;
+	int * free_cells;
+	struct xf_atlas_page * next;
+};
+
+struct xf_atlas
+{
+	struct xf_atlas_page * pages[ATLAS_CLASSES];
+};
+
+int
+xf_atlas_init(xfInfo * xfi)
+{
+	struct xf_atlas * atlas;
+
+	atlas = (struct xf_atlas *) malloc(sizeof(struct xf_atlas));
+	memset(atlas, 0, sizeof(struct xf_atlas));
+	xfi->atlas = atlas;
+	return 0;
+}
+
+void
+xf_atlas_uninit(xfInfo * xfi)
+{
+	struct xf_atlas * atlas;
+	struct xf_atlas_page * page;
+	int class;
+
+	atlas = xfi->atlas;
+	if (atlas == NULL)
+	{
+		return;
+	}
+	for (class = 0; class < ATLAS_CLASSES; class++)
+	{
+		while (atlas->pages[class] != NULL)
+		{
+			page = atlas->pages[class];
+			atlas->pages[class] = page->next;
+			XFreePixmap(xfi->display, page->pixmap);
+			free(page->free_cells);
+			free(page);
+		}
+	}
+	free(atlas);
+	xfi->atlas = NULL;
+}
+
+static struct xf_atlas_page *
+xf_atlas_page_new(xfInfo * xfi, int class, int cell_size)
+{
+	struct xf_atlas_page * page;
+	int index;
+
+	page = (struct xf_atlas_page *) malloc(sizeof(struct xf_atlas_page));
+	memset(page, 0, sizeof(struct xf_atlas_page));
+	page->pixmap = XCreatePixmap(xfi->display, xfi->wnd, ATLAS_SIZE, ATLAS_SIZE,
+		xfi->depth);
+	page->class = class;
+	page->cell_size = cell_size;
+	page->cells = (ATLAS_SIZE / cell_size) * (ATLAS_SIZE / cell_size);
+	page->free_cells = (int *) malloc(page->cells * sizeof(int));
+	/* hand out cells top left first */
+	for (index = 0; index < page->cells; index++)
+	{
+		page->free_cells[index] = page->cells - 1 - index;
+	}
+	page->free_count = page->cells;
+	return page;
+}
+
+/* a bitmap with a server pixmap of its own, used for surfaces and
+   anything too big for a cell */
+xfBitmap *
+xf_atlas_alloc_pixmap(xfInfo * xfi, int width, int height)
+{
+	xfBitmap * bitmap;
+
+	bitmap = (xfBitmap *) malloc(sizeof(xfBitmap));
+	memset(bitmap, 0, sizeof(xfBitmap));
+	bitmap->pixmap = XCreatePixmap(xfi->display, xfi->wnd, width, height, xfi->depth);
+	bitmap->width = width;
+	bitmap->height = height;
+	return bitmap;
+}
+
+xfBitmap *
+xf_atlas_alloc(xfInfo * xfi, int width, int height)
+{
+	struct xf_atlas * atlas;
+	struct xf_atlas_page * page;
+	xfBitmap * bitmap;
+	int cell_size;
+	int class;
+	int cell;
+	int per_row;
+
+	atlas = xfi->atlas;
+	if ((atlas == NULL) || (width > ATLAS_MAX_CELL) || (height > ATLAS_MAX_CELL))
+	{
+		return xf_atlas_alloc_pixmap(xfi, width, height);
+	}
+	class = 0;
+	cell_size = ATLAS_MIN_CELL;
+	while ((cell_size < width) || (cell_size < height))
+	{
+		cell_size *= 2;
+		class++;
+	}
+	page = atlas->pages[class];
+	while ((page != NULL) && (page->free_count == 0))
+	{
+		page = page->next;
+	}
+	if (page == NULL)
+	{
+		page = xf_atlas_page_new(xfi, class, cell_size);
+		page->next = atlas->pages[class];
+		atlas->pages[class] = page;
+	}
+	page->free_count--;
+	cell = page->free_cells[page->free_count];
+	page->used++;
+
+	per_row = ATLAS_SIZE / cell_size;
+	bitmap = (xfBitmap *) malloc(sizeof(xfBitmap));
+	bitmap->pixmap = page->pixmap;
+	bitmap->x = (cell % per_row) * cell_size;
+	bitmap->y = (cell / per_row) * cell_size;
+	bitmap->width = width;
+	bitmap->height = height;
+	bitmap->page = page;
+	bitmap->cell = cell;
+	return bitmap;
+}
+
+void
+xf_atlas_free(xfInfo * xfi, xfBitmap * bitmap)
+{
+	struct xf_atlas * atlas;
+	struct xf_atlas_page * page;
+	struct xf_atlas_page ** link;
+
+	if (bitmap == NULL)
+	{
+		return;
+	}
+	atlas = xfi->atlas;
+	page = bitmap->page;
+	if (page == NULL)
+	{
+		XFreePixmap(xfi->display, bitmap->pixmap);
+		free(bitmap);
+		return;
+	}
+	page->free_cells[page->free_count] = bitmap->cell;
+	page->free_count++;
+	page->used--;
+	free(bitmap);
+	if ((page->used > 0) || (atlas->pages[page->class] == page && page->next == NULL))
+	{
+		return;
+	}
+	/* empty and not the only page of its size */
+	link = &(atlas->pages[page->class]);
+	while (*link != page)
+	{
+		link = &((*link)->next);
+	}
+	*link = page->next;
+	XFreePixmap(xfi->display, page->pixmap);
+	free(page->free_cells);
+	free(page);
+}
@@ -228,6 +228,20 @@ xf_colour_convert(xfInfo * xfi, rdpSet * settings, int colour)
 	return xf_colour(xfi, colour, settings->server_depth, xfi->bpp);
 }
 
+/* the converted image only has to live until it is put to the server, so
+   one grow-only buffer serves every paint */
+static uint8 *
+xf_convert_buffer(xfInfo * xfi, int size)
+{
+	if (size > xfi->convert_buffer_size)
+	{
+		free(xfi->convert_buffer);
+		xfi->convert_buffer = (uint8 *) malloc(size);
+		xfi->convert_buffer_size = size;
+	}
+	return xfi->convert_buffer;
+}
+
 uint8 *
 xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	uint8 * in_data)
@@ -243,7 +257,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 
 	if ((settings->server_depth == 24) && (xfi->bpp == 32))
 	{
-		out_data = (uint8 *) malloc(width * height * 4);
+		out_data = xf_convert_buffer(xfi, width * height * 4);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -261,7 +275,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 16) && (xfi->bpp == 32))
 	{
-		out_data = (uint8 *) malloc(width * height * 4);
+		out_data = xf_convert_buffer(xfi, width * height * 4);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -279,7 +293,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 15) && (xfi->bpp == 32))
 	{
-		out_data = (uint8 *) malloc(width * height * 4);
+		out_data = xf_convert_buffer(xfi, width * height * 4);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -297,7 +311,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 8) && (xfi->bpp == 32))
 	{
-		out_data = (uint8 *) malloc(width * height * 4);
+		out_data = xf_convert_buffer(xfi, width * height * 4);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -314,7 +328,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 15) && (xfi->bpp == 16))
 	{
-		out_data = (uint8 *) malloc(width * height * 2);
+		out_data = xf_convert_buffer(xfi, width * height * 2);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -330,7 +344,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 8) && (xfi->bpp == 16))
 	{
-		out_data = (uint8 *) malloc(width * height * 2);
+		out_data = xf_convert_buffer(xfi, width * height * 2);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
@@ -347,7 +361,7 @@ xf_image_convert(xfInfo * xfi, rdpSet * settings, int width, int height,
 	}
 	else if ((settings->server_depth == 8) && (xfi->bpp == 15))
 	{
-		out_data = (uint8 *) malloc(width * height * 2);
+		out_data = xf_convert_buffer(xfi, width * height * 2);
 		src8 = in_data;
 		dst8 = out_data;
 		for (index = width * height; index > 0; index--)
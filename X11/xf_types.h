@@ -36,6 +36,20 @@ struct xf_km
 	int flags;
 };
 
+/* an RD_HBITMAP, either a cell of an atlas page or a pixmap of its own
+   (page is NULL), see xf_atlas.c */
+struct xf_bitmap
+{
+	Pixmap pixmap;
+	int x;
+	int y;
+	int width;
+	int height;
+	struct xf_atlas_page * page;
+	int cell;
+};
+typedef struct xf_bitmap xfBitmap;
+
 struct xf_info
 {
 	/* RDP stuff */
@@ -72,6 +86,9 @@ struct xf_info
 	GC gc_mono;
 	GC gc_default;
 	Cursor null_cursor;
+	struct xf_atlas * atlas;
+	uint8 * convert_buffer;
+	int convert_buffer_size;
 	struct xf_km km[256];
 	int pause_key;
 	int tab_key;
@@ -38,6 +38,7 @@
 #include "xf_colour.h"
 #include "xf_keyboard.h"
 #include "xf_win.h"
+#include "xf_atlas.h"
 
 #define MWM_HINTS_DECORATIONS   (1L << 1)
 #define PROP_MOTIF_WM_HINTS_ELEMENTS    5
@@ -265,26 +266,31 @@ l_ui_destroy_glyph(struct rdp_inst * inst, RD_HGLYPH glyph)
 	XFreePixmap(xfi->display, (Pixmap) glyph);
 }
 
-static RD_HBITMAP
-l_ui_create_bitmap(struct rdp_inst * inst, int width, int height, uint8 * data)
+static void
+xf_put_bitmap_data(xfInfo * xfi, rdpSet * settings, Drawable drw, int x, int y,
+	int width, int height, uint8 * data)
 {
 	XImage * image;
-	Pixmap bitmap;
-	xfInfo * xfi;
 	uint8 * cdata;
 
-	xfi = GET_XFI(inst);
-	//printf("ui_create_bitmap: inst %p width %d height %d\n", inst, width, height);
-	bitmap = XCreatePixmap(xfi->display, xfi->wnd, width, height, xfi->depth);
-	cdata = xf_image_convert(xfi, inst->settings, width, height, data);
+	cdata = xf_image_convert(xfi, settings, width, height, data);
 	image = XCreateImage(xfi->display, xfi->visual, xfi->depth, ZPixmap, 0,
 		(char *) cdata, width, height, xfi->bitmap_pad, 0);
-	XPutImage(xfi->display, bitmap, xfi->gc_default, image, 0, 0, 0, 0, width, height);
+	XPutImage(xfi->display, drw, xfi->gc_default, image, 0, 0, x, y, width, height);
 	XFree(image);
-	if (cdata != data)
-	{
-		free(cdata);
-	}
+}
+
+static RD_HBITMAP
+l_ui_create_bitmap(struct rdp_inst * inst, int width, int height, uint8 * data)
+{
+	xfBitmap * bitmap;
+	xfInfo * xfi;
+
+	xfi = GET_XFI(inst);
+	//printf("ui_create_bitmap: inst %p width %d height %d\n", inst, width, height);
+	bitmap = xf_atlas_alloc(xfi, width, height);
+	xf_put_bitmap_data(xfi, inst->settings, bitmap->pixmap, bitmap->x, bitmap->y,
+		width, height, data);
 	return (RD_HBITMAP) bitmap;
 }
 
@@ -303,10 +309,6 @@ l_ui_paint_bitmap(struct rdp_inst * inst, int x, int y, int cx, int cy, int widt
 	XPutImage(xfi->display, xfi->backstore, xfi->gc_default, image, 0, 0, x, y, cx, cy);
 	XCopyArea(xfi->display, xfi->backstore, xfi->wnd, xfi->gc_default, x, y, cx, cy, x, y);
 	XFree(image);
-	if (cdata != data)
-	{
-		free(cdata);
-	}
 }
 
 static void
@@ -316,7 +318,7 @@ l_ui_destroy_bitmap(struct rdp_inst * inst, RD_HBITMAP bmp)
 
 	xfi = GET_XFI(inst);
 	//printf("ui_destroy_bitmap:\n");
-	XFreePixmap(xfi->display, (Pixmap) bmp);
+	xf_atlas_free(xfi, (xfBitmap *) bmp);
 }
 
 static void
@@ -524,13 +526,15 @@ l_ui_patblt(struct rdp_inst * inst, uint8 opcode, int x, int y, int cx, int cy,
 			}
 			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
 			{
-				fill = (Pixmap) l_ui_create_bitmap(inst, 8, 8, brush->bd->data);
+				/* a tile must be a pixmap of its own, not an atlas cell */
+				fill = XCreatePixmap(xfi->display, xfi->wnd, 8, 8, xfi->depth);
+				xf_put_bitmap_data(xfi, inst->settings, fill, 0, 0, 8, 8, brush->bd->data);
 				XSetFillStyle(xfi->display, xfi->gc, FillTiled);
 				XSetTile(xfi->display, xfi->gc, fill);
 				XSetTSOrigin(xfi->display, xfi->gc, brush->xorigin, brush->yorigin);
 				XFillRectangle(xfi->display, xfi->drw, xfi->gc, x, y, cx, cy);
 				XSetTile(xfi->display, xfi->gc, xfi->backstore);
-				l_ui_destroy_bitmap(inst, (RD_HBITMAP) fill);
+				XFreePixmap(xfi->display, fill);
 			}
 			else
 			{
@@ -591,15 +595,33 @@ l_ui_memblt(struct rdp_inst * inst, uint8 opcode, int x, int y, int cx, int cy,
 	RD_HBITMAP src, int srcx, int srcy)
 {
 	xfInfo * xfi;
+	xfBitmap * bitmap;
 
 	xfi = GET_XFI(inst);
+	bitmap = (xfBitmap *) src;
 	//printf("ui_memblt: xfi->drw %p, opcode, %d, x %d, y %d, cx %d, cy %d, src %p srcx %d srcy %d\n",
 	//	xfi->drw, opcode, x, y, cx, cy, src, srcx, srcy);
+	/* X leaves dst alone where src runs off a pixmap, clip so an atlas
+	   cell does not bleed its neighbours instead */
+	if (srcx + cx > bitmap->width)
+	{
+		cx = bitmap->width - srcx;
+	}
+	if (srcy + cy > bitmap->height)
+	{
+		cy = bitmap->height - srcy;
+	}
+	if ((cx <= 0) || (cy <= 0))
+	{
+		return;
+	}
+	srcx += bitmap->x;
+	srcy += bitmap->y;
 	xf_set_rop3(xfi, opcode);
-	XCopyArea(xfi->display, (Pixmap) src, xfi->drw, xfi->gc, srcx, srcy, cx, cy, x, y);
+	XCopyArea(xfi->display, bitmap->pixmap, xfi->drw, xfi->gc, srcx, srcy, cx, cy, x, y);
 	if (xfi->drw == xfi->backstore)
 	{
-		XCopyArea(xfi->display, (Pixmap) src, xfi->wnd, xfi->gc, srcx, srcy, cx, cy, x, y);
+		XCopyArea(xfi->display, bitmap->pixmap, xfi->wnd, xfi->gc, srcx, srcy, cx, cy, x, y);
 	}
 }
 
@@ -791,22 +813,22 @@ l_ui_set_colourmap(struct rdp_inst * inst, RD_HCOLOURMAP map)
 static RD_HBITMAP
 l_ui_create_surface(struct rdp_inst * inst, int width, int height, RD_HBITMAP old_surface)
 {
-	Pixmap new;
-	Pixmap old;
+	xfBitmap * new;
+	xfBitmap * old;
 	xfInfo * xfi;
 
 	xfi = GET_XFI(inst);
-	new = XCreatePixmap(xfi->display, xfi->wnd, width, height, xfi->depth);
-	old = (Pixmap) old_surface;
+	new = xf_atlas_alloc_pixmap(xfi, width, height);
+	old = (xfBitmap *) old_surface;
 	if (old != 0)
 	{
-		XCopyArea(xfi->display, old, new, xfi->gc_default, 0, 0,
+		XCopyArea(xfi->display, old->pixmap, new->pixmap, xfi->gc_default, 0, 0,
 			width, height, 0, 0);
-		XFreePixmap(xfi->display, old);
-	}
-	if (xfi->drw == old)
-	{
-		xfi->drw = new;
+		if (xfi->drw == old->pixmap)
+		{
+			xfi->drw = new->pixmap;
+		}
+		xf_atlas_free(xfi, old);
 	}
 	return (RD_HBITMAP) new;
 }
@@ -819,7 +841,7 @@ l_ui_set_surface(struct rdp_inst * inst, RD_HBITMAP surface)
 	xfi = GET_XFI(inst);
 	if (surface != 0)
 	{
-		xfi->drw = (Drawable) surface;
+		xfi->drw = ((xfBitmap *) surface)->pixmap;
 	}
 	else
 	{
@@ -833,15 +855,16 @@ l_ui_destroy_surface(struct rdp_inst * inst, RD_HBITMAP surface)
 	xfInfo * xfi;
 
 	xfi = GET_XFI(inst);
-	if (xfi->drw == (Drawable) surface)
+	if (surface == 0)
 	{
-		l_ui_warning(inst, "ui_destroy_surface: freeing active surface!\n");
-		xfi->drw = xfi->backstore;
+		return;
 	}
-	if (surface != 0)
+	if (xfi->drw == ((xfBitmap *) surface)->pixmap)
 	{
-		XFreePixmap(xfi->display, (Pixmap) surface);
+		l_ui_warning(inst, "ui_destroy_surface: freeing active surface!\n");
+		xfi->drw = xfi->backstore;
 	}
+	xf_atlas_free(xfi, (xfBitmap *) surface);
 }
 
 static void
@@ -1092,6 +1115,11 @@ xf_post_connect(xfInfo * xfi)
 	XFillRectangle(xfi->display, xfi->backstore, xfi->gc, 0, 0, width, height);
 	xfi->null_cursor = (Cursor) l_ui_create_cursor(xfi->inst, 0, 0, 32, 32, 0, 0, 0);
 	xfi->mod_map = XGetModifierMapping(xfi->display);
+
+	/* cache bitmaps outlive the window across fullscreen toggles */
+	if (!xfi->atlas)
+		xf_atlas_init(xfi);
+
 	return 0;
 }
 
@@ -1123,6 +1151,10 @@ void
 xf_uninit(xfInfo * xfi)
 {
 	xf_destroy_window(xfi);
+	xf_atlas_uninit(xfi);
+	free(xfi->convert_buffer);
+	xfi->convert_buffer = NULL;
+	xfi->convert_buffer_size = 0;
 	XCloseDisplay(xfi->display);
 }
 
@@ -63,6 +63,7 @@ set_default_params(xfInfo * xfi)
 	settings->triblt = 0;
 	settings->new_cursors = 1;
 	settings->rdp_version = 5;
+	settings->auto_reconnect_attempts = 5;
 	xfi->fullscreen = xfi->fs_toggle = 0;
 	return 0;
 }
@@ -278,6 +279,38 @@ process_params(xfInfo * xfi, int argc, char ** argv, int * pindex)
 				settings->rdp5_performanceflags = strtol(argv[*pindex], 0, 16);
 			}
 		}
+		else if (strcmp("--no-auto-reconnect", argv[*pindex]) == 0)
+		{
+			settings->auto_reconnect_attempts = 0;
+		}
+		else if (strcmp("--verify-mac", argv[*pindex]) == 0)
+		{
+			settings->verify_signatures = 1;
+		}
+		else if (strcmp("--connect-timeout", argv[*pindex]) == 0)
+		{
+			*pindex = *pindex + 1;
+			if (*pindex == argc)
+			{
+				printf("missing connect timeout\n");
+				return 1;
+			}
+			settings->tcp_connect_timeout = strtol(argv[*pindex], 0, 10) * 1000;
+		}
+		else if (strcmp("--pipeline-joins", argv[*pindex]) == 0)
+		{
+			settings->mcs_pipeline_joins = 1;
+		}
+		else if (strcmp("--cache-memory", argv[*pindex]) == 0)
+		{
+			*pindex = *pindex + 1;
+			if (*pindex == argc)
+			{
+				printf("missing cache memory size\n");
+				return 1;
+			}
+			settings->bitmap_cache_memory = strtol(argv[*pindex], 0, 10);
+		}
 		else if (strcmp("--plugin", argv[*pindex]) == 0)
 		{
 			*pindex = *pindex + 1;
@@ -332,6 +365,11 @@ process_params(xfInfo * xfi, int argc, char ** argv, int * pindex)
 				"\t-f: fullscreen mode\n"
 				"\t-z: enable bulk compression\n"
 				"\t-x: performance flags (m, b or l for modem, broadband or lan)\n"
+				"\t--no-auto-reconnect: exit when the connection drops\n"
+				"\t--verify-mac: check the signature of encrypted packets\n"
+				"\t--connect-timeout: give up connecting after this many seconds\n"
+				"\t--cache-memory: limit cached bitmaps to this many KB\n"
+				"\t--pipeline-joins: join channels without waiting for each confirm\n"
 				"\t--plugin: load a virtual channel plugin\n"
 				"\t-h: show this help\n"
 				"\n";
@@ -31,6 +31,7 @@
 #include <freerdp/vchan.h>
 #include "chan_stream.h"
 #include "chan_plugin.h"
+#include "chan_pool.h"
 #include "wait_obj.h"
 #include "cliprdr_main.h"
 
@@ -214,7 +215,7 @@ thread_process_data_in(cliprdrPlugin * plugin)
 		if (data != 0)
 		{
 			thread_process_message(plugin, data, data_size);
-			free(data);
+			chan_pool_free(data);
 		}
 		if (item != 0)
 		{
@@ -274,9 +275,9 @@ OpenEventProcessReceived(uint32 openHandle, void * pData, uint32 dataLength,
 		plugin->data_in_read = 0;
 		if (plugin->data_in != 0)
 		{
-			free(plugin->data_in);
+			chan_pool_free(plugin->data_in);
 		}
-		plugin->data_in = (char *) malloc(totalLength);
+		plugin->data_in = (char *) chan_pool_alloc(totalLength);
 		plugin->data_in_size = totalLength;
 	}
 	memcpy(plugin->data_in + plugin->data_in_read, pData, dataLength);
@@ -367,12 +368,12 @@ InitEventProcessTerminated(void * pInitHandle)
 	{
 		in_item = plugin->in_list_head;
 		plugin->in_list_head = in_item->next;
-		free(in_item->data);
+		chan_pool_free(in_item->data);
 		free(in_item);
 	}
 	if (plugin->data_in != 0)
 	{
-		free(plugin->data_in);
+		chan_pool_free(plugin->data_in);
 	}
 
 	clipboard_free(plugin->device_data);
@@ -0,0 +1,152 @@
+/*
+   Copyright (c) 2010 FreeRDP project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "chan_pool.h"
+
+#define LOG_LEVEL 1
+#define LLOG(_level, _args) \
+  do { if (_level < LOG_LEVEL) { printf _args ; } } while (0)
+#define LLOGLN(_level, _args) \
+  do { if (_level < LOG_LEVEL) { printf _args ; printf("\n"); } } while (0)
+
+/* classes are 256, 1K, 4K, 16K and 64K bytes, bigger messages go
+   straight to malloc */
+#define POOL_CLASSES 5
+#define POOL_MIN_SHIFT 8
+#define POOL_CLASS_SIZE(_class) (1 << (POOL_MIN_SHIFT + 2 * (_class)))
+/* buffers kept per class once freed */
+#define POOL_MAX_FREE 8
+#define POOL_NO_CLASS -1
+
+/* sits in front of every buffer handed out */
+struct pool_header
+{
+	union
+	{
+		struct pool_header * next;	/* while on a free list */
+		int size_class;	/* while in use */
+	} u;
+	double align;
+};
+
+struct pool_class
+{
+	struct pool_header * head;
+	int count;
+};
+
+static struct pool_class g_classes[POOL_CLASSES];
+static struct chan_pool_stats g_stats;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+pool_size_class(int size)
+{
+	int size_class;
+
+	for (size_class = 0; size_class < POOL_CLASSES; size_class++)
+	{
+		if (size <= POOL_CLASS_SIZE(size_class))
+		{
+			return size_class;
+		}
+	}
+	return POOL_NO_CLASS;
+}
+
+void *
+chan_pool_alloc(int size)
+{
+	struct pool_header * header;
+	int size_class;
+
+	size_class = pool_size_class(size);
+	header = NULL;
+	pthread_mutex_lock(&g_mutex);
+	g_stats.allocs++;
+	if (size_class != POOL_NO_CLASS && g_classes[size_class].head != NULL)
+	{
+		header = g_classes[size_class].head;
+		g_classes[size_class].head = header->u.next;
+		g_classes[size_class].count--;
+	}
+	else
+	{
+		g_stats.mallocs++;
+	}
+	pthread_mutex_unlock(&g_mutex);
+
+	if (header == NULL)
+	{
+		if (size_class != POOL_NO_CLASS)
+		{
+			size = POOL_CLASS_SIZE(size_class);
+		}
+		header = (struct pool_header *) malloc(sizeof(struct pool_header) + size);
+		if (header == NULL)
+		{
+			LLOGLN(0, ("chan_pool_alloc: malloc of %d failed", size));
+			return NULL;
+		}
+	}
+	header->u.size_class = size_class;
+	return header + 1;
+}
+
+void
+chan_pool_free(void * mem)
+{
+	struct pool_header * header;
+	int size_class;
+
+	if (mem == NULL)
+	{
+		return;
+	}
+	header = ((struct pool_header *) mem) - 1;
+	size_class = header->u.size_class;
+	pthread_mutex_lock(&g_mutex);
+	g_stats.frees++;
+	if (size_class != POOL_NO_CLASS &&
+		g_classes[size_class].count < POOL_MAX_FREE)
+	{
+		header->u.next = g_classes[size_class].head;
+		g_classes[size_class].head = header;
+		g_classes[size_class].count++;
+		header = NULL;
+	}
+	pthread_mutex_unlock(&g_mutex);
+	free(header);
+}
+
+void
+chan_pool_get_stats(struct chan_pool_stats * stats)
+{
+	pthread_mutex_lock(&g_mutex);
+	memcpy(stats, &g_stats, sizeof(struct chan_pool_stats));
+	pthread_mutex_unlock(&g_mutex);
+}
@@ -0,0 +1,44 @@
+/*
+   Copyright (c) 2010 FreeRDP project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __CHAN_POOL_H
+#define __CHAN_POOL_H
+
+/* size-classed free lists for channel message buffers, so a plugin that
+   keeps receiving PDUs of similar size stops hitting malloc */
+
+struct chan_pool_stats
+{
+	long allocs;
+	long mallocs;
+	long frees;
+};
+
+void *
+chan_pool_alloc(int size);
+void
+chan_pool_free(void * mem);
+void
+chan_pool_get_stats(struct chan_pool_stats * stats);
+
+#endif
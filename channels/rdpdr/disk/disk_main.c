@@ -31,6 +31,15 @@
 #include <errno.h>
 #include <fnmatch.h>
 #include <utime.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 
 #ifdef HAVE_SYS_VFS_H
 #include <sys/vfs.h>
@@ -125,18 +134,47 @@ dummy_statfs(struct dummy_statfs_t *buf)
 #define STATFS_FN(path,buf) (dummy_statfs(buf))
 #endif
 
+/* how long file_stat may be reused by disk_query_info */
+#define DISK_STAT_CACHE_MS 1000
+
+/* largest read answered in one completion, the server asks for 64K at
+   most; longer requests get a short read */
+#define DISK_READ_MAX_LENGTH (1024 * 1024)
+
+/* one directory entry, name is an offset into FILE_INFO.entry_names */
+struct _DIR_ENTRY
+{
+	int name;
+	unsigned char type; /* d_type, 0 (DT_UNKNOWN) if not supported */
+};
+typedef struct _DIR_ENTRY DIR_ENTRY;
+
 struct _FILE_INFO
 {
 	uint32 file_id;
 	struct stat file_stat;
 	uint32 file_attr;
+	uint32 stat_time; /* ms, when file_stat was taken, 0 if stale */
 	int is_dir;
 	int file;
 	DIR * dir;
-	struct _FILE_INFO * next;
 	char * fullpath;
 	char * pattern;
 	int delete_pending;
+	/* matching entries, taken on the initial directory query */
+	DIR_ENTRY * entries;
+	int entry_count;
+	int entry_index;
+	char * entry_names;
+	int entry_names_size;
+	/* change notification, protected by the device mutex */
+	int watch; /* inotify watch descriptor, -1 if none */
+	uint32 notify_filter; /* FILE_NOTIFY_CHANGE_* */
+	IRP * notify_irp; /* pending IRP_MN_NOTIFY_CHANGE_DIRECTORY */
+	char * notify_buf; /* FILE_NOTIFY_INFORMATION records not sent yet */
+	int notify_len;
+	int notify_last; /* offset of the last record */
+	int notify_overflow; /* boolean, the client has to rescan */
 };
 typedef struct _FILE_INFO FILE_INFO;
 
@@ -151,10 +189,42 @@ struct _DISK_DEVICE_INFO
 
 	char * path;
 
-	FILE_INFO * head;
+	/* IRPs for different files run on different threads,
+	   mutex protects everything below */
+	pthread_mutex_t * mutex;
+	/* open files, open addressed by file_id with linear probing */
+	FILE_INFO ** files;
+	int files_size; /* power of 2 */
+	int files_count;
+	/* ids of closed files, handed out again before new ones */
+	uint32 * free_ids;
+	int free_ids_count;
+	int free_ids_size;
+	uint32 file_id_sequence;
+
+	/* inotify instance, started by the first change notification */
+	int notify_fd;
+	int notify_pipe[2]; /* wakes the notify thread up to exit */
+	int notify_thread_status;
+
+	/* handle statistics, logged when the device is freed */
+	int peak_files;
+	uint32 opened;
+	uint32 recycled;
+	uint32 lookups;
+	uint32 probes;
 };
 typedef struct _DISK_DEVICE_INFO DISK_DEVICE_INFO;
 
+static uint32
+get_mstime(void)
+{
+	struct timeval tp;
+
+	gettimeofday(&tp, 0);
+	return (tp.tv_sec * 1000) + (tp.tv_usec / 1000);
+}
+
 static uint64
 get_rdp_filetime(time_t seconds)
 {
@@ -319,10 +389,11 @@ disk_create_fullpath(IRP * irp, FILE_INFO * finfo, const char * fullpath)
 			return get_error_status();
 	}
 
-	if (stat(fullpath, &finfo->file_stat) != 0)
+	if (fstat((finfo->is_dir ? dirfd(finfo->dir) : finfo->file), &finfo->file_stat) != 0)
 	{
 		return RD_STATUS_NO_SUCH_FILE;
 	}
+	finfo->stat_time = get_mstime();
 
 	p = strrchr(fullpath, '/');
 	finfo->file_attr = get_file_attribute((p ? p + 1 : fullpath), &finfo->file_stat);
@@ -330,68 +401,608 @@ disk_create_fullpath(IRP * irp, FILE_INFO * finfo, const char * fullpath)
 	return RD_STATUS_SUCCESS;
 }
 
+/* refresh file_stat once it is older than DISK_STAT_CACHE_MS, Explorer
+   queries the same handle several times right after opening it */
+static void
+disk_update_file_stat(FILE_INFO * finfo)
+{
+	uint32 now;
+	int fd;
+	char * p;
+
+	now = get_mstime();
+	if (finfo->stat_time != 0 && now - finfo->stat_time < DISK_STAT_CACHE_MS)
+		return;
+	fd = (finfo->dir ? dirfd(finfo->dir) : finfo->file);
+	if (fstat(fd, &finfo->file_stat) != 0)
+		return;
+	finfo->stat_time = now;
+	p = strrchr(finfo->fullpath, '/');
+	finfo->file_attr = get_file_attribute((p ? p + 1 : finfo->fullpath), &finfo->file_stat);
+}
+
+static void
+disk_free_dir_snapshot(FILE_INFO * finfo)
+{
+	if (finfo->entries)
+		free(finfo->entries);
+	if (finfo->entry_names)
+		free(finfo->entry_names);
+	finfo->entries = NULL;
+	finfo->entry_names = NULL;
+	finfo->entry_count = 0;
+	finfo->entry_index = 0;
+	finfo->entry_names_size = 0;
+}
+
+/* read the whole directory once and keep the names that match the
+   pattern, later queries only stat the entry they return */
+static void
+disk_take_dir_snapshot(FILE_INFO * finfo)
+{
+	struct dirent * pdirent;
+	int entry_alloc;
+	int names_alloc;
+	int len;
+
+	disk_free_dir_snapshot(finfo);
+	entry_alloc = 0;
+	names_alloc = 0;
+
+	rewinddir(finfo->dir);
+	while ((pdirent = readdir(finfo->dir)) != NULL)
+	{
+		if (finfo->pattern && finfo->pattern[0] &&
+			fnmatch(finfo->pattern, pdirent->d_name, 0) != 0)
+		{
+			continue;
+		}
+		if (finfo->entry_count == entry_alloc)
+		{
+			entry_alloc = (entry_alloc ? entry_alloc * 2 : 64);
+			finfo->entries = (DIR_ENTRY *) realloc(finfo->entries, entry_alloc * sizeof(DIR_ENTRY));
+		}
+		len = strlen(pdirent->d_name) + 1;
+		while (finfo->entry_names_size + len > names_alloc)
+		{
+			names_alloc = (names_alloc ? names_alloc * 2 : 1024);
+			finfo->entry_names = (char *) realloc(finfo->entry_names, names_alloc);
+		}
+		memcpy(finfo->entry_names + finfo->entry_names_size, pdirent->d_name, len);
+		finfo->entries[finfo->entry_count].name = finfo->entry_names_size;
+#ifdef _DIRENT_HAVE_D_TYPE
+		finfo->entries[finfo->entry_count].type = pdirent->d_type;
+#else
+		finfo->entries[finfo->entry_count].type = 0;
+#endif
+		finfo->entry_names_size += len;
+		finfo->entry_count++;
+	}
+	LLOGLN(10, ("disk_take_dir_snapshot: %s %d entries", finfo->fullpath, finfo->entry_count));
+}
+
+/* the functions below up to disk_get_file_info are called with info->mutex held */
+
+static int
+disk_file_hash(DISK_DEVICE_INFO * info, uint32 file_id)
+{
+	return (file_id * 2654435761U) & (info->files_size - 1);
+}
+
+/* returns the slot holding file_id or -1 */
+static int
+disk_file_find(DISK_DEVICE_INFO * info, uint32 file_id)
+{
+	int index;
+
+	info->lookups++;
+	if (info->files_size == 0)
+		return -1;
+	index = disk_file_hash(info, file_id);
+	while (info->files[index])
+	{
+		if (info->files[index]->file_id == file_id)
+			return index;
+		info->probes++;
+		index = (index + 1) & (info->files_size - 1);
+	}
+	return -1;
+}
+
+static void
+disk_file_insert(DISK_DEVICE_INFO * info, FILE_INFO * finfo)
+{
+	FILE_INFO ** old_files;
+	int old_size;
+	int index;
+
+	/* keep the load factor at or below 1/2 so probe runs stay short */
+	if ((info->files_count + 1) * 2 > info->files_size)
+	{
+		old_files = info->files;
+		old_size = info->files_size;
+		info->files_size = (old_size ? old_size * 2 : 64);
+		info->files = (FILE_INFO **) malloc(info->files_size * sizeof(FILE_INFO *));
+		memset(info->files, 0, info->files_size * sizeof(FILE_INFO *));
+		info->files_count = 0;
+		for (index = 0; index < old_size; index++)
+		{
+			if (old_files[index])
+				disk_file_insert(info, old_files[index]);
+		}
+		if (old_files)
+			free(old_files);
+	}
+	index = disk_file_hash(info, finfo->file_id);
+	while (info->files[index])
+		index = (index + 1) & (info->files_size - 1);
+	info->files[index] = finfo;
+	info->files_count++;
+	if (info->files_count > info->peak_files)
+		info->peak_files = info->files_count;
+}
+
+/* backward shift deletion, no tombstones are left behind */
+static void
+disk_file_delete(DISK_DEVICE_INFO * info, int index)
+{
+	int next;
+	int home;
+
+	info->files[index] = NULL;
+	info->files_count--;
+	next = (index + 1) & (info->files_size - 1);
+	while (info->files[next])
+	{
+		home = disk_file_hash(info, info->files[next]->file_id);
+		/* move the entry back if its home slot is not in (index, next] */
+		if (((next - home) & (info->files_size - 1)) >= ((next - index) & (info->files_size - 1)))
+		{
+			info->files[index] = info->files[next];
+			info->files[next] = NULL;
+			index = next;
+		}
+		next = (next + 1) & (info->files_size - 1);
+	}
+}
+
+static uint32
+disk_file_new_id(DISK_DEVICE_INFO * info)
+{
+	if (info->free_ids_count > 0)
+	{
+		info->recycled++;
+		return info->free_ids[--info->free_ids_count];
+	}
+	return info->file_id_sequence++;
+}
+
+static void
+disk_file_free_id(DISK_DEVICE_INFO * info, uint32 file_id)
+{
+	if (info->free_ids_count == info->free_ids_size)
+	{
+		info->free_ids_size = (info->free_ids_size ? info->free_ids_size * 2 : 64);
+		info->free_ids = (uint32 *) realloc(info->free_ids, info->free_ids_size * sizeof(uint32));
+	}
+	info->free_ids[info->free_ids_count++] = file_id;
+}
+
 static FILE_INFO *
 disk_get_file_info(DEVICE * dev, uint32 file_id)
 {
 	DISK_DEVICE_INFO * info;
-	FILE_INFO * curr;
+	FILE_INFO * finfo;
+	int index;
 
 	info = (DISK_DEVICE_INFO *) dev->info;
-	for (curr = info->head; curr; curr = curr->next)
+	pthread_mutex_lock(info->mutex);
+	index = disk_file_find(info, file_id);
+	finfo = (index < 0 ? NULL : info->files[index]);
+	pthread_mutex_unlock(info->mutex);
+	return finfo;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* queued records beyond this make the client rescan the directory */
+#define DISK_NOTIFY_MAX_BYTES 4096
+
+#define DISK_NOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* called with info->mutex held
+   appends a FILE_NOTIFY_INFORMATION record, a file that is written to
+   many times between two requests is reported modified once */
+static void
+disk_notify_record(FILE_INFO * finfo, uint32 action, const char * name)
+{
+	char wname[512];
+	int wlen;
+	int size;
+	int offset;
+
+	if (finfo->notify_overflow)
+		return;
+	wlen = freerdp_set_wstr(wname, sizeof(wname), (char *) name, strlen(name));
+	if (action == FILE_ACTION_MODIFIED)
+	{
+		for (offset = 0; offset < finfo->notify_len; offset += GET_UINT32(finfo->notify_buf, offset))
+		{
+			if (GET_UINT32(finfo->notify_buf, offset + 4) == action &&
+				GET_UINT32(finfo->notify_buf, offset + 8) == wlen &&
+				memcmp(finfo->notify_buf + offset + 12, wname, wlen) == 0)
+			{
+				return;
+			}
+		}
+	}
+	/* records are 4 byte aligned */
+	size = (12 + wlen + 3) & ~3;
+	if (finfo->notify_len + size > DISK_NOTIFY_MAX_BYTES)
+	{
+		LLOGLN(10, ("disk_notify_record: overflow %s", finfo->fullpath));
+		free(finfo->notify_buf);
+		finfo->notify_buf = NULL;
+		finfo->notify_len = 0;
+		finfo->notify_overflow = 1;
+		return;
+	}
+	if (finfo->notify_buf == NULL)
+		finfo->notify_buf = (char *) malloc(DISK_NOTIFY_MAX_BYTES);
+	offset = finfo->notify_len;
+	memset(finfo->notify_buf + offset, 0, size);
+	SET_UINT32(finfo->notify_buf, offset, size); /* NextEntryOffset */
+	SET_UINT32(finfo->notify_buf, offset + 4, action); /* Action */
+	SET_UINT32(finfo->notify_buf, offset + 8, wlen); /* FileNameLength */
+	memcpy(finfo->notify_buf + offset + 12, wname, wlen); /* FileName */
+	finfo->notify_last = offset;
+	finfo->notify_len += size;
+}
+
+/* called with info->mutex held
+   hands the queued records to irp, returns the status to complete it with */
+static uint32
+disk_notify_fill(FILE_INFO * finfo, IRP * irp)
+{
+	uint32 status;
+
+	if (finfo->notify_overflow)
+	{
+		status = RD_STATUS_NOTIFY_ENUM_DIR;
+		irp->outputBuffer = NULL;
+		irp->outputBufferLength = 0;
+	}
+	else
+	{
+		status = RD_STATUS_SUCCESS;
+		SET_UINT32(finfo->notify_buf, finfo->notify_last, 0); /* NextEntryOffset */
+		irp->outputBuffer = finfo->notify_buf;
+		irp->outputBufferLength = finfo->notify_len;
+	}
+	irp->outputResult = irp->outputBufferLength;
+	finfo->notify_buf = NULL;
+	finfo->notify_len = 0;
+	finfo->notify_overflow = 0;
+	return status;
+}
+
+/* called with info->mutex held
+   passes one change to every handle watching wd that asked for it */
+static void
+disk_notify_deliver(DISK_DEVICE_INFO * info, int wd, uint32 action, uint32 filter,
+	const char * name)
+{
+	FILE_INFO * finfo;
+	int index;
+
+	for (index = 0; index < info->files_size; index++)
 	{
-		if (curr->file_id == file_id)
+		finfo = info->files[index];
+		if (finfo == NULL || finfo->watch < 0 || (wd >= 0 && finfo->watch != wd))
+			continue;
+		if (action == 0)
 		{
-			return curr;
+			/* queue overflow or the directory itself went away */
+			finfo->notify_overflow = 1;
+			if (finfo->notify_buf)
+				free(finfo->notify_buf);
+			finfo->notify_buf = NULL;
+			finfo->notify_len = 0;
+		}
+		else if (finfo->notify_filter & filter)
+		{
+			disk_notify_record(finfo, action, name);
 		}
 	}
-	return NULL;
 }
 
 static void
-disk_remove_file(DEVICE * dev, uint32 file_id)
+disk_notify_event(DISK_DEVICE_INFO * info, struct inotify_event * ev, uint32 action)
+{
+	uint32 filter;
+
+	filter = ((ev->mask & IN_ISDIR) ? FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME);
+	if (ev->mask & IN_MODIFY)
+		filter = FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+	else if (ev->mask & IN_ATTRIB)
+		filter = FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY |
+			FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION;
+	disk_notify_deliver(info, ev->wd, action, filter, (ev->len > 0 ? ev->name : ""));
+}
+
+/* called with info->mutex held
+   detaches the pending IRPs that have something to report */
+static int
+disk_notify_take_ready(DISK_DEVICE_INFO * info, IRP ** ready, int max)
+{
+	FILE_INFO * finfo;
+	int index;
+	int count;
+
+	count = 0;
+	for (index = 0; index < info->files_size && count < max; index++)
+	{
+		finfo = info->files[index];
+		if (finfo && finfo->notify_irp && (finfo->notify_len > 0 || finfo->notify_overflow))
+		{
+			finfo->notify_irp->ioStatus = disk_notify_fill(finfo, finfo->notify_irp);
+			ready[count++] = finfo->notify_irp;
+			finfo->notify_irp = NULL;
+		}
+	}
+	return count;
+}
+
+static void *
+disk_notify_thread_func(void * arg)
 {
 	DISK_DEVICE_INFO * info;
-	FILE_INFO * curr;
-	FILE_INFO * prev;
+	union
+	{
+		struct inotify_event ev;
+		char data[8192];
+	} buf;
+	struct inotify_event * ev;
+	struct inotify_event * moved_from;
+	struct pollfd pfd[2];
+	IRP * ready[64];
+	int count;
+	int index;
+	ssize_t len;
+	char * p;
 
-	info = (DISK_DEVICE_INFO *) dev->info;
-	for (prev = NULL, curr = info->head; curr; prev = curr, curr = curr->next)
+	info = (DISK_DEVICE_INFO *) arg;
+	LLOGLN(10, ("disk_notify_thread_func: in"));
+
+	while (1)
 	{
-		if (curr->file_id == file_id)
+		pfd[0].fd = info->notify_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = info->notify_pipe[0];
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0)
 		{
-			LLOGLN(10, ("disk_remove_file: id=%d", curr->file_id));
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents)
+		{
+			break;
+		}
+		len = read(info->notify_fd, buf.data, sizeof(buf.data));
+		if (len <= 0)
+		{
+			if (len < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			break;
+		}
 
-			if (curr->file != -1)
-				close(curr->file);
-			if (curr->dir)
-				closedir(curr->dir);
-			if (curr->delete_pending)
+		pthread_mutex_lock(info->mutex);
+		/* a rename inside the directory is a MOVED_FROM directly
+		   followed by a MOVED_TO with the same cookie */
+		moved_from = NULL;
+		for (p = buf.data; p < buf.data + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (struct inotify_event *) p;
+			if (moved_from && !((ev->mask & IN_MOVED_TO) && ev->cookie == moved_from->cookie &&
+				ev->wd == moved_from->wd))
+			{
+				disk_notify_event(info, moved_from, FILE_ACTION_REMOVED);
+				moved_from = NULL;
+			}
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				LLOGLN(0, ("disk_notify_thread_func: inotify queue overflow"));
+				disk_notify_deliver(info, -1, 0, 0, NULL);
+			}
+			else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
 			{
-				if (curr->is_dir)
+				disk_notify_deliver(info, ev->wd, 0, 0, NULL);
+			}
+			else if (ev->mask & IN_MOVED_FROM)
+			{
+				moved_from = ev;
+			}
+			else if (ev->mask & IN_MOVED_TO)
+			{
+				if (moved_from)
 				{
-					/* TODO: this should delete files recursively */
-					rmdir(curr->fullpath);
+					disk_notify_event(info, moved_from, FILE_ACTION_RENAMED_OLD_NAME);
+					disk_notify_event(info, ev, FILE_ACTION_RENAMED_NEW_NAME);
+					moved_from = NULL;
 				}
 				else
 				{
-					unlink(curr->fullpath);
+					disk_notify_event(info, ev, FILE_ACTION_ADDED);
 				}
 			}
+			else if (ev->mask & IN_CREATE)
+			{
+				disk_notify_event(info, ev, FILE_ACTION_ADDED);
+			}
+			else if (ev->mask & IN_DELETE)
+			{
+				disk_notify_event(info, ev, FILE_ACTION_REMOVED);
+			}
+			else if (ev->mask & (IN_MODIFY | IN_ATTRIB))
+			{
+				disk_notify_event(info, ev, FILE_ACTION_MODIFIED);
+			}
+		}
+		if (moved_from)
+		{
+			disk_notify_event(info, moved_from, FILE_ACTION_REMOVED);
+		}
+		count = disk_notify_take_ready(info, ready, 64);
+		pthread_mutex_unlock(info->mutex);
 
-			if (curr->fullpath)
-				free(curr->fullpath);
-			if (curr->pattern)
-				free(curr->pattern);
+		/* completing writes to the channel, keep the device unlocked */
+		for (index = 0; index < count; index++)
+		{
+			ready[index]->complete(ready[index]);
+			free(ready[index]);
+		}
+	}
 
-			if (prev == NULL)
-				info->head = curr->next;
-			else
-				prev->next  = curr->next;
+	LLOGLN(10, ("disk_notify_thread_func: out"));
+	info->notify_thread_status = -1;
+	return 0;
+}
 
-			free(curr);
-			break;
+/* called with info->mutex held */
+static int
+disk_notify_start(DISK_DEVICE_INFO * info)
+{
+	pthread_t thread;
+
+	if (info->notify_fd >= 0)
+		return 0;
+	info->notify_fd = inotify_init();
+	if (info->notify_fd < 0)
+	{
+		LLOGLN(0, ("disk_notify_start: inotify_init failed (%i)", errno));
+		return -1;
+	}
+	if (pipe(info->notify_pipe) != 0)
+	{
+		close(info->notify_fd);
+		info->notify_fd = -1;
+		return -1;
+	}
+	info->notify_thread_status = 1;
+	pthread_create(&thread, 0, disk_notify_thread_func, info);
+	pthread_detach(thread);
+	return 0;
+}
+
+static void
+disk_notify_stop(DISK_DEVICE_INFO * info)
+{
+	int index;
+
+	if (info->notify_fd < 0)
+		return;
+	if (write(info->notify_pipe[1], "", 1) != 1)
+		LLOGLN(0, ("disk_notify_stop: write failed"));
+	index = 0;
+	while ((info->notify_thread_status > 0) && (index < 100))
+	{
+		index++;
+		usleep(250 * 1000);
+	}
+	close(info->notify_fd);
+	close(info->notify_pipe[0]);
+	close(info->notify_pipe[1]);
+	info->notify_fd = -1;
+}
+
+/* called with info->mutex held */
+static void
+disk_notify_remove_watch(DISK_DEVICE_INFO * info, FILE_INFO * finfo)
+{
+	int index;
+
+	if (finfo->watch < 0)
+		return;
+	/* watching the same directory twice gives the same descriptor */
+	for (index = 0; index < info->files_size; index++)
+	{
+		if (info->files[index] && info->files[index] != finfo &&
+			info->files[index]->watch == finfo->watch)
+		{
+			return;
+		}
+	}
+	inotify_rm_watch(info->notify_fd, finfo->watch);
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static int
+disk_remove_file(DEVICE * dev, uint32 file_id)
+{
+	DISK_DEVICE_INFO * info;
+	FILE_INFO * curr;
+	int index;
+
+	info = (DISK_DEVICE_INFO *) dev->info;
+	pthread_mutex_lock(info->mutex);
+	index = disk_file_find(info, file_id);
+	if (index < 0)
+	{
+		curr = NULL;
+	}
+	else
+	{
+		curr = info->files[index];
+		disk_file_delete(info, index);
+#ifdef HAVE_SYS_INOTIFY_H
+		disk_notify_remove_watch(info, curr);
+#endif
+	}
+	pthread_mutex_unlock(info->mutex);
+
+	if (curr)
+	{
+		LLOGLN(10, ("disk_remove_file: id=%d", curr->file_id));
+
+		if (curr->notify_irp)
+		{
+			curr->notify_irp->ioStatus = RD_STATUS_CANCELLED;
+			curr->notify_irp->complete(curr->notify_irp);
+			free(curr->notify_irp);
+		}
+		if (curr->notify_buf)
+			free(curr->notify_buf);
+
+		if (curr->file != -1)
+			close(curr->file);
+		if (curr->dir)
+			closedir(curr->dir);
+		if (curr->delete_pending)
+		{
+			if (curr->is_dir)
+			{
+				/* TODO: this should delete files recursively */
+				rmdir(curr->fullpath);
+			}
+			else
+			{
+				unlink(curr->fullpath);
+			}
 		}
+
+		if (curr->fullpath)
+			free(curr->fullpath);
+		if (curr->pattern)
+			free(curr->pattern);
+		disk_free_dir_snapshot(curr);
+
+		free(curr);
 	}
+	return (curr != NULL);
 }
 
 static uint32
@@ -406,6 +1017,7 @@ disk_create(IRP * irp, const char * path)
 	finfo = (FILE_INFO *) malloc(sizeof(FILE_INFO));
 	memset(finfo, 0, sizeof(FILE_INFO));
 	finfo->file = -1;
+	finfo->watch = -1;
 
 	fullpath = disk_get_fullpath(irp->dev, path);
 	status = disk_create_fullpath(irp, finfo, fullpath);
@@ -413,9 +1025,11 @@ disk_create(IRP * irp, const char * path)
 	if (status == RD_STATUS_SUCCESS)
 	{
 		finfo->fullpath = fullpath;
-		finfo->file_id = info->devman->id_sequence++;
-		finfo->next = info->head;
-		info->head = finfo;
+		pthread_mutex_lock(info->mutex);
+		finfo->file_id = disk_file_new_id(info);
+		disk_file_insert(info, finfo);
+		info->opened++;
+		pthread_mutex_unlock(info->mutex);
 
 		irp->fileID = finfo->file_id;
 		LLOGLN(10, ("disk_create: %s (id=%d)", path, finfo->file_id));
@@ -433,15 +1047,35 @@ static uint32
 disk_close(IRP * irp)
 {
 	LLOGLN(10, ("disk_close: id=%d", irp->fileID));
-	disk_remove_file(irp->dev, irp->fileID);
+	if (!disk_remove_file(irp->dev, irp->fileID))
+		return RD_STATUS_INVALID_HANDLE;
 	return RD_STATUS_SUCCESS;
 }
 
+/* called once the close completion is on the channel, the id only goes
+   back on the free list now so a create can not hand it out and complete
+   before the server has seen the close */
+static void
+disk_closed(IRP * irp)
+{
+	DISK_DEVICE_INFO * info;
+
+	if (irp->ioStatus != RD_STATUS_SUCCESS)
+		return;
+	info = (DISK_DEVICE_INFO *) irp->dev->info;
+	pthread_mutex_lock(info->mutex);
+	disk_file_free_id(info, irp->fileID);
+	pthread_mutex_unlock(info->mutex);
+}
+
 static uint32
 disk_read(IRP * irp)
 {
 	FILE_INFO * finfo;
+	char * pdu;
 	char * buf;
+	uint32 len;
+	uint32 length;
 	ssize_t r;
 
 	LLOGLN(10, ("disk_read: id=%d len=%d off=%lld", irp->fileID, irp->length, irp->offset));
@@ -456,23 +1090,34 @@ disk_read(IRP * irp)
 	if (finfo->file == -1)
 		return RD_STATUS_INVALID_HANDLE;
 
-	if (lseek(finfo->file, irp->offset, SEEK_SET) == (off_t) - 1)
-		return get_error_status();
-
-	buf = malloc(irp->length);
-	memset(buf, 0, irp->length);
-	r = read(finfo->file, buf, irp->length);
-	if (r == -1)
-	{
-		free(buf);
-		return get_error_status();
-	}
-	else
+	/* read straight into the completion PDU, pread leaves the file
+	   position alone so IRPs for other files never race on it */
+	length = irp->length;
+	if (length > DISK_READ_MAX_LENGTH)
+		length = DISK_READ_MAX_LENGTH;
+	pdu = malloc(IRP_COMPLETION_HEADER_LENGTH + length);
+	if (pdu == NULL)
+		return RD_STATUS_NO_MEMORY;
+	buf = pdu + IRP_COMPLETION_HEADER_LENGTH;
+	len = 0;
+	while (len < length)
 	{
-		irp->outputBuffer = buf;
-		irp->outputBufferLength = r;
-		return RD_STATUS_SUCCESS;
+		r = pread(finfo->file, buf + len, length - len, irp->offset + len);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			free(pdu);
+			return get_error_status();
+		}
+		if (r == 0)
+			break;
+		len += r;
 	}
+	irp->outputPdu = pdu;
+	irp->outputBuffer = buf;
+	irp->outputBufferLength = len;
+	return RD_STATUS_SUCCESS;
 }
 
 static uint32
@@ -494,19 +1139,21 @@ disk_write(IRP * irp)
 	if (finfo->file == -1)
 		return RD_STATUS_INVALID_HANDLE;
 
-	if (lseek(finfo->file, irp->offset, SEEK_SET) == (off_t) - 1)
-		return get_error_status();
-
+	/* inputBuffer points into the request PDU */
 	len = 0;
 	while (len < irp->inputBufferLength)
 	{
-		r = write(finfo->file, irp->inputBuffer, irp->inputBufferLength);
+		r = pwrite(finfo->file, irp->inputBuffer + len, irp->inputBufferLength - len,
+			irp->offset + len);
 		if (r == -1)
 		{
+			if (errno == EINTR)
+				continue;
 			return get_error_status();
 		}
 		len += r;
 	}
+	finfo->stat_time = 0;
 	return RD_STATUS_SUCCESS;
 }
 
@@ -623,6 +1270,7 @@ disk_query_info(IRP * irp)
 		LLOGLN(0, ("disk_query_info: invalid file id"));
 		return RD_STATUS_INVALID_HANDLE;
 	}
+	disk_update_file_stat(finfo);
 
 	size = 256;
 	buf = malloc(size);
@@ -694,6 +1342,8 @@ disk_set_info(IRP * irp)
 	}
 
 	status = RD_STATUS_SUCCESS;
+	/* times, mode, size or name may change */
+	finfo->stat_time = 0;
 
 	switch (irp->infoClass)
 	{
@@ -778,7 +1428,8 @@ disk_query_directory(IRP * irp, uint8 initialQuery, const char * path)
 	char * buf;
 	int size;
 	int len;
-	struct dirent * pdirent;
+	DIR_ENTRY * entry;
+	char * name;
 	struct stat file_stat;
 	uint32 attr;
 
@@ -800,36 +1451,42 @@ disk_query_directory(IRP * irp, uint8 initialQuery, const char * path)
 		p = (p ? p + 1 : (char *)path);
 		finfo->pattern = malloc(strlen(p) + 1);
 		strcpy(finfo->pattern, p);
-		rewinddir(finfo->dir);
+		disk_take_dir_snapshot(finfo);
+	}
+	else if (finfo->entries == NULL)
+	{
+		disk_take_dir_snapshot(finfo);
 	}
 
 	status = RD_STATUS_SUCCESS;
 	buf = NULL;
 	size = 0;
 
-	pdirent = readdir(finfo->dir);
-	while (pdirent && finfo->pattern[0] && fnmatch(finfo->pattern, pdirent->d_name, 0) != 0)
-		pdirent = readdir(finfo->dir);
-	if (pdirent == NULL)
+	if (finfo->entry_index >= finfo->entry_count)
 	{
 		return RD_STATUS_NO_MORE_FILES;
-	}		
+	}
+	entry = &finfo->entries[finfo->entry_index++];
+	name = finfo->entry_names + entry->name;
 
+	/* relative to the open directory, no full path to build */
 	memset(&file_stat, 0, sizeof(struct stat));
-	p = malloc(strlen(finfo->fullpath) + strlen(pdirent->d_name) + 2);
-	sprintf(p, "%s/%s", finfo->fullpath, pdirent->d_name);
-	if (stat(p, &file_stat) != 0)
+	if (fstatat(dirfd(finfo->dir), name, &file_stat, 0) != 0 &&
+		fstatat(dirfd(finfo->dir), name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0)
 	{
-		LLOGLN(0, ("disk_query_directory: stat %s failed (%i)\n", p, errno));
+		LLOGLN(0, ("disk_query_directory: stat %s/%s failed (%i)", finfo->fullpath, name, errno));
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (entry->type == DT_DIR)
+			file_stat.st_mode = S_IFDIR;
+#endif
 	}
-	free(p);
 
-	attr = get_file_attribute(pdirent->d_name, &file_stat);
+	attr = get_file_attribute(name, &file_stat);
 
 	switch (irp->infoClass)
 	{
 		case FileBothDirectoryInformation:
-			size = 93 + strlen(pdirent->d_name) * 2;
+			size = 93 + strlen(name) * 2;
 			buf = malloc(size);
 			memset(buf, 0, size);
 
@@ -848,13 +1505,13 @@ disk_query_directory(IRP * irp, uint8 initialQuery, const char * path)
 			/* [MS-FSCC] has one byte padding here but RDP does not! */
 			//SET_UINT8(buf, 69, 0); /* Reserved */
 			/* ShortName 24  bytes */
-			len = freerdp_set_wstr(buf + 93, size - 93, pdirent->d_name, strlen(pdirent->d_name));
+			len = freerdp_set_wstr(buf + 93, size - 93, name, strlen(name));
 			SET_UINT32(buf, 60, len); /* FileNameLength */
 			size = 93 + len;
 			break;
 
 		case FileFullDirectoryInformation:
-			size = 68 + strlen(pdirent->d_name) * 2;
+			size = 68 + strlen(name) * 2;
 			buf = malloc(size);
 			memset(buf, 0, size);
 
@@ -869,7 +1526,7 @@ disk_query_directory(IRP * irp, uint8 initialQuery, const char * path)
 			SET_UINT64(buf, 48, file_stat.st_size); /* AllocationSize */
 			SET_UINT32(buf, 56, attr); /* FileAttributes */
 			SET_UINT32(buf, 64, 0); /* EaSize */
-			len = freerdp_set_wstr(buf + 68, size - 68, pdirent->d_name, strlen(pdirent->d_name));
+			len = freerdp_set_wstr(buf + 68, size - 68, name, strlen(name));
 			SET_UINT32(buf, 60, len); /* FileNameLength */
 			size = 68 + len;
 			break;
@@ -889,6 +1546,61 @@ disk_query_directory(IRP * irp, uint8 initialQuery, const char * path)
 static uint32
 disk_notify_change_directory(IRP * irp)
 {
+#ifdef HAVE_SYS_INOTIFY_H
+	DISK_DEVICE_INFO * info;
+	FILE_INFO * finfo;
+	IRP * old_irp;
+	uint32 status;
+
+	LLOGLN(10, ("disk_notify_change_directory: id=%d filter=%X tree=%d", irp->fileID,
+		irp->completionFilter, irp->watchTree));
+	finfo = disk_get_file_info(irp->dev, irp->fileID);
+	if (finfo == NULL)
+	{
+		LLOGLN(0, ("disk_notify_change_directory: invalid file id"));
+		return RD_STATUS_INVALID_HANDLE;
+	}
+	if (finfo->dir == NULL)
+		return RD_STATUS_INVALID_PARAMETER;
+	info = (DISK_DEVICE_INFO *) irp->dev->info;
+
+	pthread_mutex_lock(info->mutex);
+	if (finfo->watch < 0)
+	{
+		/* watchTree is not honoured, inotify watches one directory level */
+		if (disk_notify_start(info) == 0)
+			finfo->watch = inotify_add_watch(info->notify_fd, finfo->fullpath, DISK_NOTIFY_MASK);
+		if (finfo->watch < 0)
+		{
+			pthread_mutex_unlock(info->mutex);
+			/* nothing would ever complete a stored IRP, fail it now */
+			LLOGLN(0, ("disk_notify_change_directory: can not watch %s", finfo->fullpath));
+			return RD_STATUS_NOT_SUPPORTED;
+		}
+	}
+	finfo->notify_filter = irp->completionFilter;
+
+	/* changes since the last request are answered right away */
+	if (finfo->notify_len > 0 || finfo->notify_overflow)
+	{
+		status = disk_notify_fill(finfo, irp);
+		pthread_mutex_unlock(info->mutex);
+		return status;
+	}
+	old_irp = finfo->notify_irp;
+	finfo->notify_irp = (IRP *) malloc(sizeof(IRP));
+	memcpy(finfo->notify_irp, irp, sizeof(IRP));
+	finfo->notify_irp->inputBuffer = NULL;
+	finfo->notify_irp->inputBufferLength = 0;
+	pthread_mutex_unlock(info->mutex);
+
+	if (old_irp)
+	{
+		old_irp->ioStatus = RD_STATUS_CANCELLED;
+		old_irp->complete(old_irp);
+		free(old_irp);
+	}
+#endif
 	return RD_STATUS_PENDING;
 }
 
@@ -902,13 +1614,46 @@ static uint32
 disk_free(DEVICE * dev)
 {
 	DISK_DEVICE_INFO * info;
+	int index;
 
 	LLOGLN(10, ("disk_free"));
 	info = (DISK_DEVICE_INFO *) dev->info;
-	while (info->head)
+	/* handle statistics, once per session for a drive that was used */
+	if (info->opened > 0)
+	{
+		LLOGLN(0, ("disk_free: %s opened %u peak %d recycled %u lookups %u probes %u",
+			dev->name, info->opened, info->peak_files, info->recycled,
+			info->lookups, info->probes));
+	}
+#ifdef HAVE_SYS_INOTIFY_H
+	disk_notify_stop(info);
+#endif
+	/* the channel is going away, pending IRPs are dropped */
+	for (index = 0; index < info->files_size; index++)
+	{
+		if (info->files[index] && info->files[index]->notify_irp)
+		{
+			free(info->files[index]->notify_irp);
+			info->files[index]->notify_irp = NULL;
+		}
+	}
+	/* deleting shifts entries back, possibly across the end of the table */
+	while (info->files_count > 0)
 	{
-		disk_remove_file(dev, info->head->file_id);
+		for (index = 0; index < info->files_size; index++)
+		{
+			while (info->files[index])
+			{
+				disk_remove_file(dev, info->files[index]->file_id);
+			}
+		}
 	}
+	if (info->files)
+		free(info->files);
+	if (info->free_ids)
+		free(info->free_ids);
+	pthread_mutex_destroy(info->mutex);
+	free(info->mutex);
 	free(info);
 	if (dev->data)
 	{
@@ -927,6 +1672,7 @@ disk_register_service(PDEVMAN pDevman, PDEVMAN_ENTRY_POINTS pEntryPoints)
 
 	srv->create = disk_create;
 	srv->close = disk_close;
+	srv->closed = disk_closed;
 	srv->read = disk_read;
 	srv->write = disk_write;
 	srv->control = disk_control;
@@ -967,6 +1713,10 @@ DeviceServiceEntry(PDEVMAN pDevman, PDEVMAN_ENTRY_POINTS pEntryPoints)
 			info->DevmanRegisterDevice = pEntryPoints->pDevmanRegisterDevice;
 			info->DevmanUnregisterDevice = pEntryPoints->pDevmanUnregisterDevice;
 			info->path = (char *) data->data[2];
+			info->mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+			pthread_mutex_init(info->mutex, 0);
+			info->file_id_sequence = 1;
+			info->notify_fd = -1;
 
 			dev = info->DevmanRegisterDevice(pDevman, srv, (char*)data->data[1]);
 			dev->info = info;
@@ -32,9 +32,24 @@ irp_output_device_io_completion(IRP* irp, int * data_size)
 {
 	char * data;
 
-	*data_size = 20 + irp->outputBufferLength;
-	data = malloc(*data_size);
-	memset(data, 0, *data_size);
+	*data_size = IRP_COMPLETION_HEADER_LENGTH + irp->outputBufferLength;
+	if (irp->outputPdu)
+	{
+		/* the service already put its output behind the header,
+		   the returned PDU now owns outputBuffer */
+		data = irp->outputPdu;
+		irp->outputPdu = NULL;
+		irp->outputBuffer = NULL;
+	}
+	else
+	{
+		data = malloc(*data_size);
+		memset(data, 0, *data_size);
+		if (irp->outputBufferLength > 0)
+		{
+			memcpy(data + IRP_COMPLETION_HEADER_LENGTH, irp->outputBuffer, irp->outputBufferLength);
+		}
+	}
 
 	SET_UINT16(data, 0, RDPDR_CTYP_CORE); /* component */
 	SET_UINT16(data, 2, PAKID_CORE_DEVICE_IOCOMPLETION); /* packetID */
@@ -42,10 +57,6 @@ irp_output_device_io_completion(IRP* irp, int * data_size)
 	SET_UINT32(data, 8, irp->completionID); /* completionID */
 	SET_UINT32(data, 12, irp->ioStatus); /* ioStatus */
 	SET_UINT32(data, 16, irp->outputResult);
-	if (irp->outputBufferLength > 0)
-	{
-		memcpy(data + 20, irp->outputBuffer, irp->outputBufferLength);
-	}
 	return data;
 }
 
@@ -375,6 +386,7 @@ irp_process_notify_change_directory_request(IRP* irp, char* data, int data_size)
 	else
 	{
 		irp->ioStatus = irp->dev->service->notify_change_directory(irp);
+		irp->outputResult = irp->outputBufferLength;
 	}
 }
 
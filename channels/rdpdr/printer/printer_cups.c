@@ -25,6 +25,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h>
 #include <cups/cups.h>
 #include "rdpdr_constants.h"
 #include "rdpdr_types.h"
@@ -32,12 +33,37 @@
 #include "chan_stream.h"
 #include "printer_main.h"
 
+/* bytes of a job waiting for the writer thread, printer_hw_write
+   blocks above this so a slow printer throttles the server */
+#define PRINTER_QUEUE_MAX (4 * 1024 * 1024)
+
+struct print_chunk
+{
+	struct print_chunk * next;
+	char * data;
+	int size;
+};
+
 struct _PRINTER_DEVICE_INFO
 {
 	char * printer_name;
 
 	void * printjob_object;
 	int printjob_id;
+#ifndef _CUPS_API_1_4
+	FILE * printjob_file; /* spool file, open for the whole job */
+#endif
+
+	/* the writer thread hands job data to CUPS, mutex protects
+	   everything below */
+	pthread_mutex_t * mutex;
+	pthread_cond_t * cond;
+	struct print_chunk * head;
+	struct print_chunk * tail;
+	int queued; /* bytes in the queue */
+	int writer_running; /* boolean */
+	int closing; /* boolean, no more data for this job */
+	int error; /* boolean, the job could not be written */
 };
 typedef struct _PRINTER_DEVICE_INFO PRINTER_DEVICE_INFO;
 
@@ -71,6 +97,10 @@ printer_hw_new(const char * name)
 	memset(info, 0, sizeof(PRINTER_DEVICE_INFO));
 
 	info->printer_name = strdup(name);
+	info->mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(info->mutex, 0);
+	info->cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(info->cond, 0);
 
 #ifndef _CUPS_API_1_4
 	LLOGLN(0, ("printer_hw_new: use CUPS API 1.2"));
@@ -92,6 +122,108 @@ printer_hw_get_printjob_name(char * buf, int size)
 		t->tm_hour, t->tm_min, t->tm_sec);
 }
 
+/* returns 0 on success */
+static int
+printer_hw_write_chunk(PRINTER_DEVICE_INFO * info, const char * data, int size)
+{
+#ifndef _CUPS_API_1_4
+	if (fwrite(data, 1, size, info->printjob_file) < size)
+	{
+		LLOGLN(0, ("printer_hw_write_chunk: failed to write file %s", (char *) info->printjob_object));
+		return 1;
+	}
+#else
+	if (cupsWriteRequestData((http_t *) info->printjob_object, data, size) != HTTP_CONTINUE)
+	{
+		LLOGLN(0, ("printer_hw_write_chunk: cupsWriteRequestData: %s", cupsLastErrorString()));
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+static void *
+printer_hw_writer_func(void * arg)
+{
+	PRINTER_DEVICE_INFO * info;
+	struct print_chunk * chunk;
+	int error;
+
+	info = (PRINTER_DEVICE_INFO *) arg;
+	LLOGLN(10, ("printer_hw_writer_func: in"));
+
+	pthread_mutex_lock(info->mutex);
+	while (1)
+	{
+		if (info->head == NULL)
+		{
+			if (info->closing)
+				break;
+			pthread_cond_wait(info->cond, info->mutex);
+			continue;
+		}
+		chunk = info->head;
+		info->head = chunk->next;
+		if (info->head == NULL)
+			info->tail = NULL;
+		error = info->error;
+		pthread_mutex_unlock(info->mutex);
+
+		/* after an error the rest of the job is only drained */
+		if (!error)
+			error = printer_hw_write_chunk(info, chunk->data, chunk->size);
+
+		pthread_mutex_lock(info->mutex);
+		info->queued -= chunk->size;
+		if (error)
+			info->error = 1;
+		free(chunk);
+		pthread_cond_broadcast(info->cond);
+	}
+	info->writer_running = 0;
+	pthread_cond_broadcast(info->cond);
+	pthread_mutex_unlock(info->mutex);
+
+	LLOGLN(10, ("printer_hw_writer_func: out"));
+	return 0;
+}
+
+/* returns boolean, 1 if the whole job was written */
+static int
+printer_hw_writer_finish(PRINTER_DEVICE_INFO * info)
+{
+	int error;
+
+	pthread_mutex_lock(info->mutex);
+	info->closing = 1;
+	pthread_cond_broadcast(info->cond);
+	while (info->writer_running)
+		pthread_cond_wait(info->cond, info->mutex);
+	error = info->error;
+	pthread_mutex_unlock(info->mutex);
+	return !error;
+}
+
+static int
+printer_hw_writer_start(PRINTER_DEVICE_INFO * info)
+{
+	pthread_t thread;
+
+	info->head = NULL;
+	info->tail = NULL;
+	info->queued = 0;
+	info->closing = 0;
+	info->error = 0;
+	info->writer_running = 1;
+	if (pthread_create(&thread, 0, printer_hw_writer_func, info) != 0)
+	{
+		info->writer_running = 0;
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
 uint32
 printer_hw_create(IRP * irp, const char * path)
 {
@@ -108,8 +240,20 @@ printer_hw_create(IRP * irp, const char * path)
 
 #ifndef _CUPS_API_1_4
 
-	info->printjob_id++;
-	info->printjob_object = strdup(tmpnam(NULL));
+	{
+		char buf[] = "/tmp/freerdp-printjob-XXXXXX";
+		int fd;
+
+		fd = mkstemp(buf);
+		if (fd == -1)
+		{
+			LLOGLN(0, ("printer_hw_create: mkstemp failed"));
+			return RD_STATUS_DEVICE_BUSY;
+		}
+		info->printjob_file = fdopen(fd, "wb");
+		info->printjob_id++;
+		info->printjob_object = strdup(buf);
+	}
 
 #else
 	{
@@ -142,6 +286,12 @@ printer_hw_create(IRP * irp, const char * path)
 
 #endif
 
+	if (printer_hw_writer_start(info) != 0)
+	{
+		LLOGLN(0, ("printer_hw_create: pthread_create failed"));
+		info->error = 1;
+	}
+
 	LLOGLN(10, ("printe_hw_create: %s id=%d", info->printer_name, info->printjob_id));
 	irp->fileID = info->printjob_id;
 
@@ -152,6 +302,7 @@ uint32
 printer_hw_close(IRP * irp)
 {
 	PRINTER_DEVICE_INFO * info;
+	int ok;
 
 	info = (PRINTER_DEVICE_INFO *) irp->dev->info;
 	LLOGLN(10, ("printe_hw_close: %s id=%d", info->printer_name, irp->fileID));
@@ -162,13 +313,18 @@ printer_hw_close(IRP * irp)
 		return RD_STATUS_INVALID_HANDLE;
 	}
 
+	/* wait until everything queued has reached CUPS */
+	ok = printer_hw_writer_finish(info);
+
 #ifndef _CUPS_API_1_4
 
 	{
 		char buf[100];
 
+		fclose(info->printjob_file);
+		info->printjob_file = NULL;
 		printer_hw_get_printjob_name(buf, sizeof(buf));
-		if (cupsPrintFile(info->printer_name, (const char *) info->printjob_object, buf, 0, NULL) == 0)
+		if (ok && cupsPrintFile(info->printer_name, (const char *) info->printjob_object, buf, 0, NULL) == 0)
 		{
 			LLOGLN(0, ("printer_hw_close: cupsPrintFile: %s", cupsLastErrorString()));
 		}
@@ -178,7 +334,10 @@ printer_hw_close(IRP * irp)
 
 #else
 
-	cupsFinishDocument((http_t *) info->printjob_object, info->printer_name);
+	if (ok)
+		cupsFinishDocument((http_t *) info->printjob_object, info->printer_name);
+	else
+		cupsCancelJob(info->printer_name, info->printjob_id);
 	info->printjob_id = 0;
 	httpClose((http_t *) info->printjob_object);
 
@@ -193,6 +352,7 @@ uint32
 printer_hw_write(IRP * irp)
 {
 	PRINTER_DEVICE_INFO * info;
+	struct print_chunk * chunk;
 
 	info = (PRINTER_DEVICE_INFO *) irp->dev->info;
 	LLOGLN(10, ("printe_hw_write: %s id=%d len=%d off=%lld", info->printer_name,
@@ -203,31 +363,38 @@ printer_hw_write(IRP * irp)
 		return RD_STATUS_INVALID_HANDLE;
 	}
 
-#ifndef _CUPS_API_1_4
-
+	if (irp->inputBufferLength <= 0)
 	{
-		FILE * fp;
-
-		fp = fopen((const char *) info->printjob_object, "a+b");
-		if (fp == NULL)
-		{
-			LLOGLN(0, ("printer_hw_write: failed to open file %s", (char *) info->printjob_object));
-			return RD_STATUS_DEVICE_BUSY;
-		}
-		if (fwrite(irp->inputBuffer, 1, irp->inputBufferLength, fp) < irp->inputBufferLength)
-		{
-			fclose(fp);
-			LLOGLN(0, ("printer_hw_write: failed to write file %s", (char *) info->printjob_object));
-			return RD_STATUS_DEVICE_BUSY;
-		}
-		fclose(fp);
+		return RD_STATUS_SUCCESS;
 	}
 
-#else
-
-	cupsWriteRequestData((http_t *) info->printjob_object, irp->inputBuffer, irp->inputBufferLength);
+	/* inputBuffer goes away with the IRP, the writer gets a copy */
+	chunk = (struct print_chunk *) malloc(sizeof(struct print_chunk) + irp->inputBufferLength);
+	chunk->next = NULL;
+	chunk->data = (char *) (chunk + 1);
+	chunk->size = irp->inputBufferLength;
+	memcpy(chunk->data, irp->inputBuffer, chunk->size);
 
-#endif
+	pthread_mutex_lock(info->mutex);
+	while (info->queued > 0 && info->queued + chunk->size > PRINTER_QUEUE_MAX &&
+		info->writer_running && !info->error)
+	{
+		pthread_cond_wait(info->cond, info->mutex);
+	}
+	if (info->error || !info->writer_running)
+	{
+		pthread_mutex_unlock(info->mutex);
+		free(chunk);
+		return RD_STATUS_DEVICE_BUSY;
+	}
+	if (info->tail == NULL)
+		info->head = chunk;
+	else
+		info->tail->next = chunk;
+	info->tail = chunk;
+	info->queued += chunk->size;
+	pthread_cond_broadcast(info->cond);
+	pthread_mutex_unlock(info->mutex);
 
 	return RD_STATUS_SUCCESS;
 }
@@ -246,13 +413,21 @@ printer_hw_free(void * info)
 	}
 	if (pinfo->printjob_object)
 	{
+		/* the server never closed the job */
+		printer_hw_writer_finish(pinfo);
 #ifndef _CUPS_API_1_4
+		fclose(pinfo->printjob_file);
+		unlink(pinfo->printjob_object);
 		free(pinfo->printjob_object);
 #else
 		httpClose((http_t *) pinfo->printjob_object);
 #endif
 		pinfo->printjob_object = NULL;
 	}
+	pthread_mutex_destroy(pinfo->mutex);
+	free(pinfo->mutex);
+	pthread_cond_destroy(pinfo->cond);
+	free(pinfo->cond);
 	free(pinfo);
 }
 
@@ -41,6 +41,10 @@
 #define PAKID_CORE_USER_LOGGEDON        0x554C // "LU" "UL" (U)ser (L)ogged on
 #define PAKID_PRN_USING_XPS             0x5543 // "CU" "UC" (U)sing (?)XPS
 
+/* size of DR_DEVICE_IOCOMPLETION up to and including the result field
+   (Length for read, IoStatus-dependent otherwise) */
+#define IRP_COMPLETION_HEADER_LENGTH    20
+
 /* CAPABILITY_HEADER.CapabilityType */
 #define CAP_GENERAL_TYPE     0x0001
 #define CAP_PRINTER_TYPE     0x0002
@@ -179,6 +183,7 @@
 #define RD_STATUS_INVALID_HANDLE           0xc0000008
 #define RD_STATUS_INVALID_PARAMETER        0xc000000d
 #define RD_STATUS_NO_SUCH_FILE             0xc000000f
+#define RD_STATUS_NO_MEMORY                0xc0000017
 #define RD_STATUS_INVALID_DEVICE_REQUEST   0xc0000010
 #define RD_STATUS_ACCESS_DENIED            0xc0000022
 #define RD_STATUS_OBJECT_NAME_COLLISION    0xc0000035
@@ -281,6 +286,23 @@
 #define FILE_VIRTUAL_VOLUME                 0x00000040
 #define FILE_DEVICE_SECURE_OPEN             0x00000100
 
+/* [MS-SMB2] CHANGE_NOTIFY Request.CompletionFilter */
+#define FILE_NOTIFY_CHANGE_FILE_NAME        0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME         0x00000002
+#define FILE_NOTIFY_CHANGE_ATTRIBUTES       0x00000004
+#define FILE_NOTIFY_CHANGE_SIZE             0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE       0x00000010
+#define FILE_NOTIFY_CHANGE_LAST_ACCESS      0x00000020
+#define FILE_NOTIFY_CHANGE_CREATION         0x00000040
+#define FILE_NOTIFY_CHANGE_SECURITY         0x00000100
+
+/* [MS-FSCC] FILE_NOTIFY_INFORMATION.Action */
+#define FILE_ACTION_ADDED                   0x00000001
+#define FILE_ACTION_REMOVED                 0x00000002
+#define FILE_ACTION_MODIFIED                0x00000003
+#define FILE_ACTION_RENAMED_OLD_NAME        0x00000004
+#define FILE_ACTION_RENAMED_NEW_NAME        0x00000005
+
 enum FILE_INFORMATION_CLASS
 {
 	FileDirectoryInformation = 1,
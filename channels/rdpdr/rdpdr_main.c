@@ -34,6 +34,7 @@
 #include "rdpdr_capabilities.h"
 #include "devman.h"
 #include "irp.h"
+#include "chan_pool.h"
 
 /* called by main thread
    add item to linked list and inform worker thread that there is data */
@@ -247,6 +248,33 @@ rdpdr_send_device_list_announce_request(rdpdrPlugin * plugin)
 	return 0;
 }
 
+/* send the completion of an IRP that was left pending,
+   called by services from any thread */
+static void
+rdpdr_complete_irp(IRP * irp)
+{
+	rdpdrPlugin * plugin;
+	char * out;
+	int out_size;
+	int error;
+
+	plugin = (rdpdrPlugin *) irp->plugin;
+	out = irp_output_device_io_completion(irp, &out_size);
+	error = plugin->ep.pVirtualChannelWrite(plugin->open_handle, out, out_size, out);
+	if (error != CHANNEL_RC_OK)
+	{
+		LLOGLN(0, ("rdpdr_complete_irp: "
+			"VirtualChannelWrite failed %d", error));
+	}
+	if (irp->outputPdu)
+		free(irp->outputPdu);
+	else if (irp->outputBuffer)
+		free(irp->outputBuffer);
+	irp->outputPdu = NULL;
+	irp->outputBuffer = NULL;
+	irp->outputBufferLength = 0;
+}
+
 static void
 rdpdr_process_irp(rdpdrPlugin * plugin, char* data, int data_size)
 {
@@ -259,6 +287,8 @@ rdpdr_process_irp(rdpdrPlugin * plugin, char* data, int data_size)
 	memset((void*)&irp, '\0', sizeof(IRP));
 
 	irp.ioStatus = RD_STATUS_SUCCESS;
+	irp.plugin = plugin;
+	irp.complete = rdpdr_complete_irp;
 
 	/* Device I/O Request Header */
 	deviceID = GET_UINT32(data, 0); /* deviceID */
@@ -339,10 +369,154 @@ rdpdr_process_irp(rdpdrPlugin * plugin, char* data, int data_size)
 				"VirtualChannelWrite failed %d", error));
 		}
 	}
-	if (irp.outputBuffer)
+	if (irp.majorFunction == IRP_MJ_CLOSE && irp.dev && irp.dev->service->closed)
+	{
+		irp.dev->service->closed(&irp);
+	}
+	if (irp.outputPdu)
+		free(irp.outputPdu);
+	else if (irp.outputBuffer)
 		free(irp.outputBuffer);
 }
 
+/* called with irp_mutex held
+   returns 1 if a worker is executing an IRP for the same file */
+static int
+irp_key_busy(rdpdrPlugin * plugin, struct irp_item * item)
+{
+	int index;
+
+	for (index = 0; index < RDPDR_IRP_WORKERS; index++)
+	{
+		if (plugin->irp_slots[index].used &&
+			plugin->irp_slots[index].deviceID == item->deviceID &&
+			plugin->irp_slots[index].fileID == item->fileID)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* called with irp_mutex held
+   take the oldest IRP whose file is idle, IRPs for the same file stay in
+   the order the server sent them because the older one is always found first */
+static struct irp_item *
+irp_queue_take(rdpdrPlugin * plugin, int * slot)
+{
+	struct irp_item * item;
+	struct irp_item * prev;
+	int index;
+
+	prev = 0;
+	for (item = plugin->irp_head; item != 0; prev = item, item = item->next)
+	{
+		if (irp_key_busy(plugin, item))
+		{
+			continue;
+		}
+		for (index = 0; index < RDPDR_IRP_WORKERS; index++)
+		{
+			if (!plugin->irp_slots[index].used)
+			{
+				break;
+			}
+		}
+		if (index == RDPDR_IRP_WORKERS)
+		{
+			return 0;
+		}
+		if (prev == 0)
+		{
+			plugin->irp_head = item->next;
+		}
+		else
+		{
+			prev->next = item->next;
+		}
+		if (plugin->irp_tail == item)
+		{
+			plugin->irp_tail = prev;
+		}
+		item->next = 0;
+		plugin->irp_slots[index].used = 1;
+		plugin->irp_slots[index].deviceID = item->deviceID;
+		plugin->irp_slots[index].fileID = item->fileID;
+		*slot = index;
+		return item;
+	}
+	return 0;
+}
+
+/* called by the plugin thread, takes ownership of pdu
+   the completion is sent by the worker, completionID lets the
+   server match it even if IRPs finish out of order */
+static void
+rdpdr_queue_irp(rdpdrPlugin * plugin, char * pdu, char * data, int data_size)
+{
+	struct irp_item * item;
+
+	item = (struct irp_item *) malloc(sizeof(struct irp_item));
+	item->next = 0;
+	item->pdu = pdu;
+	item->data = data;
+	item->data_size = data_size;
+	item->deviceID = GET_UINT32(data, 0); /* deviceID */
+	item->fileID = GET_UINT32(data, 4); /* fileID */
+
+	pthread_mutex_lock(plugin->irp_mutex);
+	if (plugin->irp_tail == 0)
+	{
+		plugin->irp_head = item;
+		plugin->irp_tail = item;
+	}
+	else
+	{
+		plugin->irp_tail->next = item;
+		plugin->irp_tail = item;
+	}
+	pthread_cond_signal(plugin->irp_cond);
+	pthread_mutex_unlock(plugin->irp_mutex);
+}
+
+static void *
+irp_worker_func(void * arg)
+{
+	rdpdrPlugin * plugin;
+	struct irp_item * item;
+	int slot;
+
+	plugin = (rdpdrPlugin *) arg;
+
+	LLOGLN(10, ("irp_worker_func: in"));
+
+	pthread_mutex_lock(plugin->irp_mutex);
+	while (!plugin->irp_term)
+	{
+		item = irp_queue_take(plugin, &slot);
+		if (item == 0)
+		{
+			pthread_cond_wait(plugin->irp_cond, plugin->irp_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(plugin->irp_mutex);
+
+		rdpdr_process_irp(plugin, item->data, item->data_size);
+		chan_pool_free(item->pdu);
+		free(item);
+
+		pthread_mutex_lock(plugin->irp_mutex);
+		plugin->irp_slots[slot].used = 0;
+		/* the next IRP for this file may be waiting */
+		pthread_cond_broadcast(plugin->irp_cond);
+	}
+	plugin->irp_workers--;
+	pthread_mutex_unlock(plugin->irp_mutex);
+
+	LLOGLN(10, ("irp_worker_func: out"));
+	return 0;
+}
+
 static int
 rdpdr_send_capabilities(rdpdrPlugin * plugin)
 {
@@ -403,6 +577,7 @@ rdpdr_process_prn(rdpdrPlugin * plugin, int type, char * data, int data_size)
 	srv->process_data(srv, type, data, data_size);
 }
 
+/* returns 1 if data was handed over to the IRP workers */
 static int
 thread_process_message(rdpdrPlugin * plugin, char * data, int data_size)
 {
@@ -457,8 +632,8 @@ thread_process_message(rdpdrPlugin * plugin, char * data, int data_size)
 
 			case PAKID_CORE_DEVICE_IOREQUEST:
 				LLOGLN(10, ("PAKID_CORE_DEVICE_IOREQUEST"));
-				rdpdr_process_irp(plugin, &data[4], data_size - 4);
-				break;
+				rdpdr_queue_irp(plugin, data, &data[4], data_size - 4);
+				return 1;
 
 			default:
 				LLOGLN(0, ("unknown packetID: 0x%02X", packetID));
@@ -515,8 +690,10 @@ thread_process_data(rdpdrPlugin * plugin)
 		pthread_mutex_unlock(plugin->mutex);
 		if (data != 0)
 		{
-			thread_process_message(plugin, data, data_size);
-			free(data);
+			if (thread_process_message(plugin, data, data_size) == 0)
+			{
+				chan_pool_free(data);
+			}
 		}
 		if (item != 0)
 		{
@@ -580,9 +757,9 @@ OpenEventProcessReceived(uint32 openHandle, void * pData, uint32 dataLength,
 		plugin->data_in_read = 0;
 		if (plugin->data_in != 0)
 		{
-			free(plugin->data_in);
+			chan_pool_free(plugin->data_in);
 		}
-		plugin->data_in = (char *) malloc(totalLength);
+		plugin->data_in = (char *) chan_pool_alloc(totalLength);
 		plugin->data_in_size = totalLength;
 	}
 
@@ -622,6 +799,7 @@ InitEventProcessConnected(void * pInitHandle, void * pData, uint32 dataLength)
 	rdpdrPlugin * plugin;
 	uint32 error;
 	pthread_t thread;
+	int index;
 
 	plugin = (rdpdrPlugin *) chan_plugin_find_by_init_handle(pInitHandle);
 	if (plugin == NULL)
@@ -639,6 +817,22 @@ InitEventProcessConnected(void * pInitHandle, void * pData, uint32 dataLength)
 
 	pthread_create(&thread, 0, thread_func, plugin);
 	pthread_detach(thread);
+
+	for (index = 0; index < RDPDR_IRP_WORKERS; index++)
+	{
+		pthread_mutex_lock(plugin->irp_mutex);
+		plugin->irp_workers++;
+		pthread_mutex_unlock(plugin->irp_mutex);
+		if (pthread_create(&thread, 0, irp_worker_func, plugin) != 0)
+		{
+			LLOGLN(0, ("InitEventProcessConnected: pthread_create failed"));
+			pthread_mutex_lock(plugin->irp_mutex);
+			plugin->irp_workers--;
+			pthread_mutex_unlock(plugin->irp_mutex);
+			break;
+		}
+		pthread_detach(thread);
+	}
 }
 
 static void
@@ -647,6 +841,7 @@ InitEventProcessTerminated(void * pInitHandle)
 	rdpdrPlugin * plugin;
 	int index;
 	struct data_in_item * in_item;
+	struct irp_item * irp_item;
 
 	plugin = (rdpdrPlugin *) chan_plugin_find_by_init_handle(pInitHandle);
 	if (plugin == NULL)
@@ -662,19 +857,43 @@ InitEventProcessTerminated(void * pInitHandle)
 		index++;
 		usleep(250 * 1000);
 	}
+
+	/* workers finish the IRP they are executing, queued ones are dropped */
+	pthread_mutex_lock(plugin->irp_mutex);
+	plugin->irp_term = 1;
+	pthread_cond_broadcast(plugin->irp_cond);
+	pthread_mutex_unlock(plugin->irp_mutex);
+	index = 0;
+	while ((plugin->irp_workers > 0) && (index < 100))
+	{
+		index++;
+		usleep(250 * 1000);
+	}
+
 	wait_obj_free(plugin->term_event);
 	wait_obj_free(plugin->data_in_event);
 	pthread_mutex_destroy(plugin->mutex);
 	free(plugin->mutex);
+	pthread_mutex_destroy(plugin->irp_mutex);
+	free(plugin->irp_mutex);
+	pthread_cond_destroy(plugin->irp_cond);
+	free(plugin->irp_cond);
 
 	/* free the un-processed in/out queue */
 	while (plugin->list_head != 0)
 	{
 		in_item = plugin->list_head;
 		plugin->list_head = in_item->next;
-		free(in_item->data);
+		chan_pool_free(in_item->data);
 		free(in_item);
 	}
+	while (plugin->irp_head != 0)
+	{
+		irp_item = plugin->irp_head;
+		plugin->irp_head = irp_item->next;
+		chan_pool_free(irp_item->pdu);
+		free(irp_item);
+	}
 
 	devman_free(plugin->devman);
 	chan_plugin_uninit((rdpChanPlugin *) plugin);
@@ -724,6 +943,15 @@ VirtualChannelEntry(PCHANNEL_ENTRY_POINTS pEntryPoints)
 	plugin->list_head = 0;
 	plugin->list_tail = 0;
 
+	plugin->irp_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(plugin->irp_mutex, 0);
+	plugin->irp_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(plugin->irp_cond, 0);
+	plugin->irp_head = 0;
+	plugin->irp_tail = 0;
+	plugin->irp_workers = 0;
+	plugin->irp_term = 0;
+
 	plugin->term_event = wait_obj_new("freerdprdpdrterm");
 	plugin->data_in_event = wait_obj_new("freerdprdpdrdatain");
 
@@ -31,6 +31,28 @@ struct data_in_item
 	int data_size;
 };
 
+/* number of threads executing IRPs */
+#define RDPDR_IRP_WORKERS 4
+
+/* a device I/O request waiting for a worker */
+struct irp_item
+{
+	struct irp_item * next;
+	char * pdu; /* whole channel PDU, freed when the IRP is done */
+	char * data; /* device I/O request header inside pdu */
+	int data_size;
+	uint32 deviceID;
+	uint32 fileID;
+};
+
+/* (deviceID, fileID) of an IRP a worker is executing */
+struct irp_slot
+{
+	int used;
+	uint32 deviceID;
+	uint32 fileID;
+};
+
 typedef struct rdpdr_plugin rdpdrPlugin;
 struct rdpdr_plugin
 {
@@ -50,6 +72,15 @@ struct rdpdr_plugin
 	pthread_mutex_t * mutex;
 	int thread_status;
 
+	/* IRP worker pool, irp_mutex protects the queue and the slots */
+	pthread_mutex_t * irp_mutex;
+	pthread_cond_t * irp_cond;
+	struct irp_item * irp_head;
+	struct irp_item * irp_tail;
+	struct irp_slot irp_slots[RDPDR_IRP_WORKERS];
+	int irp_workers; /* running worker threads */
+	int irp_term; /* boolean */
+
 	uint16 versionMinor;
 	uint16 clientID;
 	DEVMAN* devman;
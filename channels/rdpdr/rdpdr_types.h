@@ -46,6 +46,7 @@ struct _SERVICE
 	uint32 type;
 	uint32 (*create) (IRP * irp, const char * path);
 	uint32 (*close) (IRP * irp);
+	void (*closed) (IRP * irp);
 	uint32 (*read) (IRP * irp);
 	uint32 (*write) (IRP * irp);
 	uint32 (*control) (IRP * irp);
@@ -98,6 +99,9 @@ struct _IRP
 	uint32 outputResult;
 	char * outputBuffer;
 	int outputBufferLength;
+	/* optional, completion PDU with outputBuffer at
+	   IRP_COMPLETION_HEADER_LENGTH, sent without copying */
+	char * outputPdu;
 	int infoClass;
 	uint32 desiredAccess;
 	uint32 fileAttributes;
@@ -111,6 +115,11 @@ struct _IRP
 	uint64 offset;
 	uint32 operation;
 	uint8 waitOperation;
+	/* a service that returned RD_STATUS_PENDING keeps a copy of the IRP
+	   and later calls complete on it from any thread, the copy stays
+	   owned by the service */
+	void * plugin;
+	void (*complete) (IRP * irp);
 };
 
 #endif
@@ -65,8 +65,13 @@ set_params(struct alsa_device_data * alsa_data)
 	snd_pcm_hw_params_set_rate_near(alsa_data->out_handle, hw_params,
 		&alsa_data->rrate, NULL);
 	snd_pcm_hw_params_set_channels(alsa_data->out_handle, hw_params, alsa_data->num_channels);
-	snd_pcm_hw_params(alsa_data->out_handle, hw_params);
+	error = snd_pcm_hw_params(alsa_data->out_handle, hw_params);
 	snd_pcm_hw_params_free(hw_params);
+	if (error < 0)
+	{
+		LLOGLN(0, ("set_params: snd_pcm_hw_params failed"));
+		return 1;
+	}
 	snd_pcm_prepare(alsa_data->out_handle);
 	return 0;
 }
@@ -196,16 +201,20 @@ wave_out_set_format(void * device_data, char * snd_format, int size)
 	switch (wBitsPerSample)
 	{
 		case 8:
-			alsa_data->format = SND_PCM_FORMAT_S8;
+			/* 8 bit wave data is unsigned */
+			alsa_data->format = SND_PCM_FORMAT_U8;
 			alsa_data->bytes_per_channel = 1;
 			break;
 		case 16:
 			alsa_data->format = SND_PCM_FORMAT_S16_LE;
 			alsa_data->bytes_per_channel = 2;
 			break;
+		default:
+			LLOGLN(0, ("wave_out_set_format: unsupported wBitsPerSample %d",
+				wBitsPerSample));
+			return 1;
 	}
-	set_params(alsa_data);
-	return 0;
+	return set_params(alsa_data);
 }
 
 int
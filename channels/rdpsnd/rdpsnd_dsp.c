@@ -0,0 +1,862 @@
+/*
+   Copyright (c) 2010 FreeRDP project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <freerdp/types_ui.h>
+#include "chan_stream.h"
+#include "rdpsnd_dsp.h"
+
+#define LOG_LEVEL 1
+#define LLOG(_level, _args) \
+  do { if (_level < LOG_LEVEL) { printf _args ; } } while (0)
+#define LLOGLN(_level, _args) \
+  do { if (_level < LOG_LEVEL) { printf _args ; printf("\n"); } } while (0)
+
+/* polyphase resampler filter bank, coefficients are stored phase by
+   phase so each output sample is one contiguous dot product */
+#define RESAMPLE_PHASES 64
+#define RESAMPLE_TAPS   16
+
+#define DSP_MAX_CHANNELS 8
+
+struct dsp_data
+{
+	int format_tag;
+	int channels;
+	int block_align;
+	/* decoded output, reused between waves */
+	char * buffer;
+	int buffer_size;
+
+	/* conversion to the device format */
+	int convert; /* boolean */
+	int in_bits;
+	int in_rate;
+	int out_channels;
+	int out_rate;
+	float * filter; /* RESAMPLE_PHASES * RESAMPLE_TAPS, NULL if same rate */
+	float mix[2][DSP_MAX_CHANNELS]; /* downmix weights, output by input */
+	/* planar history, one run of hist_capacity floats per output channel,
+	   kept between waves so the filter has no seams */
+	float * hist;
+	int hist_capacity;
+	int hist_frames;
+	uint64 pos; /* 32.32 fixed point input frame of the next output */
+	uint64 step; /* in_rate / out_rate in 32.32 */
+	char * out_buffer;
+	int out_buffer_size;
+};
+
+static const int ima_step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int ima_index_table[16] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int ms_adaptation_table[16] =
+{
+	230, 230, 230, 230, 307, 409, 512, 614,
+	768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static const int ms_coef1_table[7] = { 256, 512, 0, 192, 240, 460, 392 };
+static const int ms_coef2_table[7] = { 0, -256, 0, 64, 0, -208, -232 };
+
+static int
+clamp16(int value)
+{
+	if (value > 32767)
+	{
+		return 32767;
+	}
+	if (value < -32768)
+	{
+		return -32768;
+	}
+	return value;
+}
+
+/* header bytes and decoded frames in one block */
+static int
+block_header_size(int format_tag, int channels)
+{
+	return (format_tag == WAVE_FORMAT_ADPCM ? 7 : 4) * channels;
+}
+
+static int
+block_frames(int format_tag, int channels, int block_align)
+{
+	int frames;
+
+	/* two nibbles per byte, the header carries one (IMA)
+	   or two (MS) samples per channel */
+	frames = (block_align - block_header_size(format_tag, channels)) * 2 / channels;
+	return frames + (format_tag == WAVE_FORMAT_ADPCM ? 2 : 1);
+}
+
+/*
+	IMA ADPCM block
+	per channel: sample (2 bytes), step index (1 byte), reserved (1 byte)
+	then groups of 4 bytes (8 samples) per channel, low nibble first
+*/
+static int
+decode_ima_block(uint8 * src, int size, int channels, uint8 * dst)
+{
+	int sample[2];
+	int index[2];
+	int ch;
+	int i;
+	int n;
+	int step;
+	int diff;
+	int frames;
+	uint8 * out;
+
+	for (ch = 0; ch < channels; ch++)
+	{
+		sample[ch] = (sint16) GET_UINT16(src, 0);
+		index[ch] = GET_UINT8(src, 2);
+		if (index[ch] > 88)
+		{
+			index[ch] = 88;
+		}
+		SET_UINT16(dst, ch * 2, sample[ch]);
+		src += 4;
+		size -= 4;
+	}
+	frames = 1;
+	while (size >= 4 * channels)
+	{
+		for (ch = 0; ch < channels; ch++)
+		{
+			out = dst + (frames * channels + ch) * 2;
+			for (i = 0; i < 8; i++)
+			{
+				n = src[i >> 1];
+				n = (i & 1) ? (n >> 4) : (n & 0xf);
+				step = ima_step_table[index[ch]];
+				diff = step >> 3;
+				if (n & 1)
+				{
+					diff += step >> 2;
+				}
+				if (n & 2)
+				{
+					diff += step >> 1;
+				}
+				if (n & 4)
+				{
+					diff += step;
+				}
+				if (n & 8)
+				{
+					diff = -diff;
+				}
+				sample[ch] = clamp16(sample[ch] + diff);
+				index[ch] += ima_index_table[n];
+				if (index[ch] < 0)
+				{
+					index[ch] = 0;
+				}
+				else if (index[ch] > 88)
+				{
+					index[ch] = 88;
+				}
+				SET_UINT16(out, 0, sample[ch]);
+				out += channels * 2;
+			}
+			src += 4;
+		}
+		size -= 4 * channels;
+		frames += 8;
+	}
+	return frames;
+}
+
+/*
+	MS ADPCM block
+	predictor index (1 byte per channel), delta (2 bytes per channel),
+	sample1 (2 bytes per channel), sample2 (2 bytes per channel)
+	then nibbles alternating between channels, high nibble first
+*/
+static int
+decode_ms_block(uint8 * src, int size, int channels, uint8 * dst)
+{
+	int coef1[2];
+	int coef2[2];
+	int delta[2];
+	int sample1[2];
+	int sample2[2];
+	int ch;
+	int i;
+	int n;
+	int nibbles;
+	int predictor;
+
+	for (ch = 0; ch < channels; ch++)
+	{
+		i = GET_UINT8(src, ch);
+		if (i > 6)
+		{
+			i = 6;
+		}
+		coef1[ch] = ms_coef1_table[i];
+		coef2[ch] = ms_coef2_table[i];
+		delta[ch] = (sint16) GET_UINT16(src, channels + ch * 2);
+		sample1[ch] = (sint16) GET_UINT16(src, channels * 3 + ch * 2);
+		sample2[ch] = (sint16) GET_UINT16(src, channels * 5 + ch * 2);
+		/* sample2 is the older one and plays first */
+		SET_UINT16(dst, ch * 2, sample2[ch]);
+		SET_UINT16(dst, (channels + ch) * 2, sample1[ch]);
+	}
+	src += 7 * channels;
+	size -= 7 * channels;
+	dst += channels * 4;
+	nibbles = size * 2;
+	for (i = 0; i < nibbles; i++)
+	{
+		ch = i % channels;
+		n = src[i >> 1];
+		n = (i & 1) ? (n & 0xf) : (n >> 4);
+		predictor = (sample1[ch] * coef1[ch] + sample2[ch] * coef2[ch]) >> 8;
+		/* nibble is a signed 4 bit value */
+		predictor += ((n & 8) ? n - 16 : n) * delta[ch];
+		predictor = clamp16(predictor);
+		sample2[ch] = sample1[ch];
+		sample1[ch] = predictor;
+		delta[ch] = (ms_adaptation_table[n] * delta[ch]) >> 8;
+		if (delta[ch] < 16)
+		{
+			delta[ch] = 16;
+		}
+		SET_UINT16(dst, 0, predictor);
+		dst += 2;
+	}
+	return 2 + nibbles / channels;
+}
+
+void *
+rdpsnd_dsp_new(void)
+{
+	struct dsp_data * dsp;
+
+	dsp = (struct dsp_data *) malloc(sizeof(struct dsp_data));
+	memset(dsp, 0, sizeof(struct dsp_data));
+	dsp->format_tag = WAVE_FORMAT_PCM;
+	return (void *) dsp;
+}
+
+void
+rdpsnd_dsp_free(void * dsp_data)
+{
+	struct dsp_data * dsp;
+
+	dsp = (struct dsp_data *) dsp_data;
+	if (dsp != NULL)
+	{
+		free(dsp->buffer);
+		free(dsp->filter);
+		free(dsp->hist);
+		free(dsp->out_buffer);
+		free(dsp);
+	}
+}
+
+/*
+	wFormatTag      2 byte offset 0
+	nChannels       2 byte offset 2
+	nSamplesPerSec  4 byte offset 4
+	nAvgBytesPerSec 4 byte offset 8
+	nBlockAlign     2 byte offset 12
+	wBitsPerSample  2 byte offset 14
+	cbSize          2 byte offset 16
+	data            variable offset 18
+*/
+
+/* returns boolean, true for compressed formats that can be decoded */
+int
+rdpsnd_dsp_decode_supported(char * snd_format, int size)
+{
+	int wFormatTag;
+	int nChannels;
+	int nBlockAlign;
+	int wBitsPerSample;
+
+	if (size < 18)
+	{
+		return 0;
+	}
+	wFormatTag = GET_UINT16(snd_format, 0);
+	nChannels = GET_UINT16(snd_format, 2);
+	nBlockAlign = GET_UINT16(snd_format, 12);
+	wBitsPerSample = GET_UINT16(snd_format, 14);
+	if ((wFormatTag != WAVE_FORMAT_ADPCM && wFormatTag != WAVE_FORMAT_DVI_ADPCM) ||
+		wBitsPerSample != 4 ||
+		(nChannels != 1 && nChannels != 2) ||
+		nBlockAlign <= block_header_size(wFormatTag, nChannels))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* fills pcm_format (18 bytes) with the 16 bit PCM format
+   snd_format decodes to */
+int
+rdpsnd_dsp_pcm_format(char * snd_format, int size, char * pcm_format)
+{
+	int nChannels;
+	int nSamplesPerSec;
+
+	if (GET_UINT16(snd_format, 0) == WAVE_FORMAT_PCM)
+	{
+		memcpy(pcm_format, snd_format, 18);
+		return 0;
+	}
+	if (!rdpsnd_dsp_decode_supported(snd_format, size))
+	{
+		return 1;
+	}
+	nChannels = GET_UINT16(snd_format, 2);
+	nSamplesPerSec = GET_UINT32(snd_format, 4);
+	SET_UINT16(pcm_format, 0, WAVE_FORMAT_PCM);
+	SET_UINT16(pcm_format, 2, nChannels);
+	SET_UINT32(pcm_format, 4, nSamplesPerSec);
+	SET_UINT32(pcm_format, 8, nSamplesPerSec * nChannels * 2);
+	SET_UINT16(pcm_format, 12, nChannels * 2);
+	SET_UINT16(pcm_format, 14, 16);
+	SET_UINT16(pcm_format, 16, 0);
+	return 0;
+}
+
+/* returns boolean, true for PCM the converter takes as input */
+int
+rdpsnd_dsp_convert_supported(char * pcm_format)
+{
+	int nChannels;
+	int nSamplesPerSec;
+	int wBitsPerSample;
+
+	nChannels = GET_UINT16(pcm_format, 2);
+	nSamplesPerSec = GET_UINT32(pcm_format, 4);
+	wBitsPerSample = GET_UINT16(pcm_format, 14);
+	return GET_UINT16(pcm_format, 0) == WAVE_FORMAT_PCM &&
+		(wBitsPerSample == 8 || wBitsPerSample == 16) &&
+		nChannels >= 1 && nChannels <= DSP_MAX_CHANNELS &&
+		nSamplesPerSec >= 4000 && nSamplesPerSec <= 192000;
+}
+
+/* fills device_format (18 bytes) with 16 bit PCM at the given rate
+   and channel count */
+int
+rdpsnd_dsp_convert_format(int rate, int channels, char * device_format)
+{
+	SET_UINT16(device_format, 0, WAVE_FORMAT_PCM);
+	SET_UINT16(device_format, 2, channels);
+	SET_UINT32(device_format, 4, rate);
+	SET_UINT32(device_format, 8, rate * channels * 2);
+	SET_UINT16(device_format, 12, channels * 2);
+	SET_UINT16(device_format, 14, 16);
+	SET_UINT16(device_format, 16, 0);
+	return 0;
+}
+
+static double
+sinc(double x)
+{
+	if (fabs(x) < 1e-9)
+	{
+		return 1.0;
+	}
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+/* Blackman windowed sinc, one normalised set of taps per phase */
+static int
+make_filter(struct dsp_data * dsp)
+{
+	double cutoff;
+	double t;
+	double x;
+	double sum;
+	double h[RESAMPLE_TAPS];
+	int phase;
+	int k;
+
+	free(dsp->filter);
+	dsp->filter = (float *) malloc(sizeof(float) * RESAMPLE_PHASES * RESAMPLE_TAPS);
+	if (dsp->filter == NULL)
+	{
+		return 1;
+	}
+	/* leave some transition band below the lower Nyquist frequency */
+	cutoff = 0.9;
+	if (dsp->out_rate < dsp->in_rate)
+	{
+		cutoff = cutoff * dsp->out_rate / dsp->in_rate;
+	}
+	for (phase = 0; phase < RESAMPLE_PHASES; phase++)
+	{
+		sum = 0;
+		for (k = 0; k < RESAMPLE_TAPS; k++)
+		{
+			/* distance from the output point, which lies phase/PHASES
+			   past the centre tap */
+			t = k - (RESAMPLE_TAPS / 2 - 1) - (double) phase / RESAMPLE_PHASES;
+			x = (t + RESAMPLE_TAPS / 2) / RESAMPLE_TAPS;
+			h[k] = cutoff * sinc(cutoff * t) *
+				(0.42 - 0.5 * cos(2 * M_PI * x) + 0.08 * cos(4 * M_PI * x));
+			sum += h[k];
+		}
+		for (k = 0; k < RESAMPLE_TAPS; k++)
+		{
+			dsp->filter[phase * RESAMPLE_TAPS + k] = (float) (h[k] / sum);
+		}
+	}
+	return 0;
+}
+
+/* snd_format is what the server sends, device_format (18 bytes) what
+   the device was opened with, it must be 16 bit PCM if they differ
+   in anything but the encoding */
+/* left and right weights of the input channels in the default speaker
+   order of a WAVEFORMATEX without channel mask: FL FR FC LFE BL BR FLC FRC,
+   centre and surrounds at -3 dB, LFE dropped */
+static const float downmix_left[DSP_MAX_CHANNELS] =
+	{ 1.0f, 0.0f, 0.7071f, 0.0f, 0.7071f, 0.0f, 1.0f, 0.0f };
+static const float downmix_right[DSP_MAX_CHANNELS] =
+	{ 0.0f, 1.0f, 0.7071f, 0.0f, 0.0f, 0.7071f, 0.0f, 1.0f };
+
+/* fills the downmix matrix to stereo or mono, every output is scaled
+   by the sum of its weights so full scale input can not clip */
+static int
+make_downmix(struct dsp_data * dsp)
+{
+	float left;
+	float right;
+	int ch;
+
+	if (dsp->out_channels > 2)
+	{
+		return 1;
+	}
+	left = 0;
+	right = 0;
+	for (ch = 0; ch < dsp->channels; ch++)
+	{
+		left += downmix_left[ch];
+		right += downmix_right[ch];
+	}
+	for (ch = 0; ch < dsp->channels; ch++)
+	{
+		if (dsp->out_channels == 1)
+		{
+			dsp->mix[0][ch] = (downmix_left[ch] + downmix_right[ch]) /
+				(left + right);
+		}
+		else
+		{
+			dsp->mix[0][ch] = downmix_left[ch] / left;
+			dsp->mix[1][ch] = downmix_right[ch] / right;
+		}
+	}
+	return 0;
+}
+
+int
+rdpsnd_dsp_set_format(void * dsp_data, char * snd_format, int size,
+	char * device_format)
+{
+	struct dsp_data * dsp;
+	char pcm_format[18];
+
+	dsp = (struct dsp_data *) dsp_data;
+	dsp->format_tag = GET_UINT16(snd_format, 0);
+	dsp->channels = GET_UINT16(snd_format, 2);
+	dsp->block_align = GET_UINT16(snd_format, 12);
+	dsp->convert = 0;
+	if (rdpsnd_dsp_pcm_format(snd_format, size, pcm_format) != 0)
+	{
+		LLOGLN(0, ("rdpsnd_dsp_set_format: unsupported format tag 0x%x",
+			dsp->format_tag));
+		dsp->format_tag = WAVE_FORMAT_PCM;
+		return 1;
+	}
+
+	dsp->in_bits = GET_UINT16(pcm_format, 14);
+	dsp->in_rate = GET_UINT32(pcm_format, 4);
+	dsp->out_channels = GET_UINT16(device_format, 2);
+	dsp->out_rate = GET_UINT32(device_format, 4);
+	if (memcmp(pcm_format, device_format, 16) == 0)
+	{
+		return 0;
+	}
+	if (!rdpsnd_dsp_convert_supported(pcm_format) ||
+		GET_UINT16(device_format, 14) != 16 ||
+		dsp->out_channels < 1 || dsp->out_channels > DSP_MAX_CHANNELS ||
+		dsp->out_rate < 4000 || dsp->out_rate > 192000)
+	{
+		LLOGLN(0, ("rdpsnd_dsp_set_format: can not convert to the device format"));
+		return 1;
+	}
+	if (dsp->channels > dsp->out_channels && make_downmix(dsp) != 0)
+	{
+		LLOGLN(0, ("rdpsnd_dsp_set_format: can not mix %d channels down to %d",
+			dsp->channels, dsp->out_channels));
+		return 1;
+	}
+	LLOGLN(0, ("rdpsnd_dsp_set_format: converting %d Hz %d channels %d bits "
+		"to %d Hz %d channels", dsp->in_rate, dsp->channels, dsp->in_bits,
+		dsp->out_rate, dsp->out_channels));
+	dsp->convert = 1;
+	free(dsp->filter);
+	dsp->filter = NULL;
+	if (dsp->in_rate != dsp->out_rate)
+	{
+		if (make_filter(dsp) != 0)
+		{
+			dsp->convert = 0;
+			return 1;
+		}
+		dsp->step = ((uint64) dsp->in_rate << 32) / dsp->out_rate;
+	}
+	/* start with the filter primed with silence */
+	dsp->hist_frames = 0;
+	if (dsp->filter != NULL)
+	{
+		dsp->hist_frames = RESAMPLE_TAPS / 2 - 1;
+		if (dsp->hist_capacity < dsp->hist_frames)
+		{
+			free(dsp->hist);
+			dsp->hist_capacity = RESAMPLE_TAPS;
+			dsp->hist = (float *) malloc(sizeof(float) *
+				dsp->hist_capacity * DSP_MAX_CHANNELS);
+		}
+		memset(dsp->hist, 0, sizeof(float) * dsp->hist_capacity * dsp->out_channels);
+	}
+	dsp->pos = 0;
+	return 0;
+}
+
+static char *
+decode_adpcm(struct dsp_data * dsp, char * data, int size, int * out_size)
+{
+	uint8 * src;
+	uint8 * dst;
+	int header;
+	int frames;
+	int blocks;
+	int len;
+	int needed;
+
+	header = block_header_size(dsp->format_tag, dsp->channels);
+	frames = block_frames(dsp->format_tag, dsp->channels, dsp->block_align);
+	blocks = (size + dsp->block_align - 1) / dsp->block_align;
+	needed = blocks * frames * dsp->channels * 2;
+	if (needed > dsp->buffer_size)
+	{
+		dst = (uint8 *) realloc(dsp->buffer, needed);
+		if (dst == NULL)
+		{
+			LLOGLN(0, ("decode_adpcm: realloc failed size %d", needed));
+			*out_size = 0;
+			return data;
+		}
+		dsp->buffer = (char *) dst;
+		dsp->buffer_size = needed;
+	}
+
+	src = (uint8 *) data;
+	dst = (uint8 *) dsp->buffer;
+	while (size > header)
+	{
+		/* the last block may be short */
+		len = size < dsp->block_align ? size : dsp->block_align;
+		if (dsp->format_tag == WAVE_FORMAT_ADPCM)
+		{
+			frames = decode_ms_block(src, len, dsp->channels, dst);
+		}
+		else
+		{
+			frames = decode_ima_block(src, len, dsp->channels, dst);
+		}
+		dst += frames * dsp->channels * 2;
+		src += len;
+		size -= len;
+	}
+	*out_size = (int) (dst - (uint8 *) dsp->buffer);
+	return dsp->buffer;
+}
+
+/* makes room for frames more history frames in every channel run */
+static int
+grow_history(struct dsp_data * dsp, int frames)
+{
+	float * hist;
+	int capacity;
+	int ch;
+
+	if (dsp->hist_frames + frames <= dsp->hist_capacity)
+	{
+		return 0;
+	}
+	capacity = dsp->hist_frames + frames + RESAMPLE_TAPS;
+	hist = (float *) malloc(sizeof(float) * capacity * DSP_MAX_CHANNELS);
+	if (hist == NULL)
+	{
+		return 1;
+	}
+	if (dsp->hist != NULL)
+	{
+		for (ch = 0; ch < dsp->out_channels; ch++)
+		{
+			memcpy(hist + ch * capacity, dsp->hist + ch * dsp->hist_capacity,
+				sizeof(float) * dsp->hist_frames);
+		}
+		free(dsp->hist);
+	}
+	dsp->hist = hist;
+	dsp->hist_capacity = capacity;
+	return 0;
+}
+
+static int
+grow_output(struct dsp_data * dsp, int size)
+{
+	char * out_buffer;
+
+	if (size <= dsp->out_buffer_size)
+	{
+		return 0;
+	}
+	out_buffer = (char *) realloc(dsp->out_buffer, size);
+	if (out_buffer == NULL)
+	{
+		return 1;
+	}
+	dsp->out_buffer = out_buffer;
+	dsp->out_buffer_size = size;
+	return 0;
+}
+
+/* appends frames of interleaved PCM to the planar history, mixing
+   input channels onto output channels on the way: with fewer outputs
+   the downmix matrix applies, with more the inputs repeat */
+static void
+mix_to_history(struct dsp_data * dsp, uint8 * src, int frames)
+{
+	float sample[DSP_MAX_CHANNELS];
+	float * out;
+	float acc;
+	int in_ch;
+	int out_ch;
+	int frame;
+	int index;
+	int ch;
+	int bytes;
+
+	in_ch = dsp->channels;
+	out_ch = dsp->out_channels;
+	bytes = dsp->in_bits / 8;
+	out = dsp->hist + dsp->hist_frames;
+	for (frame = 0; frame < frames; frame++)
+	{
+		for (ch = 0; ch < in_ch; ch++)
+		{
+			if (bytes == 1)
+			{
+				/* 8 bit PCM is unsigned */
+				sample[ch] = (float) ((src[ch] - 128) * 256);
+			}
+			else
+			{
+				sample[ch] = (float) (sint16) GET_UINT16(src, ch * 2);
+			}
+		}
+		src += in_ch * bytes;
+		if (in_ch == out_ch)
+		{
+			for (ch = 0; ch < out_ch; ch++)
+			{
+				out[ch * dsp->hist_capacity + frame] = sample[ch];
+			}
+		}
+		else if (in_ch < out_ch)
+		{
+			for (ch = 0; ch < out_ch; ch++)
+			{
+				out[ch * dsp->hist_capacity + frame] = sample[ch % in_ch];
+			}
+		}
+		else
+		{
+			for (ch = 0; ch < out_ch; ch++)
+			{
+				acc = 0;
+				for (index = 0; index < in_ch; index++)
+				{
+					acc += dsp->mix[ch][index] * sample[index];
+				}
+				out[ch * dsp->hist_capacity + frame] = acc;
+			}
+		}
+	}
+	dsp->hist_frames += frames;
+}
+
+/* converts the 16 bit interleaved input to the device format, the
+   filter state carries over to the next call */
+static char *
+convert(struct dsp_data * dsp, char * data, int size, int * out_size)
+{
+	const float * coef;
+	const float * x;
+	float acc[4];
+	uint8 * dst;
+	sint64 span;
+	int frames;
+	int out_frames;
+	int index;
+	int ch;
+	int k;
+
+	*out_size = 0;
+	frames = size / (dsp->channels * (dsp->in_bits / 8));
+	if (grow_history(dsp, frames) != 0)
+	{
+		LLOGLN(0, ("convert: out of memory"));
+		return data;
+	}
+	mix_to_history(dsp, (uint8 *) data, frames);
+
+	if (dsp->filter == NULL)
+	{
+		/* same rate, only the channel layout or sample size changes */
+		if (grow_output(dsp, dsp->hist_frames * dsp->out_channels * 2) != 0)
+		{
+			return data;
+		}
+		dst = (uint8 *) dsp->out_buffer;
+		for (index = 0; index < dsp->hist_frames; index++)
+		{
+			for (ch = 0; ch < dsp->out_channels; ch++)
+			{
+				SET_UINT16(dst, 0, clamp16((int)
+					dsp->hist[ch * dsp->hist_capacity + index]));
+				dst += 2;
+			}
+		}
+		*out_size = (int) (dst - (uint8 *) dsp->out_buffer);
+		dsp->hist_frames = 0;
+		return dsp->out_buffer;
+	}
+
+	/* outputs whose taps all lie inside the history */
+	out_frames = 0;
+	span = ((sint64) (dsp->hist_frames - RESAMPLE_TAPS + 1) << 32) - (sint64) dsp->pos;
+	if (span > 0)
+	{
+		out_frames = (int) ((span + dsp->step - 1) / dsp->step);
+	}
+	if (grow_output(dsp, (out_frames + 1) * dsp->out_channels * 2) != 0)
+	{
+		return data;
+	}
+	dst = (uint8 *) dsp->out_buffer;
+	index = (int) (dsp->pos >> 32);
+	while (index + RESAMPLE_TAPS <= dsp->hist_frames)
+	{
+		coef = dsp->filter + (int) (((dsp->pos & 0xffffffff) *
+			RESAMPLE_PHASES) >> 32) * RESAMPLE_TAPS;
+		for (ch = 0; ch < dsp->out_channels; ch++)
+		{
+			x = dsp->hist + ch * dsp->hist_capacity + index;
+			/* four independent sums so the loop maps onto vector lanes */
+			acc[0] = acc[1] = acc[2] = acc[3] = 0;
+			for (k = 0; k < RESAMPLE_TAPS; k += 4)
+			{
+				acc[0] += coef[k] * x[k];
+				acc[1] += coef[k + 1] * x[k + 1];
+				acc[2] += coef[k + 2] * x[k + 2];
+				acc[3] += coef[k + 3] * x[k + 3];
+			}
+			SET_UINT16(dst, 0, clamp16((int)
+				lrintf(acc[0] + acc[1] + acc[2] + acc[3])));
+			dst += 2;
+		}
+		dsp->pos += dsp->step;
+		index = (int) (dsp->pos >> 32);
+	}
+	*out_size = (int) (dst - (uint8 *) dsp->out_buffer);
+
+	/* drop the frames no future output needs */
+	if (index > dsp->hist_frames)
+	{
+		index = dsp->hist_frames;
+	}
+	for (ch = 0; ch < dsp->out_channels; ch++)
+	{
+		memmove(dsp->hist + ch * dsp->hist_capacity,
+			dsp->hist + ch * dsp->hist_capacity + index,
+			sizeof(float) * (dsp->hist_frames - index));
+	}
+	dsp->hist_frames -= index;
+	dsp->pos -= (uint64) index << 32;
+	return dsp->out_buffer;
+}
+
+/* returns the data to write to the device, either data itself or a
+   buffer owned by dsp_data that is valid until the next call */
+char *
+rdpsnd_dsp_process(void * dsp_data, char * data, int size, int * out_size)
+{
+	struct dsp_data * dsp;
+
+	dsp = (struct dsp_data *) dsp_data;
+	if (dsp->format_tag != WAVE_FORMAT_PCM)
+	{
+		data = decode_adpcm(dsp, data, size, &size);
+	}
+	if (dsp->convert)
+	{
+		data = convert(dsp, data, size, &size);
+	}
+	*out_size = size;
+	return data;
+}
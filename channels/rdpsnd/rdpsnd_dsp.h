@@ -1,40 +1,52 @@
 /*
-   rdesktop: A Remote Desktop Protocol client.
-   Sound DSP routines
-   Copyright (C) Michael Gernoth 2006-2008
-
-   This program is free software; you can redistribute it and/or modify
-   it under the terms of the GNU General Public License as published by
-   the Free Software Foundation; either version 2 of the License, or
-   (at your option) any later version.
-
-   This program is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-   GNU General Public License for more details.
-
-   You should have received a copy of the GNU General Public License
-   along with this program; if not, write to the Free Software
-   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+   Copyright (c) 2010 FreeRDP project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+
 */
 
 #ifndef __RDPSND_DSP_H
 #define __RDPSND_DSP_H
 
-/* Software volume control */
-void rdpsnd_dsp_softvol_set(uint16 left, uint16 right);
-
-/* Endian conversion */
-void rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format);
-
-/* Resample control */
-RD_BOOL rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample,
-				uint16 device_channels);
-RD_BOOL rdpsnd_dsp_resample_supported(RD_WAVEFORMATEX * pwfx);
-
-STREAM rdpsnd_dsp_process(unsigned char *data, unsigned int size,
-			  struct audio_driver *current_driver, RD_WAVEFORMATEX * format);
-
-#endif // __RDPSND_DSP_H
-
-
+/* format tags, see mmreg.h */
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_ADPCM      0x0002
+#define WAVE_FORMAT_DVI_ADPCM  0x0011
+
+/* sits between the wave PDUs and the device
+   snd_format is the 18 byte WAVEFORMATEX header followed by cbSize bytes */
+void *
+rdpsnd_dsp_new(void);
+void
+rdpsnd_dsp_free(void * dsp_data);
+int
+rdpsnd_dsp_decode_supported(char * snd_format, int size);
+int
+rdpsnd_dsp_pcm_format(char * snd_format, int size, char * pcm_format);
+int
+rdpsnd_dsp_convert_supported(char * pcm_format);
+int
+rdpsnd_dsp_convert_format(int rate, int channels, char * device_format);
+int
+rdpsnd_dsp_set_format(void * dsp_data, char * snd_format, int size,
+	char * device_format);
+char *
+rdpsnd_dsp_process(void * dsp_data, char * data, int size, int * out_size);
+
+#endif
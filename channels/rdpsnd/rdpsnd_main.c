@@ -27,11 +27,14 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <freerdp/types_ui.h>
 #include <freerdp/vchan.h>
 #include "chan_stream.h"
 #include "chan_plugin.h"
+#include "chan_pool.h"
 #include "wait_obj.h"
+#include "rdpsnd_dsp.h"
 
 #define SNDC_CLOSE         1
 #define SNDC_WAVE          2
@@ -50,6 +53,16 @@
 #define TSSNDCAPS_VOLUME 2
 #define TSSNDCAPS_PITCH  4
 
+/* playback ring capacity, device write size and jitter buffer limits */
+#define RDPSND_RING_MS         2000
+#define RDPSND_PERIOD_MS       20
+#define RDPSND_JITTER_MIN_MS   40
+#define RDPSND_JITTER_MAX_MS   500
+#define RDPSND_JITTER_STEP_MS  20
+/* a wave sent no later than this after the previous one ends belongs to
+   the same stream, running dry in between is an underrun */
+#define RDPSND_STREAM_GAP_MS   50
+
 #define LOG_LEVEL 1
 #define LLOG(_level, _args) \
   do { if (_level < LOG_LEVEL) { printf _args ; } } while (0)
@@ -105,9 +118,47 @@ struct rdpsnd_plugin
 	uint32 wTimeStamp; /* server timestamp */
 	uint32 local_time_stamp; /* client timestamp */
 	int thread_status;
+	int timer_fd; /* fires when the next wave confirm is due */
+
+	/* playback ring, filled by the worker thread and
+	   drained by the playback thread */
+	char * ring;
+	int ring_size;
+	int ring_read;
+	int ring_used;
+	int bytes_per_second;
+	int block_align;
+	/* for locking the ring and the playback state below */
+	pthread_mutex_t * play_mutex;
+	pthread_cond_t * play_cond;
+	int play_thread_status;
+	int play_term; /* boolean */
+	int playing; /* boolean, device write in progress */
+	int prebuffering; /* boolean, waiting for the jitter buffer to fill */
+	int draining; /* boolean, play out what is left without prebuffering */
+	int ran_dry; /* boolean, the ring emptied while playing */
+	int have_wave_end; /* boolean */
+	uint32 wave_end; /* server time the last queued wave ends */
+	uint32 prebuffer_start;
+	int device_delay_ms;
+
+	/* adaptive jitter buffer */
+	uint32 prev_arrival;
+	uint32 prev_wTimeStamp;
+	int have_arrival; /* boolean */
+	int jitter_q4; /* interarrival jitter in 1/16 ms */
+	int jitter_boost_ms; /* raised on underrun, decays per wave */
+	int target_ms;
+
+	/* playback statistics */
+	int latency_ms;
+	int latency_max_ms;
+	int underruns;
 
 	/* Device specific data */
 	void * device_data;
+	/* decoder for compressed formats */
+	void * dsp_data;
 };
 
 /* implementations are in the hardware file */
@@ -138,6 +189,33 @@ get_mstime(void)
 	return (tp.tv_sec * 1000) + (tp.tv_usec / 1000);
 }
 
+/* absolute time ms milliseconds from now, for pthread_cond_timedwait */
+static void
+get_abstime(struct timespec * ts, int ms)
+{
+	struct timeval tp;
+
+	gettimeofday(&tp, 0);
+	ts->tv_sec = tp.tv_sec + ms / 1000;
+	ts->tv_nsec = tp.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* playing time of size bytes in the current format */
+static int
+ring_ms(rdpsndPlugin * plugin, int size)
+{
+	if (plugin->bytes_per_second <= 0)
+	{
+		return 0;
+	}
+	return (int) (((uint64) size * 1000) / plugin->bytes_per_second);
+}
+
 /* called by main thread
    add item to linked list and inform worker thread that there is data */
 static void
@@ -191,6 +269,31 @@ queue_data_out(rdpsndPlugin * plugin)
 	}
 }
 
+/* arm the timer for the confirm at the head of the out list,
+   or disarm it if there is nothing left to send */
+static void
+thread_arm_timer(rdpsndPlugin * plugin)
+{
+	struct itimerspec its;
+	int wait_ms;
+
+	memset(&its, 0, sizeof(its));
+	if (plugin->out_list_head != 0)
+	{
+		wait_ms = (int) (plugin->out_list_head->out_time_stamp - get_mstime()) + 1;
+		if (wait_ms < 1)
+		{
+			wait_ms = 1;
+		}
+		its.it_value.tv_sec = wait_ms / 1000;
+		its.it_value.tv_nsec = (wait_ms % 1000) * 1000000;
+	}
+	if (timerfd_settime(plugin->timer_fd, 0, &its, 0) != 0)
+	{
+		LLOGLN(0, ("thread_arm_timer: timerfd_settime failed"));
+	}
+}
+
 /* process the linked list of data that has queued to be sent */
 static int
 thread_process_data_out(rdpsndPlugin * plugin)
@@ -255,6 +358,58 @@ thread_process_data_out(rdpsndPlugin * plugin)
 	data            variable offset 18
 */
 
+/* picks the format to open the device with for a server format
+   prefers the server format itself, then its PCM decoding, then
+   16 bit PCM at the nearest layout and rate the device takes
+   returns 0 and fills device_format (18 bytes) if there is one */
+static int
+find_device_format(rdpsndPlugin * plugin, char * snd_format, int size,
+	char * device_format)
+{
+	static const int rates[] = { 0, 44100, 48000, 22050 };
+	char pcm_format[18];
+	int nChannels;
+	int channels;
+	int rate;
+	int index;
+
+	if (wave_out_format_supported(plugin->device_data, snd_format, size))
+	{
+		memcpy(device_format, snd_format, 18);
+		return 0;
+	}
+	if (rdpsnd_dsp_pcm_format(snd_format, size, pcm_format) != 0)
+	{
+		return 1;
+	}
+	if (GET_UINT16(snd_format, 0) != 1 &&
+		wave_out_format_supported(plugin->device_data, pcm_format, 18))
+	{
+		memcpy(device_format, pcm_format, 18);
+		return 0;
+	}
+	if (!rdpsnd_dsp_convert_supported(pcm_format))
+	{
+		return 1;
+	}
+	nChannels = GET_UINT16(pcm_format, 2);
+	for (index = 0; index < (int) (sizeof(rates) / sizeof(rates[0])); index++)
+	{
+		rate = rates[index] ? rates[index] : GET_UINT32(pcm_format, 4);
+		/* keep the channel count if possible, else stereo, else mono */
+		for (channels = 0; channels < 3; channels++)
+		{
+			rdpsnd_dsp_convert_format(rate,
+				channels == 0 ? nChannels : 3 - channels, device_format);
+			if (wave_out_format_supported(plugin->device_data, device_format, 18))
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
 /* called by worker thread
    receives a list of server supported formats and returns a list
    of client supported formats */
@@ -272,6 +427,7 @@ thread_process_message_formats(rdpsndPlugin * plugin, char * data, int data_size
 	char * out_data;
 	char * out_formats;
 	char * lout_formats;
+	char device_format[18];
 	uint32 error;
 
 	/* skip:
@@ -306,7 +462,9 @@ thread_process_message_formats(rdpsndPlugin * plugin, char * data, int data_size
 	for (index = 0; index < format_count; index++)
 	{
 		size = 18 + GET_UINT16(ldata, 16);
-		if (wave_out_format_supported(plugin->device_data, ldata, size))
+		/* compressed formats are decoded and other rates and channel
+		   layouts converted before they reach the device */
+		if (find_device_format(plugin, ldata, size, device_format) == 0)
 		{
 			memcpy(lout_formats, ldata, size);
 			lout_formats += size;
@@ -411,10 +569,297 @@ thread_process_message_training(rdpsndPlugin * plugin, char * data, int data_siz
 	return 0;
 }
 
+/* playback thread
+   waits for the jitter buffer to fill, then writes the ring to the
+   device one period at a time straight from ring memory so the worker
+   thread never blocks in the device */
+static void *
+play_thread_func(void * arg)
+{
+	rdpsndPlugin * plugin;
+	struct timespec ts;
+	char * data;
+	int size;
+	int period;
+	int wait_ms;
+	int delay_ms;
+
+	plugin = (rdpsndPlugin *) arg;
+
+	plugin->play_thread_status = 1;
+	LLOGLN(10, ("play_thread_func: in"));
+	pthread_mutex_lock(plugin->play_mutex);
+	while (!plugin->play_term)
+	{
+		if (plugin->ring_used == 0)
+		{
+			if (!plugin->prebuffering)
+			{
+				/* the next wave tells if this was an underrun or the
+				   end of a sound */
+				plugin->ran_dry = !plugin->draining;
+				plugin->prebuffering = 1;
+			}
+			pthread_cond_broadcast(plugin->play_cond);
+			pthread_cond_wait(plugin->play_cond, plugin->play_mutex);
+			continue;
+		}
+		if (plugin->prebuffering && !plugin->draining &&
+			ring_ms(plugin, plugin->ring_used) < plugin->target_ms)
+		{
+			/* start anyway once the target time has passed, short
+			   sounds may never fill the buffer */
+			wait_ms = (int) (plugin->prebuffer_start + plugin->target_ms - get_mstime());
+			if (wait_ms > 0)
+			{
+				get_abstime(&ts, wait_ms);
+				pthread_cond_timedwait(plugin->play_cond, plugin->play_mutex, &ts);
+				continue;
+			}
+		}
+		plugin->prebuffering = 0;
+
+		period = plugin->bytes_per_second * RDPSND_PERIOD_MS / 1000;
+		period -= period % plugin->block_align;
+		if (period < plugin->block_align)
+		{
+			period = plugin->block_align;
+		}
+		size = plugin->ring_size - plugin->ring_read;
+		if (size > plugin->ring_used)
+		{
+			size = plugin->ring_used;
+		}
+		if (size > period)
+		{
+			size = period;
+		}
+		data = plugin->ring + plugin->ring_read;
+		plugin->playing = 1;
+		pthread_mutex_unlock(plugin->play_mutex);
+
+		delay_ms = 0;
+		wave_out_play(plugin->device_data, data, size, &delay_ms);
+
+		pthread_mutex_lock(plugin->play_mutex);
+		plugin->playing = 0;
+		plugin->ring_read = (plugin->ring_read + size) % plugin->ring_size;
+		plugin->ring_used -= size;
+		plugin->device_delay_ms = delay_ms;
+		pthread_cond_broadcast(plugin->play_cond);
+	}
+	pthread_mutex_unlock(plugin->play_mutex);
+	LLOGLN(10, ("play_thread_func: out"));
+	plugin->play_thread_status = -1;
+	return 0;
+}
+
+/* called by worker thread with play_mutex held
+   waits a little for the playback thread, sending any
+   wave confirms that fall due meanwhile */
+static void
+thread_wait_playback(rdpsndPlugin * plugin)
+{
+	struct timespec ts;
+
+	get_abstime(&ts, RDPSND_PERIOD_MS / 2);
+	pthread_cond_timedwait(plugin->play_cond, plugin->play_mutex, &ts);
+	pthread_mutex_unlock(plugin->play_mutex);
+	if (plugin->out_list_head != 0)
+	{
+		thread_process_data_out(plugin);
+		thread_arm_timer(plugin);
+	}
+	pthread_mutex_lock(plugin->play_mutex);
+}
+
+/* called by worker thread
+   lets the playback thread play out everything queued, the device
+   is idle and the ring empty on return */
+static void
+thread_drain_playback(rdpsndPlugin * plugin)
+{
+	pthread_mutex_lock(plugin->play_mutex);
+	plugin->draining = 1;
+	pthread_cond_broadcast(plugin->play_cond);
+	while ((plugin->ring_used > 0 || plugin->playing) && !plugin->play_term)
+	{
+		if (wait_obj_is_set(plugin->term_event))
+		{
+			break;
+		}
+		thread_wait_playback(plugin);
+	}
+	plugin->draining = 0;
+	pthread_mutex_unlock(plugin->play_mutex);
+}
+
+/* called by worker thread with the playback thread drained */
+static int
+ring_resize(rdpsndPlugin * plugin, int size)
+{
+	char * ring;
+
+	pthread_mutex_lock(plugin->play_mutex);
+	if (plugin->ring_used > 0 || plugin->playing)
+	{
+		pthread_mutex_unlock(plugin->play_mutex);
+		return 1;
+	}
+	ring = (char *) realloc(plugin->ring, size);
+	if (ring == NULL)
+	{
+		LLOGLN(0, ("ring_resize: realloc failed size %d", size));
+		pthread_mutex_unlock(plugin->play_mutex);
+		return 1;
+	}
+	plugin->ring = ring;
+	plugin->ring_size = size;
+	plugin->ring_read = 0;
+	plugin->ring_used = 0;
+	pthread_mutex_unlock(plugin->play_mutex);
+	return 0;
+}
+
+/* called by worker thread with play_mutex held before a wave is queued
+   if the ring ran dry and the server sent this wave while the previous
+   one was still due to play, the stream was interrupted: an underrun */
+static void
+thread_check_underrun(rdpsndPlugin * plugin, int wave_ms)
+{
+	int gap;
+
+	if (plugin->ran_dry && plugin->have_wave_end)
+	{
+		/* server time is 16 bit milliseconds */
+		gap = (sint16) (uint16) (plugin->wTimeStamp - plugin->wave_end);
+		if (gap < RDPSND_STREAM_GAP_MS)
+		{
+			plugin->underruns++;
+			plugin->jitter_boost_ms += RDPSND_JITTER_STEP_MS;
+			if (plugin->jitter_boost_ms > RDPSND_JITTER_MAX_MS)
+			{
+				plugin->jitter_boost_ms = RDPSND_JITTER_MAX_MS;
+			}
+			LLOGLN(10, ("thread_check_underrun: underrun %d gap %d ms",
+				plugin->underruns, gap));
+		}
+	}
+	plugin->ran_dry = 0;
+	plugin->have_wave_end = 1;
+	plugin->wave_end = plugin->wTimeStamp + wave_ms;
+}
+
+/* called by worker thread
+   appends wave data to the ring and returns the expected time in ms
+   until it has been played */
+static int
+thread_queue_wave(rdpsndPlugin * plugin, char * data, int data_size)
+{
+	int write_pos;
+	int size;
+	int delay_ms;
+
+	if (data_size <= 0 || plugin->block_align < 1)
+	{
+		return plugin->device_delay_ms;
+	}
+	if (data_size > plugin->ring_size)
+	{
+		thread_drain_playback(plugin);
+		if (ring_resize(plugin, data_size) != 0)
+		{
+			return 0;
+		}
+	}
+	pthread_mutex_lock(plugin->play_mutex);
+	while (plugin->ring_size - plugin->ring_used < data_size)
+	{
+		if (plugin->play_term || wait_obj_is_set(plugin->term_event))
+		{
+			pthread_mutex_unlock(plugin->play_mutex);
+			return 0;
+		}
+		thread_wait_playback(plugin);
+	}
+	thread_check_underrun(plugin, ring_ms(plugin, data_size));
+	if (plugin->ring_used == 0 && plugin->prebuffering)
+	{
+		plugin->prebuffer_start = get_mstime();
+	}
+	write_pos = (plugin->ring_read + plugin->ring_used) % plugin->ring_size;
+	size = plugin->ring_size - write_pos;
+	if (size > data_size)
+	{
+		size = data_size;
+	}
+	memcpy(plugin->ring + write_pos, data, size);
+	memcpy(plugin->ring, data + size, data_size - size);
+	plugin->ring_used += data_size;
+
+	delay_ms = ring_ms(plugin, plugin->ring_used) + plugin->device_delay_ms;
+	if (plugin->prebuffering)
+	{
+		delay_ms += plugin->target_ms;
+		delay_ms -= (int) (get_mstime() - plugin->prebuffer_start);
+	}
+	plugin->latency_ms = delay_ms;
+	if (delay_ms > plugin->latency_max_ms)
+	{
+		plugin->latency_max_ms = delay_ms;
+	}
+	pthread_cond_broadcast(plugin->play_cond);
+	pthread_mutex_unlock(plugin->play_mutex);
+	return delay_ms;
+}
+
+/* called by worker thread when a wave arrives
+   tracks the interarrival jitter of the server timestamps and derives
+   the jitter buffer target from it */
+static void
+thread_update_jitter(rdpsndPlugin * plugin)
+{
+	int elapsed;
+	int d;
+	int target;
+
+	elapsed = (int) (plugin->local_time_stamp - plugin->prev_arrival);
+	if (plugin->have_arrival && elapsed < 10000)
+	{
+		/* RFC 3550 style: transit time difference, server clock is
+		   16 bit milliseconds */
+		d = (sint16) (uint16) (elapsed -
+			(int) (plugin->wTimeStamp - plugin->prev_wTimeStamp));
+		if (d < 0)
+		{
+			d = -d;
+		}
+		plugin->jitter_q4 += d - ((plugin->jitter_q4 + 8) >> 4);
+	}
+	plugin->have_arrival = 1;
+	plugin->prev_arrival = plugin->local_time_stamp;
+	plugin->prev_wTimeStamp = plugin->wTimeStamp;
+
+	if (plugin->jitter_boost_ms > 0)
+	{
+		plugin->jitter_boost_ms--;
+	}
+	target = RDPSND_JITTER_MIN_MS + 3 * (plugin->jitter_q4 >> 4) +
+		plugin->jitter_boost_ms;
+	if (target > RDPSND_JITTER_MAX_MS)
+	{
+		target = RDPSND_JITTER_MAX_MS;
+	}
+	pthread_mutex_lock(plugin->play_mutex);
+	plugin->target_ms = target;
+	pthread_mutex_unlock(plugin->play_mutex);
+}
+
 static int
 set_format(rdpsndPlugin * plugin)
 {
 	char * snd_format;
+	char device_format[18];
 	int size;
 	int index;
 
@@ -428,7 +873,27 @@ set_format(rdpsndPlugin * plugin)
 		size = 18 + GET_UINT16(snd_format, 16);
 		index++;
 	}
-	wave_out_set_format(plugin->device_data, snd_format, size);
+	/* everything queued was encoded in the old format */
+	thread_drain_playback(plugin);
+	if (find_device_format(plugin, snd_format, size, device_format) != 0)
+	{
+		LLOGLN(0, ("set_format: no device format"));
+		return 1;
+	}
+	if (rdpsnd_dsp_set_format(plugin->dsp_data, snd_format, size, device_format) != 0 ||
+		wave_out_set_format(plugin->device_data, device_format, 18) != 0)
+	{
+		LLOGLN(0, ("set_format: can not play format %d", plugin->current_format));
+		return 1;
+	}
+	plugin->bytes_per_second = GET_UINT32(device_format, 8);
+	plugin->block_align = GET_UINT16(device_format, 12);
+	if (plugin->block_align < 1)
+	{
+		plugin->block_align = 1;
+	}
+	ring_resize(plugin, plugin->bytes_per_second * RDPSND_RING_MS / 1000 +
+		plugin->block_align);
 	return 0;
 }
 
@@ -451,8 +916,14 @@ thread_process_message_wave_info(rdpsndPlugin * plugin, char * data, int data_si
 	if (wFormatNo != plugin->current_format && !error)
 	{
 		plugin->current_format = wFormatNo;
-		set_format(plugin);
+		error = set_format(plugin);
+		if (error)
+		{
+			/* waves are skipped until the close, set it up again after it */
+			plugin->current_format = -1;
+		}
 	}
+	thread_update_jitter(plugin);
 	plugin->expectingWave = 1;
 	return error;
 }
@@ -463,6 +934,8 @@ thread_process_message_wave(rdpsndPlugin * plugin, char * data, int data_size)
 {
 	int size;
 	int wTimeStamp;
+	int pcm_size;
+	char * pcm_data;
 	char * out_data;
 
 	plugin->expectingWave = 0;
@@ -472,7 +945,9 @@ thread_process_message_wave(rdpsndPlugin * plugin, char * data, int data_size)
 		LLOGLN(0, ("thread_process_message_wave: "
 			"size error"));
 	}
-	wave_out_play(plugin->device_data, data, data_size, &plugin->delay_ms);
+	/* decode and convert to the device format */
+	pcm_data = rdpsnd_dsp_process(plugin->dsp_data, data, data_size, &pcm_size);
+	plugin->delay_ms = thread_queue_wave(plugin, pcm_data, pcm_size);
 	size = 8;
 	out_data = (char *) malloc(size);
 	SET_UINT8(out_data, 0, SNDC_WAVECONFIRM);
@@ -488,6 +963,7 @@ thread_process_message_wave(rdpsndPlugin * plugin, char * data, int data_size)
 	plugin->data_out = out_data;
 	plugin->data_out_size = size;
 	queue_data_out(plugin);
+	thread_arm_timer(plugin);
 	return 0;
 }
 
@@ -496,7 +972,15 @@ thread_process_message_close(rdpsndPlugin * plugin, char * data, int data_size)
 {
 	LLOGLN(10, ("thread_process_message_close: "
 		"data_size %d", data_size));
+	thread_drain_playback(plugin);
 	wave_out_close(plugin->device_data);
+	LLOGLN(10, ("thread_process_message_close: latency %d ms (max %d) "
+		"jitter %d ms target %d ms underruns %d",
+		plugin->latency_ms, plugin->latency_max_ms,
+		plugin->jitter_q4 >> 4, plugin->target_ms, plugin->underruns));
+	plugin->device_delay_ms = 0;
+	plugin->have_arrival = 0;
+	plugin->have_wave_end = 0;
 	return 0;
 }
 
@@ -589,7 +1073,7 @@ thread_process_data_in(rdpsndPlugin * plugin)
 		if (data != 0)
 		{
 			thread_process_message(plugin, data, data_size);
-			free(data);
+			chan_pool_free(data);
 		}
 		if (item != 0)
 		{
@@ -609,8 +1093,10 @@ thread_func(void * arg)
 {
 	rdpsndPlugin * plugin;
 	struct wait_obj * listobj[2];
+	int listr[1];
 	int numobj;
-	int timeout;
+	int numr;
+	uint64 expirations;
 
 	plugin = (rdpsndPlugin *) arg;
 
@@ -621,8 +1107,9 @@ thread_func(void * arg)
 		listobj[0] = plugin->term_event;
 		listobj[1] = plugin->data_in_event;
 		numobj = 2;
-		timeout = plugin->out_list_head == 0 ? -1 : 500;
-		wait_obj_select(listobj, numobj, NULL, 0, timeout);
+		listr[0] = plugin->timer_fd;
+		numr = 1;
+		wait_obj_select(listobj, numobj, listr, numr, -1);
 		if (wait_obj_is_set(plugin->term_event))
 		{
 			break;
@@ -633,10 +1120,16 @@ thread_func(void * arg)
 			/* process data in */
 			thread_process_data_in(plugin);
 		}
+		/* timer_fd is non blocking, this just clears it */
+		if (read(plugin->timer_fd, &expirations, sizeof(expirations)) < 0)
+		{
+			expirations = 0;
+		}
 		if (plugin->out_list_head != 0)
 		{
 			thread_process_data_out(plugin);
 		}
+		thread_arm_timer(plugin);
 	}
 	LLOGLN(10, ("thread_func: out"));
 	plugin->thread_status = -1;
@@ -659,9 +1152,9 @@ OpenEventProcessReceived(uint32 openHandle, void * pData, uint32 dataLength,
 		plugin->data_in_read = 0;
 		if (plugin->data_in != 0)
 		{
-			free(plugin->data_in);
+			chan_pool_free(plugin->data_in);
 		}
-		plugin->data_in = (char *) malloc(totalLength);
+		plugin->data_in = (char *) chan_pool_alloc(totalLength);
 		plugin->data_in_size = totalLength;
 	}
 	memcpy(plugin->data_in + plugin->data_in_read, pData, dataLength);
@@ -718,6 +1211,8 @@ InitEventProcessConnected(void * pInitHandle, void * pData, uint32 dataLength)
 
 	pthread_create(&thread, 0, thread_func, plugin);
 	pthread_detach(thread);
+	pthread_create(&thread, 0, play_thread_func, plugin);
+	pthread_detach(thread);
 }
 
 static void
@@ -736,24 +1231,35 @@ InitEventProcessTerminated(void * pInitHandle)
 	}
 
 	wait_obj_set(plugin->term_event);
+	pthread_mutex_lock(plugin->play_mutex);
+	plugin->play_term = 1;
+	pthread_cond_broadcast(plugin->play_cond);
+	pthread_mutex_unlock(plugin->play_mutex);
 	index = 0;
-	while ((plugin->thread_status > 0) && (index < 100))
+	while (((plugin->thread_status > 0) || (plugin->play_thread_status > 0)) &&
+		(index < 100))
 	{
 		index++;
 		usleep(250 * 1000);
 	}
 	wait_obj_free(plugin->term_event);
 	wait_obj_free(plugin->data_in_event);
+	close(plugin->timer_fd);
 
 	pthread_mutex_destroy(plugin->in_mutex);
 	free(plugin->in_mutex);
+	pthread_cond_destroy(plugin->play_cond);
+	free(plugin->play_cond);
+	pthread_mutex_destroy(plugin->play_mutex);
+	free(plugin->play_mutex);
+	free(plugin->ring);
 
 	/* free the un-processed in/out queue */
 	while (plugin->in_list_head != 0)
 	{
 		in_item = plugin->in_list_head;
 		plugin->in_list_head = in_item->next;
-		free(in_item->data);
+		chan_pool_free(in_item->data);
 		free(in_item);
 	}
 	while (plugin->out_list_head != 0)
@@ -764,7 +1270,14 @@ InitEventProcessTerminated(void * pInitHandle)
 		free(out_item);
 	}
 
+	if (plugin->latency_max_ms > 0)
+	{
+		LLOGLN(0, ("rdpsnd: latency %d ms (max %d) jitter %d ms target %d ms "
+			"underruns %d", plugin->latency_ms, plugin->latency_max_ms,
+			plugin->jitter_q4 >> 4, plugin->target_ms, plugin->underruns));
+	}
 	wave_out_free(plugin->device_data);
+	rdpsnd_dsp_free(plugin->dsp_data);
 	chan_plugin_uninit((rdpChanPlugin *) plugin);
 	free(plugin);
 }
@@ -814,11 +1327,22 @@ VirtualChannelEntry(PCHANNEL_ENTRY_POINTS pEntryPoints)
 	plugin->out_list_tail = 0;
 	plugin->term_event = wait_obj_new("freerdprdpsndterm");
 	plugin->data_in_event = wait_obj_new("freerdprdpsnddatain");
+	plugin->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	plugin->play_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(plugin->play_mutex, 0);
+	plugin->play_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(plugin->play_cond, 0);
+	plugin->ring = 0;
+	plugin->ring_size = 0;
+	plugin->prebuffering = 1;
+	plugin->target_ms = RDPSND_JITTER_MIN_MS;
 	plugin->expectingWave = 0;
 	plugin->current_format = -1;
 	plugin->thread_status = 0;
+	plugin->play_thread_status = 0;
 	plugin->ep.pVirtualChannelInit(&plugin->chan_plugin.init_handle, &plugin->channel_def, 1,
 		VIRTUAL_CHANNEL_VERSION_WIN2000, InitEvent);
 	plugin->device_data = wave_out_new();
+	plugin->dsp_data = rdpsnd_dsp_new();
 	return 1;
 }
@@ -27,7 +27,7 @@
 #include <freerdp/types_ui.h>
 #include <freerdp/constants_ui.h>
 
-#define FREERDP_INTERFACE_VERSION 2
+#define FREERDP_INTERFACE_VERSION 3
 
 #if defined _WIN32 || defined __CYGWIN__
   #ifdef FREERDP_EXPORTS
@@ -76,6 +76,7 @@ struct rdp_inst
 	int (* rdp_sync_input)(rdpInst * inst, int toggle_flags);
 	int (* rdp_channel_data)(rdpInst * inst, int chan_id, char * data, int data_size);
 	void (* rdp_disconnect)(rdpInst * inst);
+	int (* rdp_get_timings)(rdpInst * inst, RD_CONNECT_TIMINGS * timings);
 	/* calls from library to ui */
 	void (* ui_error)(rdpInst * inst, char * text);
 	void (* ui_warning)(rdpInst * inst, char * text);
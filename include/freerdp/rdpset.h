@@ -65,6 +65,12 @@ struct rdp_set
 	int triblt;
 	int new_cursors;
 	int bulk_compression;
+	int verify_signatures;
+	int auto_reconnect_attempts; /* 0 to give up when the connection drops */
+	int bitmap_cache_memory; /* KB of realised bitmaps, 0 for no limit */
+	int offscreen_cache_size; /* KB advertised, 0 for the maximum */
+	int tcp_connect_timeout; /* ms to connect to any address, 0 to leave it to the OS */
+	int mcs_pipeline_joins; /* send every channel join before the first confirm */
 	int num_channels;
 	struct rdp_chan channels[16];
 };
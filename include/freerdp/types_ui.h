@@ -97,6 +97,19 @@ typedef struct _RD_PLUGIN_DATA
 }
 RD_PLUGIN_DATA;
 
+/* milliseconds spent in each phase of the last connection */
+typedef struct _RD_CONNECT_TIMINGS
+{
+	uint32 tcp;
+	uint32 x224;
+	uint32 security; /* TLS/NLA or the RDP security exchange */
+	uint32 mcs;
+	uint32 licensing;
+	uint32 capabilities;
+	uint32 total;
+}
+RD_CONNECT_TIMINGS;
+
 /* defined in include/freerdp/freerdp.h */
 struct rdp_inst;
 typedef struct rdp_inst rdpInst;
@@ -23,23 +23,15 @@
 #include "cache.h"
 #include "rdp.h"
 #include "pstcache.h"
+#include "rdpset.h"
 #include "mem.h"
 #include "debug.h"
 
 #define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 #define IS_PERSISTENT(id) (cache->rdp->pcache->pstcache_fd[id] > 0)
-#define TO_TOP -1
 #define NOT_SET -1
 #define IS_SET(idx) (idx >= 0)
 
-/*
- * TODO: Test for optimal value of BUMP_COUNT. TO_TOP gives lowest cpu utilisation but using
- * a positive value will hopefully result in less frequently used bitmaps having a greater chance
- * of being evicted from the cache, and therby reducing the need to load bitmaps from disk.
- * (Jeroen)
- */
-#define BUMP_COUNT 40
-
 /* Setup the bitmap cache lru/mru linked list */
 void
 cache_rebuild_bmpcache_linked_list(rdpCache * cache, uint8 id, sint16 * idx, int count)
@@ -86,11 +78,11 @@ cache_rebuild_bmpcache_linked_list(rdpCache * cache, uint8 id, sint16 * idx, int
 	}
 }
 
-/* Move a bitmap to a new position in the linked list. */
+/* Move a bitmap to the mru end of the linked list, O(1) */
 void
-cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx, int bump)
+cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx)
 {
-	int p_idx, n_idx, n;
+	int p_idx, n_idx;
 
 	if (!IS_PERSISTENT(id))
 		return;
@@ -98,11 +90,12 @@ cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx, int bump)
 	if (cache->bmpcache_mru[id] == idx)
 		return;
 
-	DEBUG_RDP5("bump bitmap: id=%d, idx=%d, bump=%d\n", id, idx, bump);
+	DEBUG_RDP5("bump bitmap: id=%d, idx=%d\n", id, idx);
 
 	n_idx = cache->bmpcache[id][idx].next;
 	p_idx = cache->bmpcache[id][idx].previous;
 
+	/* not the mru, so it is linked only if it has a next */
 	if (IS_SET(n_idx))
 	{
 		/* remove */
@@ -111,70 +104,304 @@ cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx, int bump)
 			cache->bmpcache[id][p_idx].next = n_idx;
 		else
 			cache->bmpcache_lru[id] = n_idx;
-		if (IS_SET(n_idx))
-			cache->bmpcache[id][n_idx].previous = p_idx;
-		else
-			cache->bmpcache_mru[id] = p_idx;
+		cache->bmpcache[id][n_idx].previous = p_idx;
 	}
+
+	/* insert */
+	++(cache->bmpcache_count[id]);
+	p_idx = cache->bmpcache_mru[id];
+	cache->bmpcache[id][idx].previous = p_idx;
+	cache->bmpcache[id][idx].next = NOT_SET;
+
+	if (IS_SET(p_idx))
+		cache->bmpcache[id][p_idx].next = idx;
 	else
+		cache->bmpcache_lru[id] = idx;
+
+	cache->bmpcache_mru[id] = idx;
+}
+
+static void
+cache_charge(rdpCache * cache, int kind, int bytes)
+{
+	struct cache_budget * budget;
+
+	budget = &(cache->budget[kind]);
+	budget->bytes += bytes;
+	if (budget->bytes > budget->peak)
+		budget->peak = budget->bytes;
+}
+
+/* Evict until the bitmaps fit settings->bitmap_cache_memory or nothing
+   more can go.  Only entries of the persistent tiers that are on disk
+   can be evicted, a dropped entry is reloaded on its next use.  Shared,
+   volatile and unsaved bitmaps stay whatever the limit, so it is held
+   against the bytes eviction can give back rather than the total. */
+static void
+cache_enforce_budget(rdpCache * cache, int kind)
+{
+	struct cache_budget * budget;
+	uint32 evictable;
+	uint32 limit;
+	uint32 bytes;
+
+	budget = &(cache->budget[kind]);
+	limit = cache->rdp->settings->bitmap_cache_memory * 1024;
+	if (kind != CACHE_BUDGET_BITMAP || limit == 0 || budget->evict == NULL ||
+	    budget->bytes <= limit)
+		return;
+
+	evictable = budget->evictable(cache);
+	while (evictable > limit)
+	{
+		bytes = budget->bytes;
+		if (!budget->evict(cache) || budget->bytes >= bytes ||
+		    bytes - budget->bytes >= evictable)
+			break;
+		evictable -= bytes - budget->bytes;
+	}
+}
+
+static uint64
+cache_hash_bitmap(int width, int height, int size, uint8 * data)
+{
+	uint64 hash;
+	int i;
+
+	/* FNV-1a */
+	hash = 14695981039346656037ULL ^ ((width << 16) | height);
+	for (i = 0; i < size; i++)
 	{
-		p_idx = NOT_SET;
-		n_idx = cache->bmpcache_lru[id];
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
 	}
+	return hash;
+}
+
+static int
+cache_bitmap_bucket(RD_HBITMAP bitmap)
+{
+	unsigned long p;
+
+	p = (unsigned long) bitmap;
+	return ((p >> 4) ^ (p >> 16)) & (BMPCACHE_SHARE_BUCKETS - 1);
+}
+
+static struct bmpcache_share *
+cache_find_share(rdpCache * cache, RD_HBITMAP bitmap)
+{
+	struct bmpcache_share * share;
 
-	if (bump >= 0)
+	share = cache->share_by_bitmap[cache_bitmap_bucket(bitmap)];
+	while (share != NULL && share->bitmap != bitmap)
+		share = share->next_bitmap;
+	return share;
+}
+
+/* bytes charged to the budget, a hashed bitmap also keeps its pixels */
+static int
+cache_share_bytes(struct bmpcache_share * share)
+{
+	return share->hashed ? share->size * 2 : share->size;
+}
+
+/* Realise a bitmap, or take another reference on an identical one that
+   is already cached.  Servers resend the same tile under other ids and
+   indexes, each copy would otherwise be decoded into its own ui bitmap. */
+RD_HBITMAP
+cache_create_bitmap(rdpCache * cache, int width, int height, int Bpp, uint8 * data)
+{
+	struct bmpcache_share * share;
+	RD_HBITMAP bitmap;
+	RD_BOOL hashed;
+	uint64 hash;
+	int size;
+
+	size = width * height * Bpp;
+	hash = 0;
+
+	/* 8 bit bitmaps are realised through the current colourmap, they are
+	   tracked for their size but never shared */
+	hashed = cache->rdp->settings->server_depth > 8;
+	if (hashed)
 	{
-		for (n = 0; n < bump && IS_SET(n_idx); n++)
+		hash = cache_hash_bitmap(width, height, size, data);
+		for (share = cache->share_by_hash[hash & (BMPCACHE_SHARE_BUCKETS - 1)];
+		     share != NULL; share = share->next_hash)
 		{
-			p_idx = n_idx;
-			n_idx = cache->bmpcache[id][p_idx].next;
+			if (share->hash == hash && share->width == width &&
+			    share->height == height && share->size == size &&
+			    memcmp(share->data, data, size) == 0)
+			{
+				share->refs++;
+				cache->share_hits++;
+				cache->share_bytes_saved += size;
+				return share->bitmap;
+			}
 		}
+		cache->share_misses++;
 	}
-	else
+
+	bitmap = ui_create_bitmap(cache->rdp->inst, width, height, data);
+	if (bitmap == NULL)
+		return NULL;
+
+	share = (struct bmpcache_share *) xmalloc(sizeof(struct bmpcache_share));
+	share->hash = hash;
+	share->bitmap = bitmap;
+	share->width = width;
+	share->height = height;
+	share->size = size;
+	share->refs = 1;
+	share->hashed = hashed;
+	share->data = NULL;
+	if (hashed)
 	{
-		p_idx = cache->bmpcache_mru[id];
-		n_idx = NOT_SET;
+		share->data = (uint8 *) xmalloc(size);
+		memcpy(share->data, data, size);
+		share->next_hash = cache->share_by_hash[hash & (BMPCACHE_SHARE_BUCKETS - 1)];
+		cache->share_by_hash[hash & (BMPCACHE_SHARE_BUCKETS - 1)] = share;
 	}
+	share->next_bitmap = cache->share_by_bitmap[cache_bitmap_bucket(bitmap)];
+	cache->share_by_bitmap[cache_bitmap_bucket(bitmap)] = share;
+	cache_charge(cache, CACHE_BUDGET_BITMAP, cache_share_bytes(share));
+	return bitmap;
+}
 
-	/* insert */
-	++(cache->bmpcache_count[id]);
-	cache->bmpcache[id][idx].previous = p_idx;
-	cache->bmpcache[id][idx].next = n_idx;
+/* Drop a reference, the ui bitmap goes when the last entry using it does */
+static void
+cache_release_bitmap(rdpCache * cache, RD_HBITMAP bitmap)
+{
+	struct bmpcache_share ** link;
+	struct bmpcache_share * share;
 
-	if (p_idx >= 0)
-		cache->bmpcache[id][p_idx].next = idx;
-	else
-		cache->bmpcache_lru[id] = idx;
+	link = &(cache->share_by_bitmap[cache_bitmap_bucket(bitmap)]);
+	while (*link != NULL && (*link)->bitmap != bitmap)
+		link = &((*link)->next_bitmap);
 
-	if (n_idx >= 0)
-		cache->bmpcache[id][n_idx].previous = idx;
-	else
-		cache->bmpcache_mru[id] = idx;
+	share = *link;
+	if (share == NULL)
+	{
+		/* not from cache_create_bitmap */
+		ui_destroy_bitmap(cache->rdp->inst, bitmap);
+		return;
+	}
+
+	if (--(share->refs) > 0)
+		return;
+
+	*link = share->next_bitmap;
+	if (share->hashed)
+	{
+		link = &(cache->share_by_hash[share->hash & (BMPCACHE_SHARE_BUCKETS - 1)]);
+		while (*link != share)
+			link = &((*link)->next_hash);
+		*link = share->next_hash;
+		xfree(share->data);
+	}
+
+	cache_charge(cache, CACHE_BUDGET_BITMAP, -cache_share_bytes(share));
+	ui_destroy_bitmap(cache->rdp->inst, bitmap);
+	xfree(share);
 }
 
-/* Evict the least-recently used bitmap from the cache */
-void
-cache_evict_bitmap(rdpCache * cache, uint8 id)
+/* bytes dropping an entry gives back, 0 if it is not on disk or its ui
+   bitmap is still used by other entries */
+static int
+cache_bitmap_reclaim(rdpCache * cache, uint8 id, int idx)
+{
+	struct bmpcache_share * share;
+
+	if (!pstcache_has_bitmap(cache->rdp->pcache, id, idx))
+		return 0;
+	share = cache_find_share(cache, cache->bmpcache[id][idx].bitmap);
+	if (share == NULL || share->refs > 1)
+		return 0;
+	return cache_share_bytes(share);
+}
+
+/* Evict the least-recently used bitmap that can be reloaded from the
+   persistent store.  The server still counts every entry as present, so
+   one that was never saved under its current key has to stay.  With
+   reclaim only an entry whose memory goes with it is picked. */
+static RD_BOOL
+cache_evict_bitmap_lru(rdpCache * cache, uint8 id, RD_BOOL reclaim)
 {
-	uint16 idx;
+	int idx;
+	int p_idx;
 	int n_idx;
 
 	if (!IS_PERSISTENT(id))
-		return;
+		return False;
 
 	idx = cache->bmpcache_lru[id];
+	while (IS_SET(idx) && idx != cache->bmpcache_mru[id] &&
+	       (reclaim ? cache_bitmap_reclaim(cache, id, idx) == 0 :
+	        !pstcache_has_bitmap(cache->rdp->pcache, id, idx)))
+		idx = cache->bmpcache[id][idx].next;
+
+	if (!IS_SET(idx) || idx == cache->bmpcache_mru[id])
+		return False;
+
 	n_idx = cache->bmpcache[id][idx].next;
+	p_idx = cache->bmpcache[id][idx].previous;
 /*	DEBUG_RDP5("evict bitmap: id=%d idx=%d n_idx=%d bmp=0x%x\n", id, idx, n_idx,
 		    cache->bmpcache[id][idx].bitmap); */
 
-	ui_destroy_bitmap(cache->rdp->inst, cache->bmpcache[id][idx].bitmap);
+	cache_release_bitmap(cache, cache->bmpcache[id][idx].bitmap);
 	--(cache->bmpcache_count[id]);
 	cache->bmpcache[id][idx].bitmap = 0;
 
-	cache->bmpcache_lru[id] = n_idx;
-	cache->bmpcache[id][n_idx].previous = NOT_SET;
+	if (IS_SET(p_idx))
+		cache->bmpcache[id][p_idx].next = n_idx;
+	else
+		cache->bmpcache_lru[id] = n_idx;
+	cache->bmpcache[id][n_idx].previous = p_idx;
 
 	pstcache_touch_bitmap(cache->rdp->pcache, id, idx, 0);
+	return True;
+}
+
+RD_BOOL
+cache_evict_bitmap(rdpCache * cache, uint8 id)
+{
+	return cache_evict_bitmap_lru(cache, id, False);
+}
+
+/* CACHE_BUDGET_BITMAP eviction callback, the mru entry is never dropped */
+static RD_BOOL
+cache_evict_any_bitmap(rdpCache * cache)
+{
+	int id;
+
+	for (id = NUM_ELEMENTS(cache->bmpcache) - 1; id >= 0; id--)
+	{
+		if (IS_PERSISTENT(id) && cache->bmpcache_count[id] > 1 &&
+		    cache_evict_bitmap_lru(cache, id, True))
+			return True;
+	}
+	return False;
+}
+
+/* CACHE_BUDGET_BITMAP evictable callback, walks the same entries */
+static uint32
+cache_evictable_bitmaps(rdpCache * cache)
+{
+	uint32 bytes;
+	int id;
+	int idx;
+
+	bytes = 0;
+	for (id = NUM_ELEMENTS(cache->bmpcache) - 1; id >= 0; id--)
+	{
+		if (!IS_PERSISTENT(id))
+			continue;
+		for (idx = cache->bmpcache_lru[id];
+		     IS_SET(idx) && idx != cache->bmpcache_mru[id];
+		     idx = cache->bmpcache[id][idx].next)
+			bytes += cache_bitmap_reclaim(cache, id, idx);
+	}
+	return bytes;
 }
 
 /* Retrieve a bitmap from the cache */
@@ -187,7 +414,7 @@ cache_get_bitmap(rdpCache * cache, uint8 id, uint16 idx)
 		    pstcache_load_bitmap(cache->rdp->pcache, id, idx))
 		{
 			if (IS_PERSISTENT(id))
-				cache_bump_bitmap(cache, id, idx, BUMP_COUNT);
+				cache_bump_bitmap(cache, id, idx);
 
 			return cache->bmpcache[id][idx].bitmap;
 		}
@@ -214,7 +441,7 @@ cache_put_bitmap(rdpCache * cache, uint8 id, uint16 idx, RD_HBITMAP bitmap)
 	{
 		old = cache->bmpcache[id][idx].bitmap;
 		if (old != NULL)
-			ui_destroy_bitmap(cache->rdp->inst, old);
+			cache_release_bitmap(cache, old);
 		cache->bmpcache[id][idx].bitmap = bitmap;
 
 		if (IS_PERSISTENT(id))
@@ -223,16 +450,17 @@ cache_put_bitmap(rdpCache * cache, uint8 id, uint16 idx, RD_HBITMAP bitmap)
 				cache->bmpcache[id][idx].previous =
 				cache->bmpcache[id][idx].next = NOT_SET;
 
-			cache_bump_bitmap(cache, id, idx, TO_TOP);
+			cache_bump_bitmap(cache, id, idx);
 			if (cache->bmpcache_count[id] > BMPCACHE2_C2_CELLS)
 				cache_evict_bitmap(cache, id);
+			cache_enforce_budget(cache, CACHE_BUDGET_BITMAP);
 		}
 	}
 	else if ((id < NUM_ELEMENTS(cache->volatile_bc)) && (idx == 0x7fff))
 	{
 		old = cache->volatile_bc[id];
 		if (old != NULL)
-			ui_destroy_bitmap(cache->rdp->inst, old);
+			cache_release_bitmap(cache, old);
 		cache->volatile_bc[id] = bitmap;
 	}
 	else if ((id == 255) && (idx < NUM_ELEMENTS(cache->drawing_surface)))
@@ -245,6 +473,25 @@ cache_put_bitmap(rdpCache * cache, uint8 id, uint16 idx, RD_HBITMAP bitmap)
 	}
 }
 
+/* Store an offscreen surface, NULL frees the slot.  The server manages
+   these within the size advertised in the offscreen capability set, we
+   only account for them. */
+void
+cache_put_surface(rdpCache * cache, uint16 idx, RD_HBITMAP surface, int width, int height)
+{
+	if (idx >= NUM_ELEMENTS(cache->drawing_surface))
+	{
+		ui_error(cache->rdp->inst, "put surface %d\n", idx);
+		return;
+	}
+
+	cache_charge(cache, CACHE_BUDGET_SURFACE, -cache->drawing_surface_size[idx]);
+	cache->drawing_surface[idx] = surface;
+	cache->drawing_surface_size[idx] = surface == NULL ? 0 :
+		width * height * ((cache->rdp->settings->server_depth + 7) / 8);
+	cache_charge(cache, CACHE_BUDGET_SURFACE, cache->drawing_surface_size[idx]);
+}
+
 /* Updates the persistent bitmap cache MRU information on exit */
 void
 cache_save_state(rdpCache * cache)
@@ -294,7 +541,12 @@ cache_put_font(rdpCache * cache, uint8 font, uint16 character, uint16 offset,
 	{
 		glyph = &(cache->fontcache[font][character]);
 		if (glyph->pixmap != NULL)
+		{
 			ui_destroy_glyph(cache->rdp->inst, glyph->pixmap);
+			cache_charge(cache, CACHE_BUDGET_GLYPH, -((glyph->width + 7) / 8) * glyph->height);
+		}
+		if (pixmap != NULL)
+			cache_charge(cache, CACHE_BUDGET_GLYPH, ((width + 7) / 8) * height);
 
 		glyph->offset = offset;
 		glyph->baseline = baseline;
@@ -421,6 +673,8 @@ cache_new(struct rdp_rdp * rdp)
 		self->bmpcache_mru[0] = NOT_SET;
 		self->bmpcache_mru[1] = NOT_SET;
 		self->bmpcache_mru[2] = NOT_SET;
+		self->budget[CACHE_BUDGET_BITMAP].evict = cache_evict_any_bitmap;
+		self->budget[CACHE_BUDGET_BITMAP].evictable = cache_evictable_bitmaps;
 	}
 	return self;
 }
@@ -470,9 +724,21 @@ cache_free(rdpCache * cache)
 				{
 					bmp = cache->bmpcache[cache_id][cache_idx].bitmap;
 					if (bmp != NULL)
-						ui_destroy_bitmap(cache->rdp->inst, bmp);
+						cache_release_bitmap(cache, bmp);
 				}
 			}
+			for (cache_id = 0; cache_id < NUM_ELEMENTS(cache->volatile_bc); cache_id++)
+			{
+				bmp = cache->volatile_bc[cache_id];
+				if (bmp != NULL)
+					cache_release_bitmap(cache, bmp);
+			}
+			DEBUG("shared bitmaps: %u hits %u misses %u bytes saved\n",
+				cache->share_hits, cache->share_misses, cache->share_bytes_saved);
+			DEBUG("peak bytes: bitmaps %u surfaces %u glyphs %u\n",
+				cache->budget[CACHE_BUDGET_BITMAP].peak,
+				cache->budget[CACHE_BUDGET_SURFACE].peak,
+				cache->budget[CACHE_BUDGET_GLYPH].peak);
 			for (cache_id = 0; cache_id < NUM_ELEMENTS(cache->drawing_surface); cache_id++)
 			{
 				bmp = cache->drawing_surface[cache_id];
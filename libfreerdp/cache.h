@@ -28,12 +28,48 @@ struct bmpcache_entry
 	sint16 next;
 };
 
+/* one realised bitmap shared by every cache entry with the same pixels */
+struct bmpcache_share
+{
+	uint64 hash;
+	RD_HBITMAP bitmap;
+	int width;
+	int height;
+	int size;
+	int refs;
+	RD_BOOL hashed;
+	uint8 * data; /* pixels of a hashed bitmap, a hash match is checked against them */
+	struct bmpcache_share * next_hash;
+	struct bmpcache_share * next_bitmap;
+};
+
+#define BMPCACHE_SHARE_BUCKETS 4096
+
+struct rdp_cache;
+
+/* bytes held by one kind of cached ui resource, evict is NULL when the
+   server owns the entries and nothing can be dropped behind its back,
+   evictable tells how many of the bytes evict could give back */
+struct cache_budget
+{
+	uint32 bytes;
+	uint32 peak;
+	RD_BOOL (*evict)(struct rdp_cache * cache);
+	uint32 (*evictable)(struct rdp_cache * cache);
+};
+
+#define CACHE_BUDGET_BITMAP	0
+#define CACHE_BUDGET_SURFACE	1
+#define CACHE_BUDGET_GLYPH	2
+#define CACHE_BUDGETS		3
+
 struct rdp_cache
 {
 	struct rdp_rdp * rdp;
 	struct bmpcache_entry bmpcache[3][0xa00];
 	RD_HBITMAP volatile_bc[3];
 	RD_HBITMAP drawing_surface[100];
+	int drawing_surface_size[100];
 	int bmpcache_lru[3];
 	int bmpcache_mru[3];
 	int bmpcache_count[3];
@@ -41,20 +77,30 @@ struct rdp_cache
 	DATABLOB textcache[256];
 	RD_HCURSOR cursorcache[0x20];
 	RD_BRUSHDATA brushcache[2][64];
+	struct bmpcache_share * share_by_hash[BMPCACHE_SHARE_BUCKETS];
+	struct bmpcache_share * share_by_bitmap[BMPCACHE_SHARE_BUCKETS];
+	uint32 share_hits;
+	uint32 share_misses;
+	uint32 share_bytes_saved;
+	struct cache_budget budget[CACHE_BUDGETS];
 };
 typedef struct rdp_cache rdpCache;
 
 void
 cache_rebuild_bmpcache_linked_list(rdpCache * cache, uint8 id, sint16 * idx, int count);
 void
-cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx, int bump);
-void
+cache_bump_bitmap(rdpCache * cache, uint8 id, uint16 idx);
+RD_BOOL
 cache_evict_bitmap(rdpCache * cache, uint8 id);
 RD_HBITMAP
+cache_create_bitmap(rdpCache * cache, int width, int height, int Bpp, uint8 * data);
+RD_HBITMAP
 cache_get_bitmap(rdpCache * cache, uint8 id, uint16 idx);
 void
 cache_put_bitmap(rdpCache * cache, uint8 id, uint16 idx, RD_HBITMAP bitmap);
 void
+cache_put_surface(rdpCache * cache, uint16 idx, RD_HBITMAP surface, int width, int height);
+void
 cache_save_state(rdpCache * cache);
 FONTGLYPH *
 cache_get_font(rdpCache * cache, uint8 font, uint16 character);
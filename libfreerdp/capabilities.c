@@ -577,13 +577,19 @@ rdp_out_sound_capset(STREAM s)
 
 /* Output offscreen cache capability set */
 void
-rdp_out_offscreenscache_capset(STREAM s)
+rdp_out_offscreenscache_capset(rdpRdp * rdp, STREAM s)
 {
 	uint8 * header;
+	int size;
+
+	/* the server keeps its offscreen surfaces within this */
+	size = rdp->settings->offscreen_cache_size;
+	if (size <= 0 || size > 7680)
+		size = 7680;
 
 	header = rdp_skip_capset_header(s, 4);
 	out_uint32_le(s, 1); // offscreenSupportLevel, either TRUE (0x1) or FALSE (0x0)
-	out_uint16_le(s, 7680); // offscreenCacheSize, maximum is 7680 (in KB)
+	out_uint16_le(s, size); // offscreenCacheSize, maximum is 7680 (in KB)
 	out_uint16_le(s, 100); // offscreenCacheEntries, maximum is 500 entries
 	rdp_out_capset_header(s, header, CAPSET_TYPE_OFFSCREENCACHE);
 }
@@ -837,7 +843,7 @@ rdp_out_multifragmentupdate_capset(STREAM s)
 	* fast-path update. The size of this buffer places a cap on the
 	* size of the largest fast-path update that can be fragmented.
 	*/
-	out_uint32_le(s, 0x2000); // maxRequestSize
+	out_uint32_le(s, RDP5_MAX_REQUEST_SIZE); // maxRequestSize
 	rdp_out_capset_header(s, header, CAPSET_TYPE_MULTIFRAGMENTUPDATE);
 }
 
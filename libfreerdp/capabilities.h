@@ -53,7 +53,7 @@ rdp_out_glyphcache_capset(STREAM s);
 void
 rdp_out_sound_capset(STREAM s);
 void
-rdp_out_offscreenscache_capset(STREAM s);
+rdp_out_offscreenscache_capset(rdpRdp * rdp, STREAM s);
 void
 rdp_out_bitmapcache_hostsupport_capset(rdpRdp * rdp, STREAM s);
 void
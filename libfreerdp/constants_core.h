@@ -114,6 +114,17 @@
 
 #define RDP5_COMPRESSED		0x80
 
+/* fast-path updateHeader, updateCode and fragmentation fields */
+#define RDP5_UPDATE_MASK	0x0f
+#define RDP5_FRAGMENT_MASK	0x30
+#define RDP5_FRAGMENT_SINGLE	0x00
+#define RDP5_FRAGMENT_LAST	0x10
+#define RDP5_FRAGMENT_FIRST	0x20
+#define RDP5_FRAGMENT_NEXT	0x30
+
+/* largest fragmented fast-path update we reassemble, sent as MaxRequestSize */
+#define RDP5_MAX_REQUEST_SIZE	0x3F0000
+
 /* OS Major Types */
 #define OS_MAJOR_TYPE_UNSPECIFIED	0x0000
 #define OS_MAJOR_TYPE_WINDOWS		0x0001
@@ -56,7 +56,8 @@ enum RDP_BASIC_SEC_FLAGS
 	SEC_IGNORE_SEQNO = 0x0020,	/* ignore */
 	SEC_INFO_PKT = 0x0040,
 	SEC_LICENSE_PKT = 0x0080,
-	SEC_REDIRECTION_PKT = 0x0400
+	SEC_REDIRECTION_PKT = 0x0400,
+	SEC_SECURE_CHECKSUM = 0x0800
 };
 
 /* User Data Header types */
@@ -84,6 +84,23 @@ enum RDP_DATA_PDU_TYPE
 	RDP_DATA_PDU_SET_ERROR_INFO = 47
 };
 
+/* RDP Save Session Info PDU infoType */
+enum RDP_LOGON_INFO_TYPE
+{
+	INFOTYPE_LOGON = 0,
+	INFOTYPE_LOGON_LONG = 1,
+	INFOTYPE_LOGON_PLAINNOTIFY = 2,
+	INFOTYPE_LOGON_EXTENDED_INFO = 3
+};
+
+/* RDP Logon Info Extended FieldsPresent */
+#define LOGON_EX_AUTORECONNECTCOOKIE	0x00000001
+#define LOGON_EX_LOGONERRORS		0x00000002
+
+/* ARC_SC_PRIVATE_PACKET and ARC_CS_PRIVATE_PACKET */
+#define ARC_PACKET_LENGTH	28
+#define ARC_RANDOM_LENGTH	16
+
 /* RDP Control PDU Data actions */
 enum RDP_CONTROL_PDU_TYPE
 {
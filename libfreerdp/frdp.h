@@ -57,7 +57,7 @@ ui_unimpl(rdpInst * inst, char * format, ...);
 void
 hexdump(unsigned char * p, int len);
 int
-load_licence(unsigned char ** data);
+load_licence(char * server, char * hostname, unsigned char ** data);
 RD_BOOL
 rd_lock_file(int fd, int start, int len);
 int
@@ -72,10 +72,38 @@ int
 rd_read_file(int fd, void * ptr, int len);
 int
 rd_open_file(char * filename);
+RD_BOOL
+rd_lock_file_wait(int fd, int start, int len);
+void
+rd_unlock_file(int fd, int start, int len);
+RD_BOOL
+rd_share_lock_file(int fd, int start, int len);
+RD_BOOL
+rd_file_locked(int fd, int start, int len);
+int
+rd_read_file_at(int fd, int offset, void * ptr, int len);
+int
+rd_write_file_at(int fd, int offset, void * ptr, int len);
+void
+rd_advise_file(int fd, int offset, int len);
+uint32
+rd_get_ticks(void);
+void
+rd_sleep(uint32 millis);
+struct rd_timer *
+rd_timer_new(void);
+void
+rd_timer_free(struct rd_timer * timer);
+void
+rd_timer_set(struct rd_timer * timer, uint32 millis);
+RD_BOOL
+rd_timer_expired(struct rd_timer * timer);
+void *
+rd_timer_get_fd(struct rd_timer * timer);
 void
 generate_random(uint8 * random);
 void
-save_licence(unsigned char * data, int length);
+save_licence(char * server, char * hostname, unsigned char * data, int length);
 void
 ui_begin_update(rdpInst * inst);
 void
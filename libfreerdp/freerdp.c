@@ -3,6 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#endif
 #include "frdp.h"
 #include "freerdp.h"
 #include "rdp.h"
@@ -103,11 +112,7 @@ hexdump(unsigned char * p, int len)
 	}
 }
 
-int
-load_licence(unsigned char ** data)
-{
-	return 0;
-}
+#ifdef _WIN32
 
 RD_BOOL
 rd_lock_file(int fd, int start, int len)
@@ -146,10 +151,552 @@ rd_read_file(int fd, void * ptr, int len)
 
 int
 rd_open_file(char * filename)
+{
+	return -1;
+}
+
+RD_BOOL
+rd_lock_file_wait(int fd, int start, int len)
+{
+	return 0;
+}
+
+void
+rd_unlock_file(int fd, int start, int len)
+{
+}
+
+RD_BOOL
+rd_share_lock_file(int fd, int start, int len)
+{
+	return 0;
+}
+
+RD_BOOL
+rd_file_locked(int fd, int start, int len)
+{
+	return 0;
+}
+
+int
+rd_read_file_at(int fd, int offset, void * ptr, int len)
+{
+	return 0;
+}
+
+int
+rd_write_file_at(int fd, int offset, void * ptr, int len)
+{
+	return 0;
+}
+
+void
+rd_advise_file(int fd, int offset, int len)
+{
+}
+
+uint32
+rd_get_ticks(void)
+{
+	return GetTickCount();
+}
+
+void
+rd_sleep(uint32 millis)
+{
+	Sleep(millis);
+}
+
+struct rd_timer
+{
+	HANDLE handle;
+};
+
+struct rd_timer *
+rd_timer_new(void)
+{
+	struct rd_timer * timer;
+
+	timer = (struct rd_timer *) xmalloc(sizeof(struct rd_timer));
+	timer->handle = CreateWaitableTimer(NULL, TRUE, NULL);
+	return timer;
+}
+
+void
+rd_timer_free(struct rd_timer * timer)
+{
+	if (timer != NULL)
+	{
+		CloseHandle(timer->handle);
+		xfree(timer);
+	}
+}
+
+void
+rd_timer_set(struct rd_timer * timer, uint32 millis)
+{
+	LARGE_INTEGER due;
+
+	due.QuadPart = -((LONGLONG) millis * 10000);
+	SetWaitableTimer(timer->handle, &due, 0, NULL, NULL, FALSE);
+}
+
+RD_BOOL
+rd_timer_expired(struct rd_timer * timer)
+{
+	if (WaitForSingleObject(timer->handle, 0) != WAIT_OBJECT_0)
+		return False;
+	CancelWaitableTimer(timer->handle);
+	return True;
+}
+
+void *
+rd_timer_get_fd(struct rd_timer * timer)
+{
+	return (void *) timer->handle;
+}
+
+int
+load_licence(char * server, char * hostname, unsigned char ** data)
 {
 	return 0;
 }
 
+void
+save_licence(char * server, char * hostname, unsigned char * data, int length)
+{
+}
+
+#else
+
+/* take an advisory write lock so a second session for the same user
+   does not scribble over a cache file that is in use */
+RD_BOOL
+rd_lock_file(int fd, int start, int len)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	if (fcntl(fd, F_SETLK, &lock) == -1)
+		return False;
+	return True;
+}
+
+/* like rd_lock_file but sleeps until the range is free */
+RD_BOOL
+rd_lock_file_wait(int fd, int start, int len)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	while (fcntl(fd, F_SETLKW, &lock) == -1)
+	{
+		if (errno != EINTR)
+			return False;
+	}
+	return True;
+}
+
+void
+rd_unlock_file(int fd, int start, int len)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	fcntl(fd, F_SETLK, &lock);
+}
+
+/* take an advisory read lock, any number of processes can hold one on
+   the same range and it goes away with the process */
+RD_BOOL
+rd_share_lock_file(int fd, int start, int len)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_RDLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	while (fcntl(fd, F_SETLK, &lock) == -1)
+	{
+		if (errno != EINTR)
+			return False;
+	}
+	return True;
+}
+
+/* True if another process holds any lock on the range, locks of this
+   process are not reported */
+RD_BOOL
+rd_file_locked(int fd, int start, int len)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	if (fcntl(fd, F_GETLK, &lock) == -1)
+		return False;
+	return lock.l_type != F_UNLCK;
+}
+
+int
+rd_lseek_file(int fd, int offset)
+{
+	return (int) lseek(fd, offset, SEEK_SET);
+}
+
+int
+rd_write_file(int fd, void * ptr, int len)
+{
+	char * p;
+	int written;
+	int rv;
+
+	p = (char *) ptr;
+	written = 0;
+	while (written < len)
+	{
+		rv = write(fd, p + written, len - written);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return written > 0 ? written : rv;
+		written += rv;
+	}
+	return written;
+}
+
+static RD_BOOL
+rd_mkdir(const char * path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0)
+		return S_ISDIR(st.st_mode) ? True : False;
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return False;
+	return True;
+}
+
+/* the cache lives in ~/.freerdp/cache, created on first use */
+RD_BOOL
+rd_pstcache_mkdir(void)
+{
+	char * home;
+	char path[256];
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return False;
+
+	snprintf(path, sizeof(path), "%s/.freerdp", home);
+	if (!rd_mkdir(path))
+		return False;
+
+	snprintf(path, sizeof(path), "%s/.freerdp/cache", home);
+	if (!rd_mkdir(path))
+		return False;
+
+	return True;
+}
+
+void
+rd_close_file(int fd)
+{
+	close(fd);
+}
+
+int
+rd_read_file(int fd, void * ptr, int len)
+{
+	char * p;
+	int got;
+	int rv;
+
+	p = (char *) ptr;
+	got = 0;
+	while (got < len)
+	{
+		rv = read(fd, p + got, len - got);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return got > 0 ? got : rv;
+		got += rv;
+	}
+	return got;
+}
+
+/* positioned variants, these leave the file offset alone so several
+   users of one fd do not race on lseek */
+int
+rd_read_file_at(int fd, int offset, void * ptr, int len)
+{
+	char * p;
+	int got;
+	int rv;
+
+	p = (char *) ptr;
+	got = 0;
+	while (got < len)
+	{
+		rv = pread(fd, p + got, len - got, offset + got);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return got > 0 ? got : rv;
+		got += rv;
+	}
+	return got;
+}
+
+int
+rd_write_file_at(int fd, int offset, void * ptr, int len)
+{
+	char * p;
+	int written;
+	int rv;
+
+	p = (char *) ptr;
+	written = 0;
+	while (written < len)
+	{
+		rv = pwrite(fd, p + written, len - written, offset + written);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return written > 0 ? written : rv;
+		written += rv;
+	}
+	return written;
+}
+
+/* hint that a range will be read soon, the kernel reads it in the
+   background */
+void
+rd_advise_file(int fd, int offset, int len)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* milliseconds from an arbitrary start, only differences mean anything */
+uint32
+rd_get_ticks(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint32) (tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+void
+rd_sleep(uint32 millis)
+{
+	struct timespec ts;
+
+	ts.tv_sec = millis / 1000;
+	ts.tv_nsec = (millis % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* a one shot timer the ui can select on next to the socket */
+struct rd_timer
+{
+	int fd;
+};
+
+struct rd_timer *
+rd_timer_new(void)
+{
+	struct rd_timer * timer;
+
+	timer = (struct rd_timer *) xmalloc(sizeof(struct rd_timer));
+	timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer->fd == -1)
+	{
+		perror("timerfd_create");
+		xfree(timer);
+		return NULL;
+	}
+	return timer;
+}
+
+void
+rd_timer_free(struct rd_timer * timer)
+{
+	if (timer != NULL)
+	{
+		close(timer->fd);
+		xfree(timer);
+	}
+}
+
+void
+rd_timer_set(struct rd_timer * timer, uint32 millis)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	/* a zero it_value would disarm it */
+	its.it_value.tv_sec = millis / 1000;
+	its.it_value.tv_nsec = (millis % 1000) * 1000000 + 1;
+	timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+/* True once the timer has fired, and clears it */
+RD_BOOL
+rd_timer_expired(struct rd_timer * timer)
+{
+	uint64 expirations;
+
+	return read(timer->fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+void *
+rd_timer_get_fd(struct rd_timer * timer)
+{
+	return (void *) (long) timer->fd;
+}
+
+/* filename is relative to ~/.freerdp, returns -1 on error */
+int
+rd_open_file(char * filename)
+{
+	char * home;
+	char path[256];
+	int fd;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/.freerdp/%s", home, filename);
+	fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	return fd;
+}
+
+
+/* ~/.freerdp/licence.<hostname>.<server>, a CAL is only valid for the
+   client name it was issued to and the server that issued it */
+static RD_BOOL
+rd_licence_path(char * path, int size, char * server, char * hostname)
+{
+	char * home;
+	char * p;
+	int len;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return False;
+
+	len = snprintf(path, size, "%s/.freerdp/licence.", home);
+	if (len <= 0 || len >= size)
+		return False;
+	snprintf(path + len, size - len, "%s.%s", hostname, server);
+	for (p = path + len; *p != 0; p++)
+	{
+		if (*p == '/')
+			*p = '_';
+	}
+	return True;
+}
+
+int
+load_licence(char * server, char * hostname, unsigned char ** data)
+{
+	char path[256];
+	struct stat st;
+	unsigned char * buf;
+	int fd;
+
+	*data = NULL;
+	if (!rd_licence_path(path, sizeof(path), server, hostname))
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	/* the LicenseInfo blob length goes out as 16 bits */
+	if (fstat(fd, &st) == -1 || st.st_size <= 0 || st.st_size > 0xffff)
+	{
+		close(fd);
+		return 0;
+	}
+
+	buf = (unsigned char *) xmalloc(st.st_size);
+	if (rd_read_file(fd, buf, st.st_size) != st.st_size)
+	{
+		xfree(buf);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	*data = buf;
+	return st.st_size;
+}
+
+/* written to a temporary file and renamed over the old one so an
+   interrupted save never leaves a truncated licence behind */
+void
+save_licence(char * server, char * hostname, unsigned char * data, int length)
+{
+	char path[256];
+	char tmp[264];
+	char * home;
+	int fd;
+
+	if (length <= 0 || length > 0xffff)
+		return;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return;
+	snprintf(path, sizeof(path), "%s/.freerdp", home);
+	if (!rd_mkdir(path))
+		return;
+
+	if (!rd_licence_path(path, sizeof(path), server, hostname))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return;
+
+	if (rd_write_file(fd, data, length) != length || fsync(fd) == -1)
+	{
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, path) == -1)
+		unlink(tmp);
+}
+#endif
+
 void
 generate_random(uint8 * random)
 {
@@ -163,11 +710,6 @@ generate_random(uint8 * random)
 	}
 }
 
-void
-save_licence(unsigned char * data, int length)
-{
-}
-
 void
 ui_begin_update(rdpInst * inst)
 {
@@ -178,6 +720,8 @@ void
 ui_end_update(rdpInst * inst)
 {
 	inst->ui_end_update(inst);
+	/* nothing from the update outlives it, drop the scratch memory */
+	arena_reset(RDP_FROM_INST(inst)->arena);
 }
 
 void
@@ -441,6 +985,13 @@ l_rdp_get_fds(rdpInst * inst, void ** read_fds, int * read_count,
 	rdpRdp * rdp;
 
 	rdp = RDP_FROM_INST(inst);
+	if (rdp->arc_attempt != 0)
+	{
+		/* no socket while waiting to reconnect, wake up for the next try */
+		read_fds[*read_count] = rd_timer_get_fd(rdp->arc_timer);
+		(*read_count)++;
+		return 0;
+	}
 #ifdef _WIN32
 	read_fds[*read_count] = (void *) (rdp->sec->mcs->iso->tcp->wsa_event);
 #else
@@ -459,6 +1010,12 @@ l_rdp_check_fds(rdpInst * inst)
 	int rv;
 
 	rdp = RDP_FROM_INST(inst);
+	if (rdp->arc_attempt != 0)
+	{
+		if (!rd_timer_expired(rdp->arc_timer))
+			return 0;
+		return rdp_auto_reconnect(rdp) ? 0 : 1;
+	}
 #ifdef _WIN32
 	WSAResetEvent(rdp->sec->mcs->iso->tcp->wsa_event);
 #endif
@@ -479,6 +1036,14 @@ l_rdp_check_fds(rdpInst * inst)
 			rv = 0;
 		}
 	}
+	else if ((rv != 0) && rdp->sec->mcs->iso->tcp->dropped && (inst->disc_reason == 0))
+	{
+		/* the network failed, the server did not end the session */
+		if (rdp_auto_reconnect(rdp))
+		{
+			rv = 0;
+		}
+	}
 	return rv;
 }
 
@@ -489,6 +1054,9 @@ l_rdp_send_input(rdpInst * inst, int message_type, int device_flags,
 	rdpRdp * rdp;
 
 	rdp = RDP_FROM_INST(inst);
+	/* input while the connection is down is dropped */
+	if (rdp->arc_attempt != 0)
+		return 0;
 	rdp_send_input(rdp, time(NULL), message_type, device_flags, param1, param2);
 	return 0;
 }
@@ -499,6 +1067,8 @@ l_rdp_sync_input(rdpInst * inst, int toggle_flags)
 	rdpRdp * rdp;
 
 	rdp = (rdpRdp *) (inst->rdp);
+	if (rdp->arc_attempt != 0)
+		return 0;
 	rdp_sync_input(rdp, time(NULL), toggle_flags);
 	return 0;
 }
@@ -510,6 +1080,8 @@ l_rdp_channel_data(rdpInst * inst, int chan_id, char * data, int data_size)
 	rdpChannels * chan;
 
 	rdp = RDP_FROM_INST(inst);
+	if (rdp->arc_attempt != 0)
+		return 0;
 	chan = rdp->sec->mcs->chan;
 	return vchan_send(chan, chan_id, data, data_size);
 }
@@ -523,6 +1095,16 @@ l_rdp_disconnect(rdpInst * inst)
 	rdp_disconnect(rdp);
 }
 
+static int
+l_rdp_get_timings(rdpInst * inst, RD_CONNECT_TIMINGS * timings)
+{
+	rdpRdp * rdp;
+
+	rdp = RDP_FROM_INST(inst);
+	memcpy(timings, &(rdp->timings), sizeof(RD_CONNECT_TIMINGS));
+	return 0;
+}
+
 rdpInst *
 freerdp_new(rdpSet * settings)
 {
@@ -539,6 +1121,7 @@ freerdp_new(rdpSet * settings)
 	inst->rdp_sync_input = l_rdp_sync_input;
 	inst->rdp_channel_data = l_rdp_channel_data;
 	inst->rdp_disconnect = l_rdp_disconnect;
+	inst->rdp_get_timings = l_rdp_get_timings;
 	inst->rdp = (void *) rdp_new(settings, inst);
 	return inst;
 }
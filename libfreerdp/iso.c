@@ -24,6 +24,7 @@
 #include "secure.h"
 #include "credssp.h"
 #include "rdp.h"
+#include "rdpset.h"
 #include "mem.h"
 
 /* TPKT from T123 - aka ISO DP 8073 */
@@ -492,10 +493,17 @@ iso_recv(rdpIso * iso, isoRecvType * ptype)
 RD_BOOL
 iso_connect(rdpIso * iso, char *server, char *username, int port)
 {
+	rdpRdp * rdp;
+
+	rdp = iso->mcs->sec->rdp;
 	if (!tcp_connect(iso->tcp, server, port))
 		return False;
+	rdp_mark_phase(rdp, &(rdp->timings.tcp));
 
-	return iso_negotiate_encryption(iso, username);
+	if (!iso_negotiate_encryption(iso, username))
+		return False;
+	rdp_mark_phase(rdp, &(rdp->timings.x224));
+	return True;
 }
 
 /* Establish a reconnection up to the ISO layer */
@@ -503,9 +511,21 @@ RD_BOOL
 iso_reconnect(rdpIso * iso, char *server, int port)
 {
 	uint8 code = 0;
+	rdpRdp * rdp;
 
+	rdp = iso->mcs->sec->rdp;
 	if (!tcp_connect(iso->tcp, server, port))
 		return False;
+	rdp_mark_phase(rdp, &(rdp->timings.tcp));
+
+	if (iso->mcs->sec->tls)
+	{
+		/* ask for TLS again so the previous session can be resumed */
+		if (!iso_negotiate_encryption(iso, rdp->settings->username))
+			return False;
+		rdp_mark_phase(rdp, &(rdp->timings.x224));
+		return True;
+	}
 
 	x224_send_dst_src_class(iso, X224_TPDU_CONNECTION_REQUEST);
 
@@ -520,6 +540,7 @@ iso_reconnect(rdpIso * iso, char *server, int port)
 		return False;
 	}
 
+	rdp_mark_phase(rdp, &(rdp->timings.x224));
 	return True;
 }
 
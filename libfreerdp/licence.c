@@ -164,7 +164,8 @@ licence_process_demand(rdpLicence * licence, STREAM s)
 	memset(null_data, 0, sizeof(null_data));
 	licence_generate_keys(licence, null_data, server_random, null_data);
 
-	licence_size = load_licence(&licence_data);
+	licence_size = load_licence(licence->sec->rdp->settings->server,
+				    licence->sec->rdp->settings->hostname, &licence_data);
 	if (licence_size > 0)
 	{
 		/* Generate a signature for the HWID buffer */
@@ -310,7 +311,8 @@ licence_process_issue(rdpLicence * licence, STREAM s)
 	if (!s_check_rem(s, length))
 		return;
 	licence->licence_issued = True;
-	save_licence(s->p, length);
+	save_licence(licence->sec->rdp->settings->server,
+		     licence->sec->rdp->settings->hostname, s->p, length);
 }
 
 /* Process a Licensing packet */
@@ -336,10 +338,10 @@ licence_process(rdpLicence * licence, STREAM s)
 			break;
 
 		case LICENCE_TAG_ISSUE:	/* NEW_LICENSE */
+		case LICENCE_TAG_REISSUE:	/* UPGRADE_LICENSE, same layout */
 			licence_process_issue(licence, s);
 			break;
 
-		case LICENCE_TAG_REISSUE:	/* UPGRADE_LICENSE */
 		case LICENCE_TAG_RESULT:	/* ERROR_ALERT */
 			break;
 
@@ -198,9 +198,9 @@ mcs_send_cjrq(rdpMcs * mcs, uint16 chanid)
 	iso_send(mcs->iso, s);
 }
 
-/* Expect a CJcf message (ASN.1 PER) */
+/* Expect a CJcf message (ASN.1 PER), chanid is the channel it confirms */
 static RD_BOOL
-mcs_recv_cjcf(rdpMcs * mcs)
+mcs_recv_cjcf(rdpMcs * mcs, uint16 * chanid)
 {
 	uint8 opcode, result;
 	STREAM s;
@@ -223,13 +223,89 @@ mcs_recv_cjcf(rdpMcs * mcs)
 		return False;
 	}
 
-	in_uint8s(s, 4);	/* mcs_userid, req_chanid */
+	in_uint8s(s, 2);	/* mcs_userid */
+	in_uint16_be(s, *chanid);	/* req_chanid */
 	if (opcode & 2)
 		in_uint8s(s, 2);	/* join_chanid */
 
 	return s_check_end(s);
 }
 
+/* the user channel, the global channel and settings->channels */
+#define MCS_MAX_JOINS	(2 + 16)
+
+/* Join the user channel, the global channel and the static virtual
+   channels, one at a time unless settings->mcs_pipeline_joins asks for
+   all the requests to go out before the first confirm is read */
+static RD_BOOL
+mcs_join_channels(rdpMcs * mcs)
+{
+	rdpSet * settings;
+	uint16 chanids[MCS_MAX_JOINS];
+	RD_BOOL joined[MCS_MAX_JOINS];
+	uint16 chanid;
+	int count;
+	int i;
+	int n;
+
+	settings = mcs->sec->rdp->settings;
+	count = 0;
+	chanids[count++] = mcs->mcs_userid + MCS_USERCHANNEL_BASE;
+	chanids[count++] = MCS_GLOBAL_CHANNEL;
+	for (i = 0; i < settings->num_channels; i++)
+	{
+		chanids[count] = settings->channels[i].chan_id;
+		if (chanids[count] >= mcs->mcs_userid + MCS_USERCHANNEL_BASE)
+			return False;
+		count++;
+	}
+
+	/* MS-RDPBCGR 1.3.1.1: each join request waits for the confirm of the
+	   previous one, strict servers reject anything else */
+	if (!settings->mcs_pipeline_joins)
+	{
+		for (i = 0; i < count; i++)
+		{
+			mcs_send_cjrq(mcs, chanids[i]);
+			if (!mcs_recv_cjcf(mcs, &chanid))
+				return False;
+			if (chanid != chanids[i])
+			{
+				ui_error(mcs->sec->rdp->inst, "CJcf for channel %d, requested %d\n",
+					chanid, chanids[i]);
+				return False;
+			}
+		}
+		return True;
+	}
+
+	/* pipelined, an opt-in deviation that saves a round trip per channel
+	   on servers that accept it, confirms are matched by id */
+	for (i = 0; i < count; i++)
+	{
+		mcs_send_cjrq(mcs, chanids[i]);
+		joined[i] = False;
+	}
+
+	for (n = 0; n < count; n++)
+	{
+		if (!mcs_recv_cjcf(mcs, &chanid))
+			return False;
+		for (i = 0; i < count; i++)
+		{
+			if (!joined[i] && chanids[i] == chanid)
+				break;
+		}
+		if (i == count)
+		{
+			ui_error(mcs->sec->rdp->inst, "CJcf for channel %d not requested\n", chanid);
+			return False;
+		}
+		joined[i] = True;
+	}
+	return True;
+}
+
 /* Initialise an MCS transport data packet */
 STREAM
 mcs_init(rdpMcs * mcs, int length)
@@ -322,10 +398,6 @@ mcs_recv(rdpMcs * mcs, uint16 * channel, isoRecvType * ptype)
 RD_BOOL
 mcs_connect(rdpMcs * mcs, STREAM connectdata)
 {
-	int i;
-	int mcs_id;
-	rdpSet * settings;
-
 	mcs_send_connect_initial(mcs, connectdata);
 	if (!mcs_recv_connect_response(mcs))
 		goto error;
@@ -336,25 +408,8 @@ mcs_connect(rdpMcs * mcs, STREAM connectdata)
 	if (!mcs_recv_aucf(mcs, &(mcs->mcs_userid)))
 		goto error;
 
-	mcs_send_cjrq(mcs, mcs->mcs_userid + MCS_USERCHANNEL_BASE);
-
-	if (!mcs_recv_cjcf(mcs))
-		goto error;
-
-	mcs_send_cjrq(mcs, MCS_GLOBAL_CHANNEL);
-	if (!mcs_recv_cjcf(mcs))
+	if (!mcs_join_channels(mcs))
 		goto error;
-
-	settings = mcs->sec->rdp->settings;
-	for (i = 0; i < settings->num_channels; i++)
-	{
-		mcs_id = settings->channels[i].chan_id;
-		if (mcs_id >= mcs->mcs_userid + MCS_USERCHANNEL_BASE)
-			goto error;
-		mcs_send_cjrq(mcs, mcs_id);
-		if (!mcs_recv_cjcf(mcs))
-			goto error;
-	}
 	return True;
 
       error:
@@ -366,10 +421,6 @@ mcs_connect(rdpMcs * mcs, STREAM connectdata)
 RD_BOOL
 mcs_reconnect(rdpMcs * mcs, STREAM connectdata)
 {
-	int i;
-	int mcs_id;
-	rdpSet * settings;
-
 	mcs_send_connect_initial(mcs, connectdata);
 	if (!mcs_recv_connect_response(mcs))
 		goto error;
@@ -380,25 +431,8 @@ mcs_reconnect(rdpMcs * mcs, STREAM connectdata)
 	if (!mcs_recv_aucf(mcs, &(mcs->mcs_userid)))
 		goto error;
 
-	mcs_send_cjrq(mcs, mcs->mcs_userid + MCS_USERCHANNEL_BASE);
-
-	if (!mcs_recv_cjcf(mcs))
+	if (!mcs_join_channels(mcs))
 		goto error;
-
-	mcs_send_cjrq(mcs, MCS_GLOBAL_CHANNEL);
-	if (!mcs_recv_cjcf(mcs))
-		goto error;
-
-	settings = mcs->sec->rdp->settings;
-	for (i = 0; i < settings->num_channels; i++)
-	{
-		mcs_id = settings->channels[i].chan_id;
-		if (mcs_id >= mcs->mcs_userid + MCS_USERCHANNEL_BASE)
-			goto error;
-		mcs_send_cjrq(mcs, mcs_id);
-		if (!mcs_recv_cjcf(mcs))
-			goto error;
-	}
 	return True;
 
       error:
@@ -21,6 +21,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "mem.h"
+
+#define ARENA_ALIGN 16
+/* demand above this is served from overflow chunks rather than growing
+   the arena block for good */
+#define ARENA_MAX_SIZE (4 * 1024 * 1024)
+#define ARENA_ROUND(_size) (((_size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+#ifdef __GNUC__
+#define MEM_COUNT(_counter) __sync_fetch_and_add(&(_counter), 1)
+#else
+#define MEM_COUNT(_counter) (_counter)++
+#endif
+
+static struct mem_stats g_stats;
+
+/* allocations that did not fit in the arena block; they are chained
+   and released by the next arena_reset */
+struct mem_chunk
+{
+	struct mem_chunk * next;
+	char pad[ARENA_ALIGN - sizeof(struct mem_chunk *) % ARENA_ALIGN];
+};
+
+struct mem_arena
+{
+	char * data;
+	int size;
+	int used;
+	int demand;	/* bytes requested since the last reset */
+	struct mem_chunk * overflow;
+};
 
 void *
 xmalloc(int size)
@@ -31,6 +63,7 @@ xmalloc(int size)
 	{
 		size = 1;
 	}
+	MEM_COUNT(g_stats.mallocs);
 	mem = malloc(size);
 	if (mem == NULL)
 	{
@@ -48,6 +81,7 @@ xrealloc(void * oldmem, int size)
 	{
 		size = 1;
 	}
+	MEM_COUNT(g_stats.reallocs);
 	mem = realloc(oldmem, size);
 	if (mem == NULL)
 	{
@@ -61,6 +95,7 @@ xfree(void * mem)
 {
 	if (mem != NULL)
 	{
+		MEM_COUNT(g_stats.frees);
 		free(mem);
 	}
 }
@@ -76,3 +111,99 @@ xstrdup(const char * s)
 	}
 	return mem;
 }
+
+void
+mem_get_stats(struct mem_stats * stats)
+{
+	memcpy(stats, &g_stats, sizeof(struct mem_stats));
+}
+
+struct mem_arena *
+arena_new(int size)
+{
+	struct mem_arena * arena;
+
+	arena = (struct mem_arena *) xmalloc(sizeof(struct mem_arena));
+	memset(arena, 0, sizeof(struct mem_arena));
+	arena->size = ARENA_ROUND(size);
+	arena->data = (char *) xmalloc(arena->size);
+	return arena;
+}
+
+static void
+arena_free_overflow(struct mem_arena * arena)
+{
+	struct mem_chunk * chunk;
+
+	while (arena->overflow != NULL)
+	{
+		chunk = arena->overflow;
+		arena->overflow = chunk->next;
+		xfree(chunk);
+	}
+}
+
+void
+arena_free(struct mem_arena * arena)
+{
+	if (arena == NULL)
+	{
+		return;
+	}
+	arena_free_overflow(arena);
+	xfree(arena->data);
+	xfree(arena);
+}
+
+void *
+arena_alloc(struct mem_arena * arena, int size)
+{
+	struct mem_chunk * chunk;
+	void * mem;
+
+	if (size < 1)
+	{
+		size = 1;
+	}
+	size = ARENA_ROUND(size);
+	MEM_COUNT(g_stats.arena_allocs);
+	arena->demand += size;
+	if (arena->used + size <= arena->size)
+	{
+		mem = arena->data + arena->used;
+		arena->used += size;
+		return mem;
+	}
+	/* does not fit, hand out a separate block for this update and let
+	   arena_reset grow the main block so the next update fits */
+	MEM_COUNT(g_stats.arena_overflows);
+	chunk = (struct mem_chunk *) xmalloc(sizeof(struct mem_chunk) + size);
+	if (chunk == NULL)
+	{
+		return NULL;
+	}
+	chunk->next = arena->overflow;
+	arena->overflow = chunk;
+	return chunk + 1;
+}
+
+void
+arena_reset(struct mem_arena * arena)
+{
+	if (arena->overflow != NULL)
+	{
+		arena_free_overflow(arena);
+		if (arena->demand > arena->size && arena->size < ARENA_MAX_SIZE)
+		{
+			if (arena->demand > ARENA_MAX_SIZE)
+			{
+				arena->demand = ARENA_MAX_SIZE;
+			}
+			xfree(arena->data);
+			arena->size = ARENA_ROUND(arena->demand);
+			arena->data = (char *) xmalloc(arena->size);
+		}
+	}
+	arena->used = 0;
+	arena->demand = 0;
+}
@@ -30,4 +30,32 @@ xfree(void * mem);
 char *
 xstrdup(const char * s);
 
+/* allocation counters, to check that the update path is malloc free
+   once it has warmed up */
+struct mem_stats
+{
+	long mallocs;
+	long reallocs;
+	long frees;
+	long arena_allocs;
+	long arena_overflows;
+};
+
+void
+mem_get_stats(struct mem_stats * stats);
+
+/* bump allocator for scratch memory that only lives until the end of
+   the current update; everything handed out is released at once by
+   arena_reset, which ui_end_update calls */
+struct mem_arena;
+
+struct mem_arena *
+arena_new(int size);
+void
+arena_free(struct mem_arena * arena);
+void *
+arena_alloc(struct mem_arena * arena, int size);
+void
+arena_reset(struct mem_arena * arena);
+
 #endif
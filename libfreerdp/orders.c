@@ -575,13 +575,7 @@ process_polygon(rdpOrders * orders, STREAM s, POLYGON_ORDER * os, uint32 present
 
 	size = (os->npoints + 1) * sizeof(RD_POINT);
 	
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	
-	points = (RD_POINT *) orders->buffer;
+	points = (RD_POINT *) arena_alloc(orders->rdp->arena, size);
 	memset(points, 0, size);
 
 	points[0].x = os->x;
@@ -670,13 +664,7 @@ process_polygon2(rdpOrders * orders, STREAM s, POLYGON2_ORDER * os, uint32 prese
 
 	size = (os->npoints + 1) * sizeof(RD_POINT);
 	
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	
-	points = (RD_POINT *) orders->buffer;
+	points = (RD_POINT *) arena_alloc(orders->rdp->arena, size);
 	memset(points, 0, size);
 
 	points[0].x = os->x;
@@ -754,13 +742,7 @@ process_polyline(rdpOrders * orders, STREAM s, POLYLINE_ORDER * os, uint32 prese
 	
 	size = (os->lines + 1) * sizeof(RD_POINT);
 	
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	
-	points = (RD_POINT *) orders->buffer;
+	points = (RD_POINT *) arena_alloc(orders->rdp->arena, size);
 	memset(points, 0, size);
 
 	points[0].x = os->x;
@@ -1114,12 +1096,7 @@ process_raw_bmpcache(rdpOrders * orders, STREAM s)
 
 	size = width * height * Bpp;
 	
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	inverted = (uint8 *) orders->buffer;
+	inverted = (uint8 *) arena_alloc(orders->rdp->arena, size);
 	
 	for (y = 0; y < height; y++)
 	{
@@ -1127,7 +1104,8 @@ process_raw_bmpcache(rdpOrders * orders, STREAM s)
 		       width * Bpp);
 	}
 
-	bitmap = ui_create_bitmap(orders->rdp->inst, width, height, inverted);
+	bitmap = cache_create_bitmap(orders->rdp->cache, width, height, Bpp, inverted);
+	pstcache_forget_bitmap(orders->rdp->pcache, cache_id, cache_idx);
 	cache_put_bitmap(orders->rdp->cache, cache_id, cache_idx, bitmap);
 }
 
@@ -1175,17 +1153,12 @@ process_bmpcache(rdpOrders * orders, STREAM s, uint16 flags)
 
 	buffer_size = width * height * Bpp;
 
-	if (buffer_size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, buffer_size);
-		orders->buffer_size = buffer_size;
-	}
-	
-	bmpdata = (uint8 *) orders->buffer;
+	bmpdata = (uint8 *) arena_alloc(orders->rdp->arena, buffer_size);
 
 	if (bitmap_decompress(orders->rdp->inst, bmpdata, width, height, data, size, Bpp))
 	{
-		bitmap = ui_create_bitmap(orders->rdp->inst, width, height, bmpdata);
+		bitmap = cache_create_bitmap(orders->rdp->cache, width, height, Bpp, bmpdata);
+		pstcache_forget_bitmap(orders->rdp->pcache, cache_id, cache_idx);
 		cache_put_bitmap(orders->rdp->cache, cache_id, cache_idx, bitmap);
 	}
 	else
@@ -1242,20 +1215,13 @@ process_bmpcache2(rdpOrders * orders, STREAM s, uint16 flags, RD_BOOL compressed
 
 	size = width * height * Bpp;
 
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	
-	bmpdata = (uint8 *) orders->buffer;
+	bmpdata = (uint8 *) arena_alloc(orders->rdp->arena, size);
 
 	if (compressed)
 	{
 		if (!bitmap_decompress(orders->rdp->inst, bmpdata, width, height, data, bufsize, Bpp))
 		{
 			DEBUG("Failed to decompress bitmap data\n");
-			xfree(bmpdata);
 			return;
 		}
 	}
@@ -1266,14 +1232,17 @@ process_bmpcache2(rdpOrders * orders, STREAM s, uint16 flags, RD_BOOL compressed
 			       &data[y * (width * Bpp)], width * Bpp);
 	}
 
-	bitmap = ui_create_bitmap(orders->rdp->inst, width, height, bmpdata);
+	bitmap = cache_create_bitmap(orders->rdp->cache, width, height, Bpp, bmpdata);
 
 	if (bitmap)
 	{
-		cache_put_bitmap(orders->rdp->cache, cache_id, cache_idx, bitmap);
+		/* save first, the put may evict and only saved entries can go */
 		if (flags & PERSIST)
 			pstcache_save_bitmap(orders->rdp->pcache, cache_id, cache_idx, bitmap_id,
 					     width, height, width * height * Bpp, bmpdata);
+		else
+			pstcache_forget_bitmap(orders->rdp->pcache, cache_id, cache_idx);
+		cache_put_bitmap(orders->rdp->cache, cache_id, cache_idx, bitmap);
 	}
 	else
 	{
@@ -1297,13 +1266,7 @@ process_colcache(rdpOrders * orders, STREAM s)
 
 	size = sizeof(RD_COLOURENTRY) * map.ncolours;
 
-	if (size > orders->buffer_size)
-	{
-		orders->buffer = xrealloc(orders->buffer, size);
-		orders->buffer_size = size;
-	}
-	
-	map.colours = (RD_COLOURENTRY *) orders->buffer;
+	map.colours = (RD_COLOURENTRY *) arena_alloc(orders->rdp->arena, size);
 
 	for (i = 0; i < map.ncolours; i++)
 	{
@@ -1491,13 +1454,13 @@ process_create_surface(rdpOrders * orders, STREAM s)
 			in_uint16_le(s, free_idx);
 			bitmap = cache_get_bitmap(orders->rdp->cache, 255, free_idx);
 			ui_destroy_surface(orders->rdp->inst, bitmap);
-			cache_put_bitmap(orders->rdp->cache, 255, free_idx, NULL);
+			cache_put_surface(orders->rdp->cache, free_idx, NULL, 0, 0);
 		}
 	}
 	idx &= ~0x8000;
 	bitmap = cache_get_bitmap(orders->rdp->cache, 255, idx);
 	bitmap = ui_create_surface(orders->rdp->inst, width, height, bitmap);
-	cache_put_bitmap(orders->rdp->cache, 255, idx, bitmap);
+	cache_put_surface(orders->rdp->cache, idx, bitmap, width, height);
 }
 
 /* Process a non-standard order */
@@ -1738,10 +1701,6 @@ orders_new(struct rdp_rdp * rdp)
 		/* orders_state is void * */
 		self->order_state = xmalloc(sizeof(RDP_ORDER_STATE));
 		memset(self->order_state, 0, sizeof(RDP_ORDER_STATE));
-		/* reusable buffer */
-		self->buffer_size = 4096;
-		self->buffer = xmalloc(self->buffer_size);
-		memset(self->buffer, 0, self->buffer_size);
 	}
 	return self;
 }
@@ -1752,7 +1711,6 @@ orders_free(rdpOrders * orders)
 	if (orders != NULL)
 	{
 		xfree(orders->order_state);
-		xfree(orders->buffer);
 		xfree(orders);
 	}
 }
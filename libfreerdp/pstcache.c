@@ -18,6 +18,8 @@
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+
+#include <stddef.h>
 #include "frdp.h"
 #include "pstcache.h"
 #include "rdp.h"
@@ -28,21 +30,320 @@
 
 #define MAX_CELL_SIZE		0x1000	/* pixels */
 
+/*
+ * All sessions of a user share one store per colour depth, addressed by the
+ * 64 bit key the server computes over the tile, so a tile seen by any
+ * session is on disk once.  The file is a header page, an index of
+ * CELLHEADERs and a cell array with one fixed size cell per index entry.
+ * The index is set associative: a key lives in one of PSTORE_WAYS slots of
+ * its bucket and a full bucket evicts its oldest stamp, which bounds the
+ * file at PSTORE_MAX_SIZE.
+ *
+ * Readers take no locks.  A writer locks the bucket's lock byte, clears
+ * the slot header, writes the cell and writes the header last; a reader
+ * re-reads the header after the cell and drops the cell if the key moved.
+ *
+ * The keys a session enumerates are promised to the server for the whole
+ * session, so it holds a read lock on each of their slot headers and
+ * writers never recycle a slot that anyone has locked.  The kernel drops
+ * the locks when the session exits, however it exits.
+ */
+#define PSTORE_MAGIC		0x53505246	/* "FRPS" */
+#define PSTORE_VERSION		2
+#define PSTORE_HEADER_SIZE	4096
+#define PSTORE_MAX_SIZE		(128 * 1024 * 1024)
+#define PSTORE_WAYS		8
+
+#define PSTORE_INDEX(slot)	(PSTORE_HEADER_SIZE + (slot) * (int) sizeof(CELLHEADER))
+/* bucket locks live past the end of the file so they never overlap a pin */
+#define PSTORE_LOCK(bucket)	(0x40000000 + (bucket) / PSTORE_WAYS)
+#define PSTORE_CELL(pcache, slot)	((pcache)->store_data + \
+		(slot) * (pcache)->pstcache_Bpp * MAX_CELL_SIZE)
+
 #define IS_PERSISTENT(id) (id < 8 && pcache->pstcache_fd[id] > 0)
+#define IS_PINNED(pcache, slot) ((pcache)->store_pinned[(slot) >> 3] & (1 << ((slot) & 7)))
+#define IS_EMPTY(pcache, hdr) (memcmp((hdr)->key, (pcache)->zero_key, sizeof(HASH_KEY)) == 0)
+
+struct pstore_entry
+{
+	CELLHEADER hdr;
+	int slot;
+};
+
+struct pstore_header
+{
+	uint32 magic;
+	uint32 version;
+	uint32 Bpp;
+	uint32 slots;
+};
+
+static int
+pstore_bucket(rdpPcache * pcache, uint8 * key)
+{
+	uint32 h;
+
+	h = (key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32) key[3] << 24)) ^
+	    (key[4] | (key[5] << 8) | (key[6] << 16) | ((uint32) key[7] << 24));
+	h *= 2654435761U;
+	h ^= h >> 16;
+	return h & (pcache->store_slots - 1) & ~(PSTORE_WAYS - 1);
+}
+
+/* read a bucket, anything past the end of the file reads as empty */
+static void
+pstore_read_bucket(rdpPcache * pcache, int bucket, CELLHEADER * hdrs)
+{
+	memset(hdrs, 0, PSTORE_WAYS * sizeof(CELLHEADER));
+	rd_read_file_at(pcache->store_fd, PSTORE_INDEX(bucket), hdrs,
+		PSTORE_WAYS * sizeof(CELLHEADER));
+}
+
+static int
+pstore_find(rdpPcache * pcache, uint8 * key, CELLHEADER * hdr)
+{
+	CELLHEADER hdrs[PSTORE_WAYS];
+	int bucket;
+	int i;
+
+	bucket = pstore_bucket(pcache, key);
+	pstore_read_bucket(pcache, bucket, hdrs);
+	for (i = 0; i < PSTORE_WAYS; i++)
+	{
+		if (memcmp(hdrs[i].key, key, sizeof(HASH_KEY)) == 0)
+		{
+			if (hdr != NULL)
+				memcpy(hdr, &hdrs[i], sizeof(CELLHEADER));
+			return bucket + i;
+		}
+	}
+	return -1;
+}
+
+static RD_BOOL
+pstore_valid(rdpPcache * pcache, CELLHEADER * hdr)
+{
+	return hdr->length != 0 &&
+		hdr->length <= pcache->pstcache_Bpp * MAX_CELL_SIZE &&
+		hdr->width * hdr->height * pcache->pstcache_Bpp == hdr->length;
+}
+
+/* returns an xmalloc'ed copy of the cell or NULL */
+static uint8 *
+pstore_read(rdpPcache * pcache, uint8 * key, CELLHEADER * hdr)
+{
+	CELLHEADER check;
+	uint8 * data;
+	int slot;
+
+	slot = pstore_find(pcache, key, hdr);
+	if (slot < 0 || !pstore_valid(pcache, hdr))
+		return NULL;
+
+	data = (uint8 *) xmalloc(hdr->length);
+	if (rd_read_file_at(pcache->store_fd, PSTORE_CELL(pcache, slot), data,
+		hdr->length) != hdr->length)
+	{
+		xfree(data);
+		return NULL;
+	}
+
+	/* a writer may have recycled the slot while we were reading */
+	memset(&check, 0, sizeof(check));
+	rd_read_file_at(pcache->store_fd, PSTORE_INDEX(slot), &check, sizeof(check));
+	if (memcmp(check.key, key, sizeof(HASH_KEY)) != 0 || check.length != hdr->length)
+	{
+		xfree(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* returns True once the cell is on disk under hdr->key */
+static RD_BOOL
+pstore_write(rdpPcache * pcache, CELLHEADER * hdr, uint8 * data)
+{
+	CELLHEADER hdrs[PSTORE_WAYS];
+	CELLHEADER empty;
+	RD_BOOL written;
+	int bucket;
+	int slot;
+	int i;
+
+	bucket = pstore_bucket(pcache, hdr->key);
+	if (!rd_lock_file_wait(pcache->store_fd, PSTORE_LOCK(bucket), 1))
+		return False;
+
+	pstore_read_bucket(pcache, bucket, hdrs);
+	slot = -1;
+	for (i = 0; i < PSTORE_WAYS; i++)
+	{
+		if (memcmp(hdrs[i].key, hdr->key, sizeof(HASH_KEY)) == 0)
+		{
+			/* same key, same pixels, another session got here first */
+			if (hdrs[i].stamp < hdr->stamp)
+				rd_write_file_at(pcache->store_fd, PSTORE_INDEX(bucket + i) +
+					offsetof(CELLHEADER, stamp), &hdr->stamp, sizeof(uint32));
+			rd_unlock_file(pcache->store_fd, PSTORE_LOCK(bucket), 1);
+			return True;
+		}
+	}
+	for (i = 0; i < PSTORE_WAYS; i++)
+	{
+		/* a slot some session enumerated stays until that session ends */
+		if (!IS_EMPTY(pcache, &hdrs[i]) && (IS_PINNED(pcache, bucket + i) ||
+		    rd_file_locked(pcache->store_fd, PSTORE_INDEX(bucket + i),
+		    sizeof(CELLHEADER))))
+			continue;
+		/* prefer an empty way, else evict the oldest */
+		if (slot < 0 || (!IS_EMPTY(pcache, &hdrs[slot]) &&
+		    (IS_EMPTY(pcache, &hdrs[i]) || hdrs[i].stamp < hdrs[slot].stamp)))
+			slot = i;
+	}
+	if (slot < 0)
+	{
+		rd_unlock_file(pcache->store_fd, PSTORE_LOCK(bucket), 1);
+		return False;
+	}
+	slot += bucket;
+
+	memset(&empty, 0, sizeof(empty));
+	rd_write_file_at(pcache->store_fd, PSTORE_INDEX(slot), &empty, sizeof(empty));
+	written = rd_write_file_at(pcache->store_fd, PSTORE_CELL(pcache, slot), data,
+		hdr->length) == hdr->length &&
+		rd_write_file_at(pcache->store_fd, PSTORE_INDEX(slot), hdr,
+		sizeof(CELLHEADER)) == (int) sizeof(CELLHEADER);
+
+	rd_unlock_file(pcache->store_fd, PSTORE_LOCK(bucket), 1);
+	return written;
+}
+
+static void
+pstore_touch(rdpPcache * pcache, uint8 * key, uint32 stamp)
+{
+	int slot;
+
+	slot = pstore_find(pcache, key, NULL);
+	if (slot >= 0)
+		rd_write_file_at(pcache->store_fd, PSTORE_INDEX(slot) +
+			offsetof(CELLHEADER, stamp), &stamp, sizeof(uint32));
+}
+
+/* read the whole index, returns an xmalloc'ed copy */
+static CELLHEADER *
+pstore_read_index(rdpPcache * pcache)
+{
+	CELLHEADER * index;
+	int size;
+
+	size = pcache->store_slots * sizeof(CELLHEADER);
+	index = (CELLHEADER *) xmalloc(size);
+	memset(index, 0, size);
+	rd_read_file_at(pcache->store_fd, PSTORE_INDEX(0), index, size);
+	return index;
+}
+
+static RD_BOOL
+pstore_open(rdpPcache * pcache)
+{
+	struct pstore_header header;
+	struct pstore_header want;
+	CELLHEADER * index;
+	char filename[256];
+	char * zero;
+	int fd;
+	int slots;
+	int size;
+	int i;
+
+	slots = PSTORE_MAX_SIZE / (pcache->pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER));
+	for (i = PSTORE_WAYS; i * 2 <= slots; i *= 2);
+	slots = i;
+
+	snprintf(filename, sizeof(filename), "cache/pststore_%d",
+		pcache->rdp->settings->server_depth);
+	DEBUG("persistent bitmap store: %s\n", filename);
+	fd = rd_open_file(filename);
+	if (fd == -1)
+		return False;
+
+	/* the header page lock only serialises creation and format upgrades */
+	if (!rd_lock_file_wait(fd, 0, PSTORE_HEADER_SIZE))
+	{
+		rd_close_file(fd);
+		return False;
+	}
+	want.magic = PSTORE_MAGIC;
+	want.version = PSTORE_VERSION;
+	want.Bpp = pcache->pstcache_Bpp;
+	want.slots = slots;
+	memset(&header, 0, sizeof(header));
+	rd_read_file_at(fd, 0, &header, sizeof(header));
+	if (memcmp(&header, &want, sizeof(header)) != 0)
+	{
+		DEBUG("initialising persistent bitmap store\n");
+		size = slots * sizeof(CELLHEADER);
+		zero = (char *) xmalloc(size);
+		memset(zero, 0, size);
+		rd_write_file_at(fd, PSTORE_INDEX(0), zero, size);
+		xfree(zero);
+		rd_write_file_at(fd, 0, &want, sizeof(want));
+	}
+	rd_unlock_file(fd, 0, PSTORE_HEADER_SIZE);
+
+	pcache->store_fd = fd;
+	pcache->store_slots = slots;
+	pcache->store_data = (PSTORE_INDEX(slots) + 4095) & ~4095;
+	pcache->store_pinned = (uint8 *) xmalloc(slots / 8);
+	memset(pcache->store_pinned, 0, slots / 8);
+
+	/* stamps from this session sort after everything already stored,
+	   saves and touches count up from here so a full bucket evicts its
+	   oldest tile */
+	index = pstore_read_index(pcache);
+	pcache->store_stamp = 0;
+	for (i = 0; i < slots; i++)
+	{
+		if (index[i].stamp > pcache->store_stamp)
+			pcache->store_stamp = index[i].stamp;
+	}
+	pcache->store_stamp++;
+	xfree(index);
+	return True;
+}
+
+static int
+pstore_stamp_cmp(const void * a, const void * b)
+{
+	uint32 sa;
+	uint32 sb;
+
+	sa = ((const struct pstore_entry *) a)->hdr.stamp;
+	sb = ((const struct pstore_entry *) b)->hdr.stamp;
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
 
 /* Update mru stamp/index for a bitmap */
 void
 pstcache_touch_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx, uint32 stamp)
 {
-	int fd;
+	uint8 * key;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return;
 
-	fd = pcache->pstcache_fd[cache_id];
-	rd_lseek_file(fd, 12 + cache_idx *
-			(pcache->pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &stamp, sizeof(stamp));
+	/* the store is shared, one session dropping a tile from memory
+	   says nothing about the others */
+	if (stamp == 0)
+		return;
+
+	key = pcache->keys[cache_id][cache_idx];
+	if (memcmp(key, pcache->zero_key, sizeof(HASH_KEY)) == 0)
+		return;
+
+	/* callers touch in lru to mru order, the one session counter keeps
+	   that order and keeps touches behind later saves */
+	pstore_touch(pcache, key, ++(pcache->store_stamp));
 }
 
 /* Load a bitmap from the persistent cache */
@@ -50,7 +351,7 @@ RD_BOOL
 pstcache_load_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx)
 {
 	uint8 *celldata;
-	int fd;
+	uint8 * key;
 	CELLHEADER cellhdr;
 	RD_HBITMAP bitmap;
 
@@ -60,14 +361,16 @@ pstcache_load_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx)
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
-	fd = pcache->pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx *
-			(pcache->pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_read_file(fd, &cellhdr, sizeof(CELLHEADER));
-	celldata = (uint8 *) xmalloc(cellhdr.length);
-	rd_read_file(fd, celldata, cellhdr.length);
+	key = pcache->keys[cache_id][cache_idx];
+	if (memcmp(key, pcache->zero_key, sizeof(HASH_KEY)) == 0)
+		return False;
+
+	celldata = pstore_read(pcache, key, &cellhdr);
+	if (celldata == NULL)
+		return False;
 
-	bitmap = ui_create_bitmap(pcache->rdp->inst, cellhdr.width, cellhdr.height, celldata);
+	bitmap = cache_create_bitmap(pcache->rdp->cache, cellhdr.width, cellhdr.height,
+		pcache->pstcache_Bpp, celldata);
 	DEBUG("Load bitmap from disk: id=%d, idx=%d, bmp=0x%x)\n", cache_id, cache_idx,
 	       (unsigned int) bitmap);
 	cache_put_bitmap(pcache->rdp->cache, cache_id, cache_idx, bitmap);
@@ -81,36 +384,97 @@ RD_BOOL
 pstcache_save_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx, uint8 * key,
 		     uint8 width, uint8 height, uint16 length, uint8 * data)
 {
-	int fd;
 	CELLHEADER cellhdr;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
+	/* the old key no longer describes this index, whatever happens */
+	pstcache_forget_bitmap(pcache, cache_id, cache_idx);
+
 	memcpy(cellhdr.key, key, sizeof(HASH_KEY));
 	cellhdr.width = width;
 	cellhdr.height = height;
 	cellhdr.length = length;
-	cellhdr.stamp = 0;
+	cellhdr.stamp = ++(pcache->store_stamp);
+	if (!pstore_valid(pcache, &cellhdr))
+		return False;
 
-	fd = pcache->pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx *
-			(pcache->pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &cellhdr, sizeof(CELLHEADER));
-	rd_write_file(fd, data, length);
+	if (!pstore_write(pcache, &cellhdr, data))
+		return False;
 
+	memcpy(pcache->keys[cache_id][cache_idx], key, sizeof(HASH_KEY));
 	return True;
 }
 
-/* List the bitmap keys from the persistent cache file */
+/* The server put a bitmap at this index without saving it */
+void
+pstcache_forget_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx)
+{
+	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
+		return;
+
+	memset(pcache->keys[cache_id][cache_idx], 0, sizeof(HASH_KEY));
+}
+
+/* True if the bitmap at this index can be reloaded from the store */
+RD_BOOL
+pstcache_has_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx)
+{
+	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
+		return False;
+
+	return memcmp(pcache->keys[cache_id][cache_idx], pcache->zero_key,
+		sizeof(HASH_KEY)) != 0;
+}
+
+/* Pin a slot for the rest of the session, False if the cell it held
+   when the index was read has been replaced since */
+static RD_BOOL
+pstore_pin(rdpPcache * pcache, struct pstore_entry * entry)
+{
+	CELLHEADER check;
+	RD_BOOL pinned;
+	int bucket;
+
+	/* under the bucket lock no writer is between choosing this slot and
+	   rewriting its header */
+	bucket = entry->slot & ~(PSTORE_WAYS - 1);
+	if (!rd_lock_file_wait(pcache->store_fd, PSTORE_LOCK(bucket), 1))
+		return False;
+
+	pinned = rd_share_lock_file(pcache->store_fd, PSTORE_INDEX(entry->slot),
+		sizeof(CELLHEADER));
+	if (pinned)
+	{
+		memset(&check, 0, sizeof(check));
+		rd_read_file_at(pcache->store_fd, PSTORE_INDEX(entry->slot), &check,
+			sizeof(check));
+		if (memcmp(check.key, entry->hdr.key, sizeof(HASH_KEY)) != 0 ||
+		    !pstore_valid(pcache, &check))
+		{
+			rd_unlock_file(pcache->store_fd, PSTORE_INDEX(entry->slot),
+				sizeof(CELLHEADER));
+			pinned = False;
+		}
+	}
+	rd_unlock_file(pcache->store_fd, PSTORE_LOCK(bucket), 1);
+
+	if (pinned)
+		pcache->store_pinned[entry->slot >> 3] |= 1 << (entry->slot & 7);
+	return pinned;
+}
+
+/* List the most recently used keys in the store, the server places them
+   at cache indices 0..n-1 in the order sent */
 int
 pstcache_enumerate(rdpPcache * pcache, uint8 id, HASH_KEY * keylist)
 {
-	int fd, n;
+	int n, count;
 	uint16 idx;
-	sint16 mru_idx[0xa00];
-	uint32 mru_stamp[0xa00];
-	CELLHEADER cellhdr;
+	CELLHEADER * index;
+	struct pstore_entry * entry;
+	struct pstore_entry * entries;
 
 	if (!(pcache->rdp->settings->bitmap_cache &&
 	      pcache->rdp->settings->bitmap_cache_persist_enable &&
@@ -122,84 +486,88 @@ pstcache_enumerate(rdpPcache * pcache, uint8 id, HASH_KEY * keylist)
 		return 0;
 
 	DEBUG_RDP5("Persistent bitmap cache enumeration... ");
-	for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
+	index = pstore_read_index(pcache);
+	entries = (struct pstore_entry *) xmalloc(pcache->store_slots * sizeof(struct pstore_entry));
+	count = 0;
+	for (n = 0; n < pcache->store_slots; n++)
 	{
-		fd = pcache->pstcache_fd[id];
-		rd_lseek_file(fd, idx *
-			(pcache->pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-		if (rd_read_file(fd, &cellhdr, sizeof(CELLHEADER)) <= 0)
-			break;
-
-		if (memcmp(cellhdr.key, pcache->zero_key, sizeof(HASH_KEY)) != 0)
+		if (!IS_EMPTY(pcache, &index[n]))
 		{
-			memcpy(keylist[idx], cellhdr.key, sizeof(HASH_KEY));
-
-			/* Pre-cache (not possible for 8 bit colour depth cause it needs a colourmap) */
-			if (pcache->rdp->settings->bitmap_cache_precache && cellhdr.stamp &&
-			    pcache->rdp->settings->server_depth > 8)
-				pstcache_load_bitmap(pcache, id, idx);
-
-			/* Sort by stamp */
-			for (n = idx; n > 0 && cellhdr.stamp < mru_stamp[n - 1]; n--)
-			{
-				mru_idx[n] = mru_idx[n - 1];
-				mru_stamp[n] = mru_stamp[n - 1];
-			}
-
-			mru_idx[n] = idx;
-			mru_stamp[n] = cellhdr.stamp;
-		}
-		else
-		{
-			break;
+			memcpy(&entries[count].hdr, &index[n], sizeof(CELLHEADER));
+			entries[count].slot = n;
+			count++;
 		}
 	}
+	xfree(index);
+	qsort(entries, count, sizeof(struct pstore_entry), pstore_stamp_cmp);
+
+	idx = 0;
+	for (n = 0; n < count && idx < BMPCACHE2_NUM_PSTCELLS; n++)
+	{
+		entry = &entries[n];
+		if (!pstore_pin(pcache, entry))
+			continue;
+
+		memcpy(keylist[idx], entry->hdr.key, sizeof(HASH_KEY));
+		memcpy(pcache->keys[id][idx], entry->hdr.key, sizeof(HASH_KEY));
+
+		/* Nothing is loaded here, cells are decoded on the first
+		   cache_get_bitmap miss.  Pre-cache only asks the kernel to start
+		   reading the cells that fit in memory, most recent first, so
+		   those misses hit the page cache (not useful for 8 bit colour
+		   depth cause it needs a colourmap) */
+		if (pcache->rdp->settings->bitmap_cache_precache && idx < BMPCACHE2_C2_CELLS &&
+		    pcache->rdp->settings->server_depth > 8)
+			rd_advise_file(pcache->store_fd, PSTORE_CELL(pcache, entry->slot),
+				entry->hdr.length);
+		idx++;
+	}
+	xfree(entries);
+	count = idx;
 
-	DEBUG_RDP5("%d cached bitmaps.\n", idx);
+	DEBUG_RDP5("%d cached bitmaps.\n", count);
 
-	cache_rebuild_bmpcache_linked_list(pcache->rdp->cache, id, mru_idx, idx);
 	pcache->pstcache_enumerated = True;
-	return idx;
+	return count;
 }
 
 /* initialise the persistent bitmap cache */
 RD_BOOL
 pstcache_init(rdpPcache * pcache, uint8 cache_id)
 {
-	int fd;
-	char filename[256];
-
 	if (pcache->pstcache_enumerated)
 		return True;
 
+	/* already open by an earlier init in this session */
+	if (pcache->pstcache_fd[cache_id] > 0)
+		return True;
+
 	pcache->pstcache_fd[cache_id] = 0;
 
 	if (!(pcache->rdp->settings->bitmap_cache &&
 	      pcache->rdp->settings->bitmap_cache_persist_enable))
 		return False;
 
-	if (!rd_pstcache_mkdir())
+	if (pcache->store_fd <= 0)
 	{
-		DEBUG("failed to get/make cache directory!\n");
-		return False;
-	}
-
-	pcache->pstcache_Bpp = (pcache->rdp->settings->server_depth + 7) / 8;
-	sprintf(filename, "cache/pstcache_%d_%d", cache_id, pcache->pstcache_Bpp);
-	DEBUG("persistent bitmap cache file: %s\n", filename);
+		if (!rd_pstcache_mkdir())
+		{
+			DEBUG("failed to get/make cache directory!\n");
+			return False;
+		}
 
-	fd = rd_open_file(filename);
-	if (fd == -1)
-		return False;
+		pcache->pstcache_Bpp = (pcache->rdp->settings->server_depth + 7) / 8;
+		if (!pstore_open(pcache))
+			return False;
+	}
 
-	if (!rd_lock_file(fd, 0, 0))
+	if (pcache->keys[cache_id] == NULL)
 	{
-		ui_warning(pcache->rdp->inst, "Persistent bitmap caching is disabled. (The file is already in use)\n");
-		rd_close_file(fd);
-		return False;
+		pcache->keys[cache_id] = (HASH_KEY *) xmalloc(BMPCACHE2_NUM_PSTCELLS * sizeof(HASH_KEY));
+		memset(pcache->keys[cache_id], 0, BMPCACHE2_NUM_PSTCELLS * sizeof(HASH_KEY));
 	}
 
-	pcache->pstcache_fd[cache_id] = fd;
+	pcache->pstcache_fd[cache_id] = pcache->store_fd;
 	return True;
 }
 
@@ -220,8 +588,15 @@ pcache_new(struct rdp_rdp * rdp)
 void
 pcache_free(rdpPcache * pcache)
 {
+	int i;
+
 	if (pcache != NULL)
 	{
+		if (pcache->store_fd > 0)
+			rd_close_file(pcache->store_fd);
+		xfree(pcache->store_pinned);
+		for (i = 0; i < 8; i++)
+			xfree(pcache->keys[i]);
 		xfree(pcache);
 	}
 }
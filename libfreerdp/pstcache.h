@@ -28,6 +28,12 @@ struct rdp_pcache
 	int pstcache_fd[8];
 	RD_BOOL pstcache_enumerated;
 	uint8 zero_key[8];
+	int store_fd;
+	int store_slots;
+	int store_data;
+	uint32 store_stamp;
+	uint8 * store_pinned;	/* slots this session enumerated */
+	HASH_KEY * keys[8];
 };
 typedef struct rdp_pcache rdpPcache;
 
@@ -38,6 +44,10 @@ pstcache_load_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx);
 RD_BOOL
 pstcache_save_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx, uint8 * key,
 		     uint8 width, uint8 height, uint16 length, uint8 * data);
+void
+pstcache_forget_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx);
+RD_BOOL
+pstcache_has_bitmap(rdpPcache * pcache, uint8 cache_id, uint16 cache_idx);
 int
 pstcache_enumerate(rdpPcache * pcache, uint8 id, HASH_KEY * keylist);
 RD_BOOL
@@ -31,6 +31,7 @@
 #include "tcp.h"
 #include "mcs.h"
 #include "secure.h"
+#include "licence.h"
 #include "rdp.h"
 #include "rail.h"
 #include "capabilities.h"
@@ -384,7 +385,8 @@ rdp_send_client_info(rdpRdp * rdp, uint32 flags, char *domain, char *user,
 			172 +	/* clientTimeZone */
 			4 +	/* clientSessionId */
 			4 +	/* performanceFlags */
-			2	/* cbAutoReconnectLen */
+			2 +	/* cbAutoReconnectLen */
+			(rdp->arc_valid ? ARC_PACKET_LENGTH : 0)
 		) : 0);
 
 	s = sec_init(rdp->sec, sec_flags, packetlen);
@@ -425,8 +427,21 @@ rdp_send_client_info(rdpRdp * rdp, uint32 flags, char *domain, char *user,
 
 		out_uint32_le(s, 0); // clientSessionId, should be set to zero
 		out_uint32_le(s, rdp->settings->rdp5_performanceflags); // performanceFlags
-		out_uint16_le(s, 0); // cbAutoReconnectLen
-		// autoReconnectCookie (length specified by cbAutoReconnectLen)
+		if (rdp->arc_valid)
+		{
+			uint8 verifier[16];
+
+			sec_arc_verifier(rdp->sec, rdp->arc_random, verifier);
+			out_uint16_le(s, ARC_PACKET_LENGTH); // cbAutoReconnectLen
+			out_uint32_le(s, ARC_PACKET_LENGTH); // cbLen
+			out_uint32_le(s, 1); // version
+			out_uint32_le(s, rdp->arc_logon_id); // logonId
+			out_uint8a(s, verifier, 16); // securityVerifier
+		}
+		else
+		{
+			out_uint16_le(s, 0); // cbAutoReconnectLen
+		}
 	}
 
 	xfree(domain_win);
@@ -699,7 +714,7 @@ rdp_send_confirm_active(rdpRdp * rdp)
 	STREAM s;
 	uint32 sec_flags = rdp->settings->encryption ? SEC_ENCRYPT : 0;
 	int caplen;
-	uint16 numberCapabilities = 14;
+	uint16 numberCapabilities = 15;
 
 	caps = (STREAM) xmalloc(sizeof(struct stream));
 	memset(caps, 0, sizeof(struct stream));
@@ -729,9 +744,10 @@ rdp_send_confirm_active(rdpRdp * rdp)
 	if (rdp->settings->off_screen_bitmaps)
 	{
 		numberCapabilities++;
-		rdp_out_offscreenscache_capset(caps);
+		rdp_out_offscreenscache_capset(rdp, caps);
 	}
 	rdp_out_glyphcache_capset(caps);
+	rdp_out_multifragmentupdate_capset(caps);
 	if (rdp->settings->remote_app)
 	{
 		numberCapabilities += 2;
@@ -898,6 +914,7 @@ process_demand_active(rdpRdp * rdp, STREAM s)
 	in_uint8s(s, lengthSourceDescriptor); // sourceDescriptor, should be "RDP"
 
 	DEBUG("DEMAND_ACTIVE(id=0x%x)\n", rdp->rdp_shareid);
+	rdp_mark_phase(rdp, &(rdp->timings.licensing));
 	rdp_process_server_caps(rdp, s, lengthCombinedCapabilities);
 	in_uint8s(s, 4); // sessionID, ignored by the client
 
@@ -925,6 +942,17 @@ process_demand_active(rdpRdp * rdp, STREAM s)
 
 	rdp_recv(rdp, &type);	/* RDP_PDU_UNKNOWN 0x28 (Fonts?) */
 	reset_order_state(rdp->orders);
+
+	if (rdp->timings_running)
+	{
+		rdp_mark_phase(rdp, &(rdp->timings.capabilities));
+		rdp->timings.total = rdp->timings_mark - rdp->timings_start;
+		rdp->timings_running = False;
+		DEBUG("connected in %u ms: tcp %u x224 %u security %u mcs %u "
+			"licensing %u capabilities %u\n", rdp->timings.total,
+			rdp->timings.tcp, rdp->timings.x224, rdp->timings.security,
+			rdp->timings.mcs, rdp->timings.licensing, rdp->timings.capabilities);
+	}
 }
 
 /* Process a colour pointer PDU */
@@ -1083,17 +1111,11 @@ process_bitmap_updates(rdpRdp * rdp, STREAM s)
 		       left, top, right, bottom, width, height, Bpp, compress);
 
 		buffer_size = width * height * Bpp;
+		bmpdata = (uint8 *) arena_alloc(rdp->arena, buffer_size);
 
-		if (buffer_size > rdp->buffer_size)
-		{
-			rdp->buffer = xrealloc(rdp->buffer, buffer_size);
-			rdp->buffer_size = buffer_size;
-		}
-		
 		if (!compress)
 		{
 			int y;
-			bmpdata = (uint8 *) rdp->buffer;
 			for (y = 0; y < height; y++)
 			{
 				in_uint8a(s, &bmpdata[(height - y - 1) * (width * Bpp)],
@@ -1114,17 +1136,7 @@ process_bitmap_updates(rdpRdp * rdp, STREAM s)
 			in_uint8s(s, 4);	/* line_size, final_size */
 		}
 		in_uint8p(s, data, size);
-		
-		buffer_size = width * height * Bpp;
 
-		if (buffer_size > rdp->buffer_size)
-		{
-			rdp->buffer = xrealloc(rdp->buffer, buffer_size);
-			rdp->buffer_size = buffer_size;
-		}
-
-		bmpdata = (uint8 *) rdp->buffer;
-		
 		if (bitmap_decompress(rdp->inst, bmpdata, width, height, data, size, Bpp))
 		{
 			ui_paint_bitmap(rdp->inst, left, top, cx, cy, width, height, bmpdata);
@@ -1152,13 +1164,7 @@ process_palette(rdpRdp * rdp, STREAM s)
 
 	size = sizeof(RD_COLOURENTRY) * map.ncolours;
 
-	if (size > rdp->buffer_size)
-	{
-		rdp->buffer = xrealloc(rdp->buffer, size);
-		rdp->buffer_size = size;
-	}
-	
-	map.colours = (RD_COLOURENTRY *) rdp->buffer;
+	map.colours = (RD_COLOURENTRY *) arena_alloc(rdp->arena, size);
 
 	DEBUG("PALETTE(c=%d)\n", map.ncolours);
 
@@ -1218,6 +1224,57 @@ process_disconnect_pdu(STREAM s, struct rdp_inst *inst)
 	DEBUG("Received disconnect PDU\n");
 }
 
+/* Process a Save Session Info PDU, only the auto-reconnect cookie in the
+   extended logon info is kept */
+static void
+process_save_session_info(rdpRdp * rdp, STREAM s)
+{
+	uint32 info_type;
+	uint32 fields_present;
+	uint32 len;
+	uint32 version;
+
+	in_uint32_le(s, info_type); // infoType
+	if (info_type != INFOTYPE_LOGON_EXTENDED_INFO)
+		return;
+
+	in_uint8s(s, 2); // length
+	in_uint32_le(s, fields_present); // fieldsPresent
+	if (fields_present & LOGON_EX_AUTORECONNECTCOOKIE)
+	{
+		in_uint8s(s, 4); // cbFieldData
+		in_uint32_le(s, len); // cbLen
+		in_uint32_le(s, version); // version
+		if ((len == ARC_PACKET_LENGTH) && (version == 1))
+		{
+			in_uint32_le(s, rdp->arc_logon_id); // logonId
+			in_uint8a(s, rdp->arc_random, ARC_RANDOM_LENGTH); // arcRandomBits
+			rdp->arc_valid = True;
+			DEBUG("auto-reconnect cookie for logon id %d\n", rdp->arc_logon_id);
+		}
+	}
+}
+
+/* Copy a decompressed PDU out of the MPPC history. The stream only ever
+   grows so steady traffic doesn't go back to the allocator. */
+STREAM
+rdp_mppc_stream(rdpRdp * rdp, uint32 roff, uint32 rlen)
+{
+	STREAM ns;
+
+	ns = &(rdp->mppc_dict.ns);
+	if (ns->size < rlen)
+	{
+		ns->data = (uint8 *) xrealloc(ns->data, rlen);
+		ns->size = rlen;
+	}
+	memcpy(ns->data, rdp->mppc_dict.hist + roff, rlen);
+	ns->p = ns->data;
+	ns->end = ns->data + rlen;
+	ns->rdp_hdr = ns->p;
+	return ns;
+}
+
 /* Process data PDU */
 static RD_BOOL
 process_data_pdu(rdpRdp * rdp, STREAM s)
@@ -1227,7 +1284,6 @@ process_data_pdu(rdpRdp * rdp, STREAM s)
 	uint16 clen;
 	uint32 len;
 	uint32 roff, rlen;
-	struct stream * ns;
 
 	in_uint8s(s, 6);	/* shareid, pad, streamid */
 	in_uint16_le(s, len);
@@ -1237,20 +1293,12 @@ process_data_pdu(rdpRdp * rdp, STREAM s)
 
 	if (ctype & RDP_MPPC_COMPRESSED)
 	{
-		ns = &(rdp->mppc_dict.ns);
 		clen -= 18;
 		if (len > RDP_MPPC_DICT_SIZE)
 			ui_error(rdp->inst, "error decompressed packet size exceeds max\n");
 		if (mppc_expand(rdp, s->p, clen, ctype, &roff, &rlen) == -1)
 			ui_error(rdp->inst, "error while decompressing packet\n");
-		/* allocate memory and copy the uncompressed data into the temporary stream */
-		ns->data = (uint8 *) xrealloc(ns->data, rlen);
-		memcpy(ns->data, rdp->mppc_dict.hist + roff, rlen);
-		ns->size = rlen;
-		ns->end = (ns->data + ns->size);
-		ns->p = ns->data;
-		ns->rdp_hdr = ns->p;
-		s = ns;
+		s = rdp_mppc_stream(rdp, roff, rlen);
 	}
 
 	switch (data_pdu_type)
@@ -1277,7 +1325,7 @@ process_data_pdu(rdpRdp * rdp, STREAM s)
 
 		case RDP_DATA_PDU_SAVE_SESSION_INFO:
 			DEBUG("Received Logon PDU\n");
-			/* User logged on */
+			process_save_session_info(rdp, s);
 			break;
 
 		case RDP_DATA_PDU_SET_ERROR_INFO:
@@ -1413,9 +1461,33 @@ rdp_loop(rdpRdp * rdp, RD_BOOL * deactivated)
 	return True;
 }
 
-/* Establish a connection up to the RDP layer */
-RD_BOOL
-rdp_connect(rdpRdp * rdp)
+/* Start timing a new connection */
+static void
+rdp_start_timings(rdpRdp * rdp)
+{
+	memset(&(rdp->timings), 0, sizeof(rdp->timings));
+	rdp->timings_start = rd_get_ticks();
+	rdp->timings_mark = rdp->timings_start;
+	rdp->timings_running = True;
+}
+
+/* Charge the time since the last mark to phase, does nothing once the
+   session is active */
+void
+rdp_mark_phase(rdpRdp * rdp, uint32 * phase)
+{
+	uint32 now;
+
+	if (!rdp->timings_running)
+		return;
+	now = rd_get_ticks();
+	*phase += now - rdp->timings_mark;
+	rdp->timings_mark = now;
+}
+
+/* Send the client info PDU with the logon details from settings */
+static void
+rdp_send_logon(rdpRdp * rdp)
 {
 	char* password_encoded;
 	size_t password_encoded_len = 0;
@@ -1434,12 +1506,20 @@ rdp_connect(rdpRdp * rdp)
 		connect_flags |= INFO_REMOTECONSOLEAUDIO;
 	}
 
-	if (!sec_connect(rdp->sec, rdp->settings->server, rdp->settings->username, rdp->settings->tcp_port_rdp))
-		return False;
-
 	password_encoded = xstrdup_out_unistr(rdp, rdp->settings->password, &password_encoded_len);
 	rdp_send_client_info(rdp, connect_flags, rdp->settings->domain, rdp->settings->username, password_encoded, password_encoded_len, rdp->settings->shell, rdp->settings->directory);
 	xfree(password_encoded);
+}
+
+/* Establish a connection up to the RDP layer */
+RD_BOOL
+rdp_connect(rdpRdp * rdp)
+{
+	rdp_start_timings(rdp);
+	if (!sec_connect(rdp->sec, rdp->settings->server, rdp->settings->username, rdp->settings->tcp_port_rdp))
+		return False;
+
+	rdp_send_logon(rdp);
 	return True;
 }
 
@@ -1448,6 +1528,10 @@ RD_BOOL
 rdp_reconnect(rdpRdp * rdp)
 {
 	/* FIXME: Cookie is unused? */
+	rdp_start_timings(rdp);
+	/* an auto-reconnect cookie only means something to the server that
+	   issued it */
+	rdp->arc_valid = False;
 	if (!sec_reconnect(rdp->sec, rdp->redirect_server, rdp->settings->tcp_port_rdp))
 		return False;
 
@@ -1456,6 +1540,50 @@ rdp_reconnect(rdpRdp * rdp)
 	return True;
 }
 
+/* Get back into the session after the connection dropped.  The server
+   takes the auto-reconnect cookie instead of a logon, and the caches and
+   the ui's backstore are left alone so the server only has to send what
+   changed meanwhile.  Attempts are 1, 2, 4... up to 16 seconds apart.
+   Each call makes one attempt, after a failed one arc_timer is armed and
+   the ui waits on it in its own loop rather than in here.  Returns False
+   once there is nothing left to try. */
+RD_BOOL
+rdp_auto_reconnect(rdpRdp * rdp)
+{
+	if (!rdp->arc_valid || rdp->settings->auto_reconnect_attempts <= 0)
+		return False;
+
+	if (rdp->arc_attempt == 0)
+	{
+		if (rdp->arc_timer == NULL)
+			rdp->arc_timer = rd_timer_new();
+		if (rdp->arc_timer == NULL)
+			return False;
+		rdp->arc_delay = 1000;
+	}
+	rdp->arc_attempt++;
+
+	ui_warning(rdp->inst, "connection lost, reconnecting (attempt %d)\n", rdp->arc_attempt);
+	tcp_disconnect(rdp->sec->mcs->iso->tcp);
+	rdp->sec->licence->licence_issued = False;
+	rdp_start_timings(rdp);
+	if (sec_reconnect(rdp->sec, rdp->settings->server, rdp->settings->tcp_port_rdp))
+	{
+		rdp->arc_attempt = 0;
+		rdp_send_logon(rdp);
+		return True;
+	}
+
+	if (rdp->arc_attempt >= rdp->settings->auto_reconnect_attempts)
+	{
+		rdp->arc_attempt = 0;
+		return False;
+	}
+	rd_timer_set(rdp->arc_timer, rdp->arc_delay);
+	rdp->arc_delay = MIN(rdp->arc_delay * 2, 16000);
+	return True;
+}
+
 /* Disconnect from the RDP layer */
 void
 rdp_disconnect(rdpRdp * rdp)
@@ -1487,9 +1615,7 @@ rdp_new(struct rdp_set *settings, struct rdp_inst *inst)
 			DEBUG("Error opening iconv converter to %s from %s\n", WINDOWS_CODEPAGE, DEFAULT_CODEPAGE);
 		}
 #endif
-		self->buffer_size = 2048;
-		self->buffer = xmalloc(self->buffer_size);
-		memset(self->buffer, 0, self->buffer_size);
+		self->arena = arena_new(0x10000);
 		self->sec = sec_new(self);
 		self->orders = orders_new(self);
 		self->pcache = pcache_new(self);
@@ -1507,10 +1633,14 @@ rdp_free(rdpRdp * rdp)
 		iconv_close(rdp->in_iconv_h);
 		iconv_close(rdp->out_iconv_h);
 #endif
+		cache_save_state(rdp->cache);
 		cache_free(rdp->cache);
 		pcache_free(rdp->pcache);
 		orders_free(rdp->orders);
-		xfree(rdp->buffer);
+		arena_free(rdp->arena);
+		rd_timer_free(rdp->arc_timer);
+		xfree(rdp->mppc_dict.ns.data);
+		xfree(rdp->fragment.data);
 		sec_free(rdp->sec);
 		xfree(rdp->redirect_server);
 		xfree(rdp->redirect_cookie);
@@ -61,13 +61,34 @@ struct rdp_rdp
 	int input_flags;
 	int use_input_fast_path;
 	rdpInst * inst;
-	void* buffer;
-	size_t buffer_size;
+	/* scratch memory for the update being processed */
+	struct mem_arena * arena;
+	/* connection phase timings, timings_mark is when the current phase
+	   started */
+	RD_CONNECT_TIMINGS timings;
+	/* auto-reconnect cookie from the Save Session Info PDU */
+	RD_BOOL arc_valid;
+	uint32 arc_logon_id;
+	uint8 arc_random[16];
+	/* attempts made since the connection dropped, 0 while connected,
+	   the next one is due when arc_timer fires */
+	int arc_attempt;
+	uint32 arc_delay;
+	struct rd_timer * arc_timer;
+	RD_BOOL timings_running;
+	uint32 timings_start;
+	uint32 timings_mark;
+	/* fast-path update fragments collect here until the last one, the
+	   buffer is kept between updates */
+	struct stream fragment;
+	RD_BOOL fragmenting;
 };
 typedef struct rdp_rdp rdpRdp;
 
 int
 mppc_expand(rdpRdp * rdp, uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen);
+STREAM
+rdp_mppc_stream(rdpRdp * rdp, uint32 roff, uint32 rlen);
 void
 rdp5_process(rdpRdp * rdp, STREAM s);
 char*
@@ -101,10 +122,14 @@ void
 rdp_main_loop(rdpRdp * rdp, RD_BOOL * deactivated, uint32 * ext_disc_reason);
 RD_BOOL
 rdp_loop(rdpRdp * rdp, RD_BOOL * deactivated);
+void
+rdp_mark_phase(rdpRdp * rdp, uint32 * phase);
 RD_BOOL
 rdp_connect(rdpRdp * rdp);
 RD_BOOL
 rdp_reconnect(rdpRdp * rdp);
+RD_BOOL
+rdp_auto_reconnect(rdpRdp * rdp);
 void
 rdp_disconnect(rdpRdp * rdp);
 rdpRdp *
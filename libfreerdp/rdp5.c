@@ -24,15 +24,63 @@
 #include "orders.h"
 #include "mem.h"
 
+/* Append one fragment of a fast-path update to rdp->fragment, returns the
+   whole update once the last fragment is in, NULL until then or on error */
+static STREAM
+rdp5_reassemble(rdpRdp * rdp, uint8 fragment, uint8 * data, int length)
+{
+	STREAM f;
+	int used;
+	int size;
+
+	f = &(rdp->fragment);
+	if (fragment == RDP5_FRAGMENT_FIRST)
+	{
+		f->p = f->data;
+		rdp->fragmenting = True;
+	}
+	else if (!rdp->fragmenting)
+	{
+		ui_warning(rdp->inst, "fast-path fragment without a first fragment\n");
+		return NULL;
+	}
+
+	used = f->p - f->data;
+	if (used + length > RDP5_MAX_REQUEST_SIZE)
+	{
+		ui_error(rdp->inst, "fast-path update larger than %d bytes\n", RDP5_MAX_REQUEST_SIZE);
+		rdp->fragmenting = False;
+		return NULL;
+	}
+	if (used + length > f->size)
+	{
+		size = f->size ? f->size : 0x10000;
+		while (size < used + length)
+			size *= 2;
+		f->data = (uint8 *) xrealloc(f->data, size);
+		f->size = size;
+		f->p = f->data + used;
+	}
+	memcpy(f->p, data, length);
+	f->p += length;
+
+	if (fragment != RDP5_FRAGMENT_LAST)
+		return NULL;
+
+	rdp->fragmenting = False;
+	f->end = f->p;
+	f->p = f->data;
+	return f;
+}
+
 void
 rdp5_process(rdpRdp * rdp, STREAM s)
 {
 	uint16 length, count, x, y;
-	uint8 type, ctype;
+	uint8 type, ctype, fragment;
 	uint8 *next;
 
 	uint32 roff, rlen;
-	struct stream *ns = &(rdp->mppc_dict.ns);
 	struct stream *ts;
 
 	ui_begin_update(rdp->inst);
@@ -57,21 +105,25 @@ rdp5_process(rdpRdp * rdp, STREAM s)
 			if (mppc_expand(rdp, s->p, length, ctype, &roff, &rlen) == -1)
 				ui_error(rdp->inst, "error while decompressing packet\n");
 
-			/* allocate memory and copy the uncompressed data into the temporary stream */
-			ns->data = (uint8 *) xrealloc(ns->data, rlen);
-
-			memcpy((ns->data), (unsigned char *) (rdp->mppc_dict.hist + roff), rlen);
-
-			ns->size = rlen;
-			ns->end = (ns->data + ns->size);
-			ns->p = ns->data;
-			ns->rdp_hdr = ns->p;
-
-			ts = ns;
+			ts = rdp_mppc_stream(rdp, roff, rlen);
 		}
 		else
 			ts = s;
 
+		/* each fragment is compressed on its own, so this comes after */
+		fragment = type & RDP5_FRAGMENT_MASK;
+		type &= RDP5_UPDATE_MASK;
+		if (fragment != RDP5_FRAGMENT_SINGLE)
+		{
+			ts = rdp5_reassemble(rdp, fragment, ts->p,
+				(ts == s) ? length : ts->end - ts->p);
+			if (ts == NULL)
+			{
+				s->p = next;
+				continue;
+			}
+		}
+
 		switch (type)
 		{
 			case 0:	/* update orders */
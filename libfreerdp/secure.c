@@ -152,6 +152,8 @@ sec_generate_keys(rdpSec * sec, uint8 * client_random, uint8 * server_random, in
 	/* Initialise RC4 state arrays */
 	crypto_rc4_set_key((CRYPTO_RC4*)&(sec->rc4_decrypt_key), sec->sec_decrypt_key, sec->rc4_key_len);
 	crypto_rc4_set_key((CRYPTO_RC4*)&(sec->rc4_encrypt_key), sec->sec_encrypt_key, sec->rc4_key_len);
+	sec->sec_encrypt_use_count = 0;
+	sec->sec_decrypt_use_count = 0;
 }
 
 /* Output a uint32 into a buffer (little-endian) */
@@ -192,6 +194,36 @@ sec_sign(uint8 * signature, int siglen, uint8 * session_key, int keylen, uint8 *
 	memcpy(signature, md5sig, siglen);
 }
 
+/* SecurityVerifier of the auto-reconnect cookie (5.5), the HMAC-MD5 of
+   this connection's client random keyed with the server's ArcRandomBits */
+void
+sec_arc_verifier(rdpSec * sec, uint8 * arc_random, uint8 * verifier)
+{
+	uint8 ipad[64];
+	uint8 opad[64];
+	uint8 inner[16];
+	CRYPTO_MD5 md5;
+	int i;
+
+	memset(ipad, 0x36, sizeof(ipad));
+	memset(opad, 0x5c, sizeof(opad));
+	for (i = 0; i < ARC_RANDOM_LENGTH; i++)
+	{
+		ipad[i] ^= arc_random[i];
+		opad[i] ^= arc_random[i];
+	}
+
+	crypto_md5_init(&md5);
+	crypto_md5_update(&md5, ipad, sizeof(ipad));
+	crypto_md5_update(&md5, sec->client_random, SEC_RANDOM_SIZE);
+	crypto_md5_final(&md5, inner);
+
+	crypto_md5_init(&md5);
+	crypto_md5_update(&md5, opad, sizeof(opad));
+	crypto_md5_update(&md5, inner, sizeof(inner));
+	crypto_md5_final(&md5, verifier);
+}
+
 /* Update an encryption key */
 static void
 sec_update(rdpSec * sec, uint8 * key, uint8 * update_key)
@@ -235,10 +267,14 @@ sec_encrypt(rdpSec * sec, uint8 * data, int length)
 	sec->sec_encrypt_use_count++;
 }
 
-/* Decrypt data using RC4 */
+/* Decrypt data using RC4, feeding the plaintext to sha1 when it is set.
+   That is done a chunk at a time so the data is hashed while it is still
+   in cache from the decryption. */
 static void
-sec_decrypt(rdpSec * sec, uint8 * data, int length)
+sec_decrypt(rdpSec * sec, uint8 * data, int length, CRYPTO_SHA1 * sha1)
 {
+	int chunk;
+
 	if (sec->sec_decrypt_use_count == 4096)
 	{
 		sec_update(sec, sec->sec_decrypt_key, sec->sec_decrypt_update_key);
@@ -246,10 +282,52 @@ sec_decrypt(rdpSec * sec, uint8 * data, int length)
 		sec->sec_decrypt_use_count = 0;
 	}
 
-	crypto_rc4((CRYPTO_RC4*)&(sec->rc4_decrypt_key), length, data, data);
+	if (sha1 == NULL)
+	{
+		crypto_rc4((CRYPTO_RC4*)&(sec->rc4_decrypt_key), length, data, data);
+	}
+	else
+	{
+		while (length > 0)
+		{
+			chunk = MIN(length, 4096);
+			crypto_rc4((CRYPTO_RC4*)&(sec->rc4_decrypt_key), chunk, data, data);
+			crypto_sha1_update(sha1, data, chunk);
+			data += chunk;
+			length -= chunk;
+		}
+	}
 	sec->sec_decrypt_use_count++;
 }
 
+/* Decrypt data and check it against its MAC (5.2.3.1) */
+static RD_BOOL
+sec_decrypt_verify(rdpSec * sec, uint8 * signature, uint8 * data, int length)
+{
+	uint8 shasig[20];
+	uint8 md5sig[16];
+	uint8 lenhdr[4];
+	CRYPTO_SHA1 sha1;
+	CRYPTO_MD5 md5;
+
+	buf_out_uint32(lenhdr, length);
+
+	crypto_sha1_init(&sha1);
+	crypto_sha1_update(&sha1, sec->sec_sign_key, sec->rc4_key_len);
+	crypto_sha1_update(&sha1, pad_54, 40);
+	crypto_sha1_update(&sha1, lenhdr, 4);
+	sec_decrypt(sec, data, length, &sha1);
+	crypto_sha1_final(&sha1, shasig);
+
+	crypto_md5_init(&md5);
+	crypto_md5_update(&md5, sec->sec_sign_key, sec->rc4_key_len);
+	crypto_md5_update(&md5, pad_92, 48);
+	crypto_md5_update(&md5, shasig, 20);
+	crypto_md5_final(&md5, md5sig);
+
+	return memcmp(signature, md5sig, 8) == 0;
+}
+
 /* Perform an RSA public key encryption operation */
 static void
 sec_rsa_encrypt(uint8 * out, uint8 * in, int len, uint32 modulus_size, uint8 * modulus,
@@ -708,11 +786,11 @@ static void
 sec_process_server_security_data(rdpSec * sec, STREAM s)
 {
 	uint8 server_random[SEC_RANDOM_SIZE];
-	uint8 client_random[SEC_RANDOM_SIZE];
 	uint8 modulus[SEC_MAX_MODULUS_SIZE];
 	uint8 exponent[SEC_EXPONENT_SIZE];
 	uint32 rc4_key_size;
 
+	memset(sec->client_random, 0, sizeof(sec->client_random));
 	memset(modulus, 0, sizeof(modulus));
 	memset(exponent, 0, sizeof(exponent));
 	if (!sec_parse_server_security_data(sec, s, &rc4_key_size, server_random, modulus, exponent))
@@ -721,10 +799,10 @@ sec_process_server_security_data(rdpSec * sec, STREAM s)
 		return;
 	}
 	DEBUG("Generating client random\n");
-	generate_random(client_random);
-	sec_rsa_encrypt(sec->sec_crypted_random, client_random, SEC_RANDOM_SIZE,
+	generate_random(sec->client_random);
+	sec_rsa_encrypt(sec->sec_crypted_random, sec->client_random, SEC_RANDOM_SIZE,
 			sec->server_public_key_len, modulus, exponent);
-	sec_generate_keys(sec, client_random, server_random, rc4_key_size);
+	sec_generate_keys(sec, sec->client_random, server_random, rc4_key_size);
 }
 
 /* Process Server Core Data */
@@ -840,6 +918,28 @@ sec_process_mcs_data(rdpSec * sec, STREAM s)
 	}
 }
 
+/* Decrypt the rest of s after its dataSignature, checking the signature
+   if settings->verify_signatures asks for it.  Salted checksums are not
+   advertised and are let through unchecked. */
+static RD_BOOL
+sec_recv_decrypt(rdpSec * sec, STREAM s, RD_BOOL salted)
+{
+	uint8 * signature;
+
+	in_uint8p(s, signature, 8);	/* dataSignature */
+	if (!sec->rdp->settings->verify_signatures || salted)
+	{
+		sec_decrypt(sec, s->p, s->end - s->p, NULL);
+		return True;
+	}
+	if (!sec_decrypt_verify(sec, signature, s->p, s->end - s->p))
+	{
+		ui_error(sec->rdp->inst, "bad signature on encrypted packet\n");
+		return False;
+	}
+	return True;
+}
+
 /* Receive secure transport packet */
 STREAM
 sec_recv(rdpSec * sec, secRecvType * type)
@@ -857,8 +957,8 @@ sec_recv(rdpSec * sec, secRecvType * type)
 			*type = SEC_RECV_FAST_PATH;
 			if (iso_type == ISO_RECV_FAST_PATH_ENCRYPTED)
 			{
-				in_uint8s(s, 8);	/* dataSignature */ /* TODO: Check signature! */
-				sec_decrypt(sec, s->p, s->end - s->p);
+				if (!sec_recv_decrypt(sec, s, False))
+					return NULL;
 			}
 			return s;
 		}
@@ -869,8 +969,8 @@ sec_recv(rdpSec * sec, secRecvType * type)
 
 			if ((sec_flags & SEC_ENCRYPT) || (sec_flags & SEC_REDIRECTION_PKT))
 			{
-				in_uint8s(s, 8);	/* dataSignature */ /* TODO: Check signature! */
-				sec_decrypt(sec, s->p, s->end - s->p);
+				if (!sec_recv_decrypt(sec, s, (sec_flags & SEC_SECURE_CHECKSUM) != 0))
+					return NULL;
 			}
 
 			if (sec_flags & SEC_LICENSE_PKT)
@@ -900,6 +1000,50 @@ sec_recv(rdpSec * sec, secRecvType * type)
 	return NULL;
 }
 
+#ifndef DISABLE_TLS
+
+/* TLS handshake and NLA, resuming the previous session to the same server */
+static RD_BOOL
+sec_tls_connect(rdpSec * sec, char *server)
+{
+	SSL_SESSION *session;
+
+	if (sec->ctx == NULL)
+	{
+		sec->ctx = tls_create_context();
+		if (sec->ctx == NULL)
+			return False;
+	}
+
+	session = NULL;
+	if (sec->tls_session != NULL)
+	{
+		if (strcmp(sec->tls_session_server, server) == 0)
+			session = sec->tls_session;
+		else
+		{
+			tls_free_session(sec->tls_session);
+			sec->tls_session = NULL;
+		}
+	}
+
+	sec->ssl = tls_connect(sec->ctx, sec->mcs->iso->tcp->sock, server, session);
+	if (sec->ssl == NULL)
+		return False;
+
+	tls_free_session(sec->tls_session);
+	sec->tls_session = tls_get_session(sec->ssl);
+	strncpy(sec->tls_session_server, server, sizeof(sec->tls_session_server) - 1);
+	sec->tls_session_server[sizeof(sec->tls_session_server) - 1] = 0;
+
+	ntlm_send_negotiate_message(sec);
+	credssp_recv(sec);
+	rdp_mark_phase(sec->rdp, &(sec->rdp->timings.security));
+	return True;
+}
+
+#endif
+
 /* Establish a secure connection */
 RD_BOOL
 sec_connect(rdpSec * sec, char *server, char *username, int port)
@@ -916,11 +1060,12 @@ sec_connect(rdpSec * sec, char *server, char *username, int port)
 	{
 		/* TLS with NLA was successfully negotiated */
 
-		sec->ctx = tls_create_context();
-		sec->ssl = tls_connect(sec->ctx, sec->mcs->iso->tcp->sock, server);
-		ntlm_send_negotiate_message(sec);
-		credssp_recv(sec);
-		exit(0);
+		if (!sec_tls_connect(sec, server))
+			return False;
+		/* NLA stops after the negotiate message and the MCS data path does
+		   not go through TLS yet, so the connection can not go on */
+		ui_error(sec->rdp->inst, "TLS connections are not supported yet\n");
+		return False;
 	}
 	else
 #endif
@@ -934,9 +1079,13 @@ sec_connect(rdpSec * sec, char *server, char *username, int port)
 		sec_out_connectdata(sec, &connectdata);
 		success = mcs_connect(sec->mcs, &connectdata);
 		xfree(connectdata.data);
+		rdp_mark_phase(sec->rdp, &(sec->rdp->timings.mcs));
 
 		if (success && sec->rdp->settings->encryption)
+		{
 			sec_establish_key(sec);
+			rdp_mark_phase(sec->rdp, &(sec->rdp->timings.security));
+		}
 
 		return success;
 	}
@@ -952,15 +1101,30 @@ sec_reconnect(rdpSec * sec, char *server, int port)
 	if (!iso_reconnect(sec->mcs->iso, server, port))
 		return False;
 
+#ifndef DISABLE_TLS
+	if (sec->tls)
+	{
+		/* same as sec_connect, but usually a resumed handshake */
+		if (!sec_tls_connect(sec, server))
+			return False;
+		ui_error(sec->rdp->inst, "TLS connections are not supported yet\n");
+		return False;
+	}
+#endif
+
 	/* We exchange some RDP data during the MCS-Connect */
 	connectdata.size = 512;
 	connectdata.p = connectdata.data = (uint8 *) xmalloc(connectdata.size);
 	sec_out_connectdata(sec, &connectdata);
 	success = mcs_reconnect(sec->mcs, &connectdata);
 	xfree(connectdata.data);
+	rdp_mark_phase(sec->rdp, &(sec->rdp->timings.mcs));
 
 	if (success && sec->rdp->settings->encryption)
+	{
 		sec_establish_key(sec);
+		rdp_mark_phase(sec->rdp, &(sec->rdp->timings.security));
+	}
 
 	return success;
 }
@@ -969,6 +1133,13 @@ sec_reconnect(rdpSec * sec, char *server, int port)
 void
 sec_disconnect(rdpSec * sec)
 {
+#ifndef DISABLE_TLS
+	if (sec->ssl != NULL)
+	{
+		tls_disconnect(sec->ssl);
+		sec->ssl = NULL;
+	}
+#endif
 	mcs_disconnect(sec->mcs);
 }
 
@@ -1003,6 +1174,11 @@ sec_free(rdpSec * sec)
 
 #ifndef DISABLE_TLS
 		nla_free(sec->nla);
+		if (sec->ssl != NULL)
+			SSL_free(sec->ssl);
+		tls_free_session(sec->tls_session);
+		if (sec->ctx != NULL)
+			SSL_CTX_free(sec->ctx);
 #endif
 
 		xfree(sec);
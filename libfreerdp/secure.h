@@ -41,6 +41,7 @@ struct rdp_sec
 	uint8 sec_decrypt_update_key[16];
 	uint8 sec_encrypt_update_key[16];
 	uint8 sec_crypted_random[SEC_MAX_MODULUS_SIZE];
+	uint8 client_random[SEC_RANDOM_SIZE];
 	/* These values must be available to reset state - Session Directory */
 	int sec_encrypt_use_count;
 	int sec_decrypt_use_count;
@@ -51,6 +52,8 @@ struct rdp_sec
 #ifndef DISABLE_TLS
 	SSL *ssl;
 	SSL_CTX *ctx;
+	SSL_SESSION *tls_session;	/* kept for resumption on reconnect and redirect */
+	char tls_session_server[64];
 	struct rdp_nla * nla;
 #endif
 };
@@ -75,6 +78,8 @@ buf_out_uint32(uint8 * buffer, uint32 value);
 void
 sec_sign(uint8 * signature, int siglen, uint8 * session_key, int keylen,
 	 uint8 * data, int datalen);
+void
+sec_arc_verifier(rdpSec * sec, uint8 * arc_random, uint8 * verifier);
 STREAM
 sec_init(rdpSec * sec, uint32 flags, int maxlen);
 STREAM
@@ -59,25 +59,13 @@ l_free(void * in)
  * Copyright (C) 2001-2003  Christophe Devine
  */
 
-/*****************************************************************************/
-void
-ssl_sha1_init(SSL_SHA1 * sha1)
-{
-	memset(sha1, 0, sizeof(SSL_SHA1));
-	sha1->state[0] = 0x67452301;
-	sha1->state[1] = 0xEFCDAB89;
-	sha1->state[2] = 0x98BADCFE;
-	sha1->state[3] = 0x10325476;
-	sha1->state[4] = 0xC3D2E1F0;
-}
-
 #undef GET_UINT32
 #define GET_UINT32(n, b, i)          \
 {                                    \
-  (n) = ((b)[(i) + 0] << 24) |       \
-        ((b)[(i) + 1] << 16) |       \
-        ((b)[(i) + 2] << 8) |        \
-        ((b)[(i) + 3] << 0);         \
+  (n) = ((uint32) (b)[(i) + 0] << 24) | \
+        ((uint32) (b)[(i) + 1] << 16) | \
+        ((uint32) (b)[(i) + 2] << 8) |  \
+        ((uint32) (b)[(i) + 3] << 0);   \
 }
 
 #undef PUT_UINT32
@@ -91,18 +79,15 @@ ssl_sha1_init(SSL_SHA1 * sha1)
 
 /*****************************************************************************/
 static void
-sha1_process(struct sha1_context * ctx, char * in_data)
+sha1_process(uint32 * state, uint8 * data)
 {
-	int temp;
-	int W[16];
-	int A;
-	int B;
-	int C;
-	int D;
-	int E;
-	unsigned char * data;
-
-	data = (unsigned char *) in_data;
+	uint32 temp;
+	uint32 W[16];
+	uint32 A;
+	uint32 B;
+	uint32 C;
+	uint32 D;
+	uint32 E;
 
 	GET_UINT32(W[0], data, 0);
 	GET_UINT32(W[1], data, 4);
@@ -121,7 +106,8 @@ sha1_process(struct sha1_context * ctx, char * in_data)
 	GET_UINT32(W[14], data, 56);
 	GET_UINT32(W[15], data, 60);
 
-#define S(x, n) ((x << n) | ((x & 0xFFFFFFFF) >> (32 - n)))
+#undef S
+#define S(x, n) ((x << n) | (x >> (32 - n)))
 
 #define R(t)                        \
 (                                   \
@@ -139,11 +125,11 @@ sha1_process(struct sha1_context * ctx, char * in_data)
   b = S(b, 30);                      \
 }
 
-	A = ctx->state[0];
-	B = ctx->state[1];
-	C = ctx->state[2];
-	D = ctx->state[3];
-	E = ctx->state[4];
+	A = state[0];
+	B = state[1];
+	C = state[2];
+	D = state[3];
+	E = state[4];
 
 #define F(x, y, z) (z ^ (x & (y ^ z)))
 #define K 0x5A827999
@@ -253,19 +239,194 @@ sha1_process(struct sha1_context * ctx, char * in_data)
 #undef K
 #undef F
 
-	ctx->state[0] += A;
-	ctx->state[1] += B;
-	ctx->state[2] += C;
-	ctx->state[3] += D;
-	ctx->state[4] += E;
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
+	state[4] += E;
+}
+
+/*****************************************************************************/
+static void
+sha1_process_blocks(uint32 * state, uint8 * data, int blocks)
+{
+	while (blocks-- > 0)
+	{
+		sha1_process(state, data);
+		data += 64;
+	}
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define SSL_SHA_NI
+#endif
+
+#ifdef SSL_SHA_NI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*****************************************************************************/
+/* SHA extensions (Intel Goldmont, AMD Zen and later), four rounds per
+   sha1rnds4 with the message schedule computed alongside in MSG0..MSG3.
+   Based on the reference code in Intel's "New Instructions Supporting the
+   Secure Hash Algorithm on Intel Architecture Processors" */
+
+/* rounds 4g..4g+3 once the schedule is running: e is the accumulator for
+   this group, o the one for the next, m0 holds W[4g..4g+3] */
+#define SHA1_NI_R4(e, o, m0, m1, m2, m3, f)  \
+{                                            \
+  e = _mm_sha1nexte_epu32(e, m0);            \
+  o = abcd;                                  \
+  m1 = _mm_sha1msg2_epu32(m1, m0);           \
+  abcd = _mm_sha1rnds4_epu32(abcd, e, f);    \
+  m3 = _mm_sha1msg1_epu32(m3, m0);           \
+  m2 = _mm_xor_si128(m2, m0);                \
+}
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_process_blocks_ni(uint32 * state, uint8 * data, int blocks)
+{
+	__m128i abcd;
+	__m128i abcd_save;
+	__m128i e0;
+	__m128i e0_save;
+	__m128i e1;
+	__m128i msg0;
+	__m128i msg1;
+	__m128i msg2;
+	__m128i msg3;
+	__m128i mask;
+
+	mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) state), 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	while (blocks-- > 0)
+	{
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* rounds 0-15 load the block */
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 0)), mask);
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 16)), mask);
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 32)), mask);
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 48)), mask);
+		SHA1_NI_R4(e1, e0, msg3, msg0, msg1, msg2, 0);
+
+		/* rounds 16-67 */
+		SHA1_NI_R4(e0, e1, msg0, msg1, msg2, msg3, 0);
+		SHA1_NI_R4(e1, e0, msg1, msg2, msg3, msg0, 1);
+		SHA1_NI_R4(e0, e1, msg2, msg3, msg0, msg1, 1);
+		SHA1_NI_R4(e1, e0, msg3, msg0, msg1, msg2, 1);
+		SHA1_NI_R4(e0, e1, msg0, msg1, msg2, msg3, 1);
+		SHA1_NI_R4(e1, e0, msg1, msg2, msg3, msg0, 1);
+		SHA1_NI_R4(e0, e1, msg2, msg3, msg0, msg1, 2);
+		SHA1_NI_R4(e1, e0, msg3, msg0, msg1, msg2, 2);
+		SHA1_NI_R4(e0, e1, msg0, msg1, msg2, msg3, 2);
+		SHA1_NI_R4(e1, e0, msg1, msg2, msg3, msg0, 2);
+		SHA1_NI_R4(e0, e1, msg2, msg3, msg0, msg1, 2);
+		SHA1_NI_R4(e1, e0, msg3, msg0, msg1, msg2, 3);
+		SHA1_NI_R4(e0, e1, msg0, msg1, msg2, msg3, 3);
+
+		/* rounds 68-79 only finish the schedule */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data += 64;
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/*****************************************************************************/
+static RD_BOOL
+sha1_have_ni(void)
+{
+	unsigned int eax;
+	unsigned int ebx;
+	unsigned int ecx;
+	unsigned int edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return False;
+	/* SSSE3 and SSE4.1 */
+	if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+		return False;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return False;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) ? True : False;
+}
+
+#endif /* SSL_SHA_NI */
+
+/* picked on first use, the portable code when the cpu has nothing better */
+static void (* sha1_blocks)(uint32 * state, uint8 * data, int blocks) = NULL;
+
+/*****************************************************************************/
+static void
+sha1_select(void)
+{
+	sha1_blocks = sha1_process_blocks;
+#ifdef SSL_SHA_NI
+	if (sha1_have_ni())
+		sha1_blocks = sha1_process_blocks_ni;
+#endif
+}
+
+/*****************************************************************************/
+void
+ssl_sha1_init(SSL_SHA1 * sha1)
+{
+	if (sha1_blocks == NULL)
+		sha1_select();
+	memset(sha1, 0, sizeof(SSL_SHA1));
+	sha1->state[0] = 0x67452301;
+	sha1->state[1] = 0xEFCDAB89;
+	sha1->state[2] = 0x98BADCFE;
+	sha1->state[3] = 0x10325476;
+	sha1->state[4] = 0xC3D2E1F0;
 }
 
 /*****************************************************************************/
 void
 ssl_sha1_update(SSL_SHA1 * sha1, uint8 * data, uint32 len)
 {
-	int left;
-	int fill;
+	uint32 left;
+	uint32 fill;
 
 	if (len == 0)
 	{
@@ -274,24 +435,23 @@ ssl_sha1_update(SSL_SHA1 * sha1, uint8 * data, uint32 len)
 	left = sha1->total[0] & 0x3F;
 	fill = 64 - left;
 	sha1->total[0] += len;
-	sha1->total[0] &= 0xFFFFFFFF;
-	if (sha1->total[0] < (int) len)
+	if (sha1->total[0] < len)
 	{
 		sha1->total[1]++;
 	}
-	if (left && ((int) len >= fill))
+	if (left && (len >= fill))
 	{
 		memcpy(sha1->buffer + left, data, fill);
-		sha1_process(sha1, sha1->buffer);
+		sha1_blocks(sha1->state, sha1->buffer, 1);
 		len -= fill;
 		data += fill;
 		left = 0;
 	}
-	while (len >= 64)
+	if (len >= 64)
 	{
-		sha1_process(sha1, (char *) data);
-		len -= 64;
-		data += 64;
+		sha1_blocks(sha1->state, data, len / 64);
+		data += len & ~0x3F;
+		len &= 0x3F;
 	}
 	if (len != 0)
 	{
@@ -311,11 +471,11 @@ static unsigned char sha1_padding[64] =
 void
 ssl_sha1_final(SSL_SHA1 * sha1, uint8 * out_data)
 {
-	int last;
-	int padn;
-	int high;
-	int low;
-	char msglen[8];
+	uint32 last;
+	uint32 padn;
+	uint32 high;
+	uint32 low;
+	uint8 msglen[8];
 
 	high = (sha1->total[0] >> 29) | (sha1->total[1] << 3);
 	low = (sha1->total[0] << 3);
@@ -324,7 +484,7 @@ ssl_sha1_final(SSL_SHA1 * sha1, uint8 * out_data)
 	last = sha1->total[0] & 0x3F;
 	padn = (last < 56) ? (56 - last) : (120 - last);
 	ssl_sha1_update(sha1, sha1_padding, padn);
-	ssl_sha1_update(sha1, (uint8*)msglen, 8);
+	ssl_sha1_update(sha1, msglen, 8);
 	PUT_UINT32(sha1->state[0], out_data, 0);
 	PUT_UINT32(sha1->state[1], out_data, 4);
 	PUT_UINT32(sha1->state[2], out_data, 8);
@@ -355,10 +515,10 @@ ssl_md5_init(SSL_MD5 * md5)
 #undef GET_UINT32
 #define GET_UINT32(n, b, i)          \
 {                                    \
-  (n) = ((b)[(i) + 0] << 0) |        \
-        ((b)[(i) + 1] << 8) |        \
-        ((b)[(i) + 2] << 16) |       \
-        ((b)[(i) + 3] << 24);        \
+  (n) = ((uint32) (b)[(i) + 0] << 0) |  \
+        ((uint32) (b)[(i) + 1] << 8) |  \
+        ((uint32) (b)[(i) + 2] << 16) | \
+        ((uint32) (b)[(i) + 3] << 24);  \
 }
 
 #undef PUT_UINT32
@@ -372,16 +532,14 @@ ssl_md5_init(SSL_MD5 * md5)
 
 /*****************************************************************************/
 static void
-md5_process(struct md5_context* ctx, char* in_data)
+md5_process(uint32 * state, uint8 * data)
 {
-	int X[16];
-	int A;
-	int B;
-	int C;
-	int D;
-	unsigned char* data;
+	uint32 X[16];
+	uint32 A;
+	uint32 B;
+	uint32 C;
+	uint32 D;
 
-	data = (unsigned char *) in_data;
 	GET_UINT32(X[0], data, 0);
 	GET_UINT32(X[1], data, 4);
 	GET_UINT32(X[2], data, 8);
@@ -399,7 +557,8 @@ md5_process(struct md5_context* ctx, char* in_data)
 	GET_UINT32(X[14], data, 56);
 	GET_UINT32(X[15], data, 60);
 
-#define S(x, n) ((x << n) | ((x & 0xFFFFFFFF) >> (32 - n)))
+#undef S
+#define S(x, n) ((x << n) | (x >> (32 - n)))
 
 #undef P
 #define P(a, b, c, d, k, s, t) \
@@ -408,10 +567,10 @@ md5_process(struct md5_context* ctx, char* in_data)
   a = S(a, s) + b;             \
 }
 
-	A = ctx->state[0];
-	B = ctx->state[1];
-	C = ctx->state[2];
-	D = ctx->state[3];
+	A = state[0];
+	B = state[1];
+	C = state[2];
+	D = state[3];
 
 #define F(x, y, z) (z ^ (x & (y ^ z)))
 
@@ -497,18 +656,18 @@ md5_process(struct md5_context* ctx, char* in_data)
 
 #undef F
 
-	ctx->state[0] += A;
-	ctx->state[1] += B;
-	ctx->state[2] += C;
-	ctx->state[3] += D;
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
 }
 
 /*****************************************************************************/
 void
 ssl_md5_update(SSL_MD5 * md5, uint8 * data, uint32 len)
 {
-	int left;
-	int fill;
+	uint32 left;
+	uint32 fill;
 
 	if (len == 0)
 	{
@@ -517,22 +676,21 @@ ssl_md5_update(SSL_MD5 * md5, uint8 * data, uint32 len)
 	left = md5->total[0] & 0x3F;
 	fill = 64 - left;
 	md5->total[0] += len;
-	md5->total[0] &= 0xFFFFFFFF;
-	if (md5->total[0] < (int) len)
+	if (md5->total[0] < len)
 	{
 		md5->total[1]++;
 	}
-	if (left && ((int) len >= fill))
+	if (left && (len >= fill))
 	{
 		memcpy(md5->buffer + left, data, fill);
-		md5_process(md5, md5->buffer);
+		md5_process(md5->state, md5->buffer);
 		len -= fill;
 		data += fill;
 		left = 0;
 	}
 	while (len >= 64)
 	{
-		md5_process(md5, (char *) data);
+		md5_process(md5->state, data);
 		len -= 64;
 		data += 64;
 	}
@@ -554,11 +712,11 @@ static unsigned char md5_padding[64] =
 void
 ssl_md5_final(SSL_MD5 * md5, uint8 * out_data)
 {
-	int last;
-	int padn;
-	int high;
-	int low;
-	char msglen[8];
+	uint32 last;
+	uint32 padn;
+	uint32 high;
+	uint32 low;
+	uint8 msglen[8];
 
 	high = (md5->total[0] >> 29) | (md5->total[1] << 3);
 	low = (md5->total[0] << 3);
@@ -567,7 +725,7 @@ ssl_md5_final(SSL_MD5 * md5, uint8 * out_data)
 	last = md5->total[0] & 0x3F;
 	padn = (last < 56) ? (56 - last) : (120 - last);
 	ssl_md5_update(md5, md5_padding, padn);
-	ssl_md5_update(md5, (uint8*)msglen, 8);
+	ssl_md5_update(md5, msglen, 8);
 	PUT_UINT32(md5->state[0], out_data, 0);
 	PUT_UINT32(md5->state[1], out_data, 4);
 	PUT_UINT32(md5->state[2], out_data, 8);
@@ -588,16 +746,14 @@ void
 ssl_rc4_set_key(SSL_RC4 * rc4, uint8 * key, uint32 len)
 {
 	int i;
-	int j;
-	int k;
-	int a;
-	int * m;
-	struct rc4_state * s;
-
-	s = rc4;
-	s->x = 0;
-	s->y = 0;
-	m = s->m;
+	uint32 k;
+	uint8 j;
+	uint32 a;
+	uint32 * m;
+
+	rc4->x = 0;
+	rc4->y = 0;
+	m = rc4->m;
 	for (i = 0; i < 256; i++)
 	{
 		m[i] = i;
@@ -607,45 +763,70 @@ ssl_rc4_set_key(SSL_RC4 * rc4, uint8 * key, uint32 len)
 	for (i = 0; i < 256; i++)
 	{
 		a = m[i];
-		j = (unsigned char) (j + a + key[k]);
+		j += a + key[k];
 		m[i] = m[j];
 		m[j] = a;
 		k++;
-		if (k >= (int) len)
+		if (k >= len)
 		{
 			k = 0;
 		}
 	}
 }
 
+/* next keystream byte into k, the uint8 indexes wrap by themselves */
+#define RC4_NEXT(k)                                         \
+{                                                           \
+  x++;                                                      \
+  a = m[x];                                                 \
+  y += a;                                                   \
+  b = m[y];                                                 \
+  m[x] = b;                                                 \
+  m[y] = a;                                                 \
+  k = m[(uint8) (a + b)];                                   \
+}
+
 /*****************************************************************************/
 void
 ssl_rc4_crypt(SSL_RC4 * rc4, uint8 * in_data, uint8 * out_data, uint32 len)
 {
-	int i;
-	int x;
-	int y;
-	int a;
-	int b;
-	int * m;
-	struct rc4_state * s;
-
-	s = rc4;
-	x = s->x;
-	y = s->y;
-	m = s->m;
-	for (i = 0; i < (int)len; i++)
-	{
-		x = (unsigned char) (x + 1);
-		a = m[x];
-		y = (unsigned char) (y + a);
-		b = m[y];
-		m[x] = b;
-		m[y] = a;
-		out_data[i] = in_data[i] ^ (m[(unsigned char) (a + b)]);
-	}
-	s->x = x;
-	s->y = y;
+	uint8 x;
+	uint8 y;
+	uint32 a;
+	uint32 b;
+	uint32 k0;
+	uint32 k1;
+	uint32 k2;
+	uint32 k3;
+	uint32 * m;
+
+	x = rc4->x;
+	y = rc4->y;
+	m = rc4->m;
+	/* four keystream bytes before any output store, a store through
+	   uint8 * may alias m and would force it to be reloaded */
+	while (len >= 4)
+	{
+		RC4_NEXT(k0);
+		RC4_NEXT(k1);
+		RC4_NEXT(k2);
+		RC4_NEXT(k3);
+		out_data[0] = in_data[0] ^ k0;
+		out_data[1] = in_data[1] ^ k1;
+		out_data[2] = in_data[2] ^ k2;
+		out_data[3] = in_data[3] ^ k3;
+		in_data += 4;
+		out_data += 4;
+		len -= 4;
+	}
+	while (len > 0)
+	{
+		RC4_NEXT(k0);
+		*out_data++ = *in_data++ ^ k0;
+		len--;
+	}
+	rc4->x = x;
+	rc4->y = y;
 }
 
 /*****************************************************************************/
@@ -1453,7 +1634,7 @@ s_mp_mul_d(mp_int * a, mp_digit d)
 		unless absolutely necessary.
 	*/
 	max = USED(a);
-	w = dp[max - 1] * d;
+	w = (mp_word) dp[max - 1] * d;
 	if (CARRYOUT(w) != 0)
 	{
 		if ((res = s_mp_pad(a, max + 1)) != MP_OKAY)
@@ -1462,7 +1643,7 @@ s_mp_mul_d(mp_int * a, mp_digit d)
 	}
 	for (ix = 0; ix < max; ix++)
 	{
-		w = (dp[ix] * d) + k;
+		w = ((mp_word) dp[ix] * d) + k;
 		dp[ix] = ACCUM(w);
 		k = CARRYOUT(w);
 	}
@@ -1986,7 +2167,7 @@ s_mp_mul(mp_int * a, mp_int * b)
 		for (jx = 0; jx < ua; ++jx, ++pa)
 		{
 			pt = pbt + ix + jx;
-			w = *pb * *pa + k + *pt;
+			w = (mp_word) *pb * *pa + k + *pt;
 			*pt = ACCUM(w);
 			k = CARRYOUT(w);
 		}
@@ -2201,7 +2382,7 @@ s_mp_sqr(mp_int * a)
 	{
 		if (*pa1 == 0)
 			continue;
-		w = DIGIT(&tmp, ix + ix) + (*pa1 * *pa1);
+		w = DIGIT(&tmp, ix + ix) + ((mp_word) *pa1 * *pa1);
 		pbt[ix + ix] = ACCUM(w);
 		k = CARRYOUT(w);
 		/*
@@ -2218,7 +2399,7 @@ s_mp_sqr(mp_int * a)
 			/* Store this in a temporary to avoid indirections later */
 			pt = pbt + ix + jx;
 			/* Compute the multiplicative step */
-			w = *pa1 * *pa2;
+			w = (mp_word) *pa1 * *pa2;
 			/* If w is more than half MP_WORD_MAX, the doubling will
 				overflow, and we need to record a carry out into the next
 				word */
@@ -2446,6 +2627,254 @@ ssl_reverse_it(char * p, int len)
 
 #define PAR_MAX 1024
 
+/*****************************************************************************/
+/*
+  Montgomery multiplication on little endian 32 bit limbs, used instead of
+  mp_exptmod() for odd moduli, which is every RSA key a server sends.
+  Numbers stay in Montgomery form (x * R mod n, R = 2^(32 * len)) for the
+  whole exponentiation so each step is one interleaved multiply and
+  reduce (CIOS, Koc et al.) instead of a multiply and a Barrett reduce.
+*/
+
+#define MONT_MAX_LIMBS (PAR_MAX / 4)
+#define MONT_MAX_WINDOW 5
+
+/* -n0^-1 mod 2^32, n0 odd */
+static uint32
+mont_n0inv(uint32 n0)
+{
+	uint32 inv;
+	int i;
+
+	/* Newton iteration, each step doubles the number of correct bits */
+	inv = n0;
+	for (i = 0; i < 5; i++)
+		inv *= 2 - n0 * inv;
+	return (uint32) 0 - inv;
+}
+
+/* r = a * b / R mod n, r may be a or b */
+static void
+mont_mul(uint32 * r, uint32 * a, uint32 * b, uint32 * n, uint32 n0inv, int len)
+{
+	uint32 t[MONT_MAX_LIMBS + 2];
+	uint64 acc;
+	uint32 m;
+	uint32 bi;
+	int i;
+	int j;
+
+	memset(t, 0, (len + 2) * sizeof(uint32));
+	for (i = 0; i < len; i++)
+	{
+		/* t += a * b[i] */
+		bi = b[i];
+		acc = 0;
+		for (j = 0; j < len; j++)
+		{
+			acc += (uint64) a[j] * bi + t[j];
+			t[j] = (uint32) acc;
+			acc >>= 32;
+		}
+		acc += t[len];
+		t[len] = (uint32) acc;
+		t[len + 1] = (uint32) (acc >> 32);
+
+		/* t = (t + m * n) / 2^32, m chosen so the low limb cancels */
+		m = t[0] * n0inv;
+		acc = (uint64) m * n[0] + t[0];
+		acc >>= 32;
+		for (j = 1; j < len; j++)
+		{
+			acc += (uint64) m * n[j] + t[j];
+			t[j - 1] = (uint32) acc;
+			acc >>= 32;
+		}
+		acc += t[len];
+		t[len - 1] = (uint32) acc;
+		t[len] = t[len + 1] + (uint32) (acc >> 32);
+	}
+
+	/* t < 2n, one conditional subtract brings it below n */
+	if (t[len] == 0)
+	{
+		for (j = len - 1; j >= 0; j--)
+		{
+			if (t[j] != n[j])
+				break;
+		}
+		if (j >= 0 && t[j] < n[j])
+		{
+			memcpy(r, t, len * sizeof(uint32));
+			return;
+		}
+	}
+	acc = 1;
+	for (j = 0; j < len; j++)
+	{
+		acc += (uint64) t[j] + (uint32) ~n[j];
+		r[j] = (uint32) acc;
+		acc >>= 32;
+	}
+}
+
+/* r = 2r mod n, r < n */
+static void
+mont_double(uint32 * r, uint32 * n, int len)
+{
+	uint64 acc;
+	uint32 top;
+	int j;
+
+	top = r[len - 1] >> 31;
+	for (j = len - 1; j > 0; j--)
+		r[j] = (r[j] << 1) | (r[j - 1] >> 31);
+	r[0] <<= 1;
+	for (j = len - 1; j >= 0 && !top; j--)
+	{
+		if (r[j] != n[j])
+			break;
+	}
+	if (top || j < 0 || r[j] > n[j])
+	{
+		acc = 1;
+		for (j = 0; j < len; j++)
+		{
+			acc += (uint64) r[j] + (uint32) ~n[j];
+			r[j] = (uint32) acc;
+			acc >>= 32;
+		}
+	}
+}
+
+/* r = R^2 mod n, for converting into Montgomery form */
+static void
+mont_rr(uint32 * r, uint32 * n, uint32 n0inv, int len)
+{
+	int top;
+	int k;
+	int m;
+	int i;
+
+	/* start at the highest power of two below n */
+	top = 32 * len - 1;
+	while (!(n[top / 32] & ((uint32) 1 << (top % 32))))
+		top--;
+	memset(r, 0, len * sizeof(uint32));
+	r[top / 32] = (uint32) 1 << (top % 32);
+
+	/* doubling gets to 2^k * R mod n, the Montgomery form of 2^k, where
+	   k * 2^m = 32 * len; each squaring then doubles k until it is R */
+	k = 32 * len;
+	m = 0;
+	while (k % 2 == 0 && k > 32)
+	{
+		k /= 2;
+		m++;
+	}
+	for (i = top; i < 32 * len + k; i++)
+		mont_double(r, n, len);
+	for (i = 0; i < m; i++)
+		mont_mul(r, r, r, n, n0inv, len);
+}
+
+static void
+mont_from_bin(uint32 * r, int len, uint8 * in, int in_len)
+{
+	int i;
+
+	memset(r, 0, len * sizeof(uint32));
+	for (i = 0; i < in_len && i < len * 4; i++)
+		r[i / 4] |= (uint32) in[i] << (8 * (i % 4));
+}
+
+/* fixed window exponentiation, all in little endian byte order like the
+   rest of RDP; returns 1 if n is not odd or the input is wider than n so
+   the caller can fall back */
+static int
+mont_mod_exp(uint8 * out, int out_len, uint8 * in, int in_len,
+	uint8 * mod, int mod_len, uint8 * exp, int exp_len)
+{
+	uint32 n[MONT_MAX_LIMBS];
+	uint32 x[MONT_MAX_LIMBS];
+	uint32 acc[MONT_MAX_LIMBS];
+	uint32 table[1 << MONT_MAX_WINDOW][MONT_MAX_LIMBS];
+	uint32 n0inv;
+	int len;
+	int bits;
+	int window;
+	int bit;
+	int digit;
+	int started;
+	int i;
+
+	len = (mod_len + 3) / 4;
+	mont_from_bin(n, len, mod, mod_len);
+	while (len > 1 && n[len - 1] == 0)
+		len--;
+	if ((n[0] & 1) == 0 || (len == 1 && n[0] == 1))
+		return 1;
+	/* mont_from_bin keeps len limbs, anything above would be lost */
+	for (i = len * 4; i < in_len; i++)
+	{
+		if (in[i] != 0)
+			return 1;
+	}
+
+	bits = exp_len * 8;
+	while (bits > 0 && !(exp[(bits - 1) / 8] & (1 << ((bits - 1) % 8))))
+		bits--;
+	window = bits > 512 ? 5 : bits > 128 ? 4 : bits > 24 ? 3 : 1;
+
+	n0inv = mont_n0inv(n[0]);
+
+	/* table[i] = in^i * R mod n */
+	mont_rr(acc, n, n0inv, len);
+	mont_from_bin(x, len, in, in_len);
+	mont_mul(table[1], x, acc, n, n0inv, len);
+	memset(x, 0, len * sizeof(uint32));
+	x[0] = 1;
+	mont_mul(table[0], x, acc, n, n0inv, len);
+	for (i = 2; i < (1 << window); i++)
+		mont_mul(table[i], table[i - 1], table[1], n, n0inv, len);
+
+	/* exponent from the top, window bits at a time */
+	memcpy(acc, table[0], len * sizeof(uint32));
+	started = 0;
+	for (bit = ((bits + window - 1) / window) * window - 1; bit >= 0; bit -= window)
+	{
+		digit = 0;
+		for (i = 0; i < window; i++)
+		{
+			digit <<= 1;
+			if (bit - i < bits && (exp[(bit - i) / 8] & (1 << ((bit - i) % 8))))
+				digit |= 1;
+		}
+		if (started)
+		{
+			for (i = 0; i < window; i++)
+				mont_mul(acc, acc, acc, n, n0inv, len);
+		}
+		if (digit != 0)
+		{
+			mont_mul(acc, acc, table[digit], n, n0inv, len);
+			started = 1;
+		}
+	}
+
+	/* out of Montgomery form */
+	memset(x, 0, len * sizeof(uint32));
+	x[0] = 1;
+	mont_mul(acc, acc, x, n, n0inv, len);
+
+	for (i = 0; i < out_len; i++)
+		out[i] = i < len * 4 ? (uint8) (acc[i / 4] >> (8 * (i % 4))) : 0;
+
+	memset(table, 0, sizeof(table));
+	memset(acc, 0, sizeof(acc));
+	return 0;
+}
+
 /*****************************************************************************/
 static int
 ssl_mod_exp(char * out, int out_len, char * in, int in_len,
@@ -2468,6 +2897,11 @@ ssl_mod_exp(char * out, int out_len, char * in, int in_len,
 		printf("ssl_mod_exp: too big\n");
 		return 1;
 	}
+	if (mont_mod_exp((uint8 *) out, out_len, (uint8 *) in, in_len,
+		(uint8 *) mod, mod_len, (uint8 *) exp, exp_len) == 0)
+	{
+		return 0;
+	}
 	data = (char *) l_malloc(PAR_MAX * 4, 1);
 	if (data == NULL)
 	{
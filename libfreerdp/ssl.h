@@ -24,23 +24,23 @@
 
 struct rc4_state
 {
-  int x;
-  int y;
-  int m[256];
+  uint8 x;
+  uint8 y;
+  uint32 m[256];
 };
 
 struct sha1_context
 {
-  int total[2];
-  int state[5];
-  char buffer[64];
+  uint32 total[2];
+  uint32 state[5];
+  uint8 buffer[64];
 };
 
 struct md5_context
 {
-  int total[2];
-  int state[4];
-  char buffer[64];
+  uint32 total[2];
+  uint32 state[4];
+  uint8 buffer[64];
 };
 
 #define SSL_RC4 struct rc4_state
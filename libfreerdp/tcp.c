@@ -36,18 +36,22 @@
 #include "mcs.h"
 #include "secure.h"
 #include "rdp.h"
+#include "rdpset.h"
 #include "mem.h"
+#include "debug.h"
 
 #ifdef _WIN32
 #define socklen_t int
 #define TCP_CLOSE(_sck) closesocket(_sck)
 #define TCP_STRERROR "tcp error"
 #define TCP_BLOCKS (WSAGetLastError() == WSAEWOULDBLOCK)
+#define TCP_CONNECTING (WSAGetLastError() == WSAEWOULDBLOCK)
 #define MSG_NOSIGNAL 0
 #else
 #define TCP_CLOSE(_sck) close(_sck)
 #define TCP_STRERROR strerror(errno)
 #define TCP_BLOCKS (errno == EWOULDBLOCK)
+#define TCP_CONNECTING (errno == EINPROGRESS)
 #endif
 
 #ifdef __APPLE__
@@ -222,6 +226,7 @@ tcp_recv(rdpTcp * tcp, STREAM s, uint32 length)
 			else
 			{
 				ui_error(tcp->iso->mcs->sec->rdp->inst, "recv: %s\n", TCP_STRERROR);
+				tcp->dropped = True;
 				return NULL;
 			}
 		}
@@ -236,6 +241,7 @@ tcp_recv(rdpTcp * tcp, STREAM s, uint32 length)
 			else
 			{
 				ui_error(tcp->iso->mcs->sec->rdp->inst, "Connection closed\n");
+				tcp->dropped = True;
 				return NULL;
 			}
 		}
@@ -247,6 +253,183 @@ tcp_recv(rdpTcp * tcp, STREAM s, uint32 length)
 	return s;
 }
 
+static void
+tcp_set_nonblocking(int sck)
+{
+#ifdef _WIN32
+	u_long arg = 1;
+	ioctlsocket(sck, FIONBIO, &arg);
+#else
+	int flags;
+
+	flags = fcntl(sck, F_GETFL);
+	fcntl(sck, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+#ifdef IPv6
+
+/* addresses raced against each other, the rest of a long list is ignored */
+#define TCP_MAX_ATTEMPTS 16
+/* RFC 8305 "Connection Attempt Delay" in ms */
+#define TCP_ATTEMPT_DELAY 250
+
+/* Order the getaddrinfo results as RFC 8305 section 4 describes:
+   alternate between address families, starting with the preferred one */
+static int
+tcp_sort_addresses(struct addrinfo * res, struct addrinfo ** list)
+{
+	struct addrinfo * first[TCP_MAX_ATTEMPTS];
+	struct addrinfo * other[TCP_MAX_ATTEMPTS];
+	struct addrinfo * ai;
+	int nfirst;
+	int nother;
+	int count;
+	int i;
+
+	nfirst = 0;
+	nother = 0;
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		if (ai->ai_family == res->ai_family)
+		{
+			if (nfirst < TCP_MAX_ATTEMPTS)
+				first[nfirst++] = ai;
+		}
+		else if (nother < TCP_MAX_ATTEMPTS)
+			other[nother++] = ai;
+	}
+
+	count = 0;
+	for (i = 0; count < TCP_MAX_ATTEMPTS && (i < nfirst || i < nother); i++)
+	{
+		if (i < nfirst)
+			list[count++] = first[i];
+		if (i < nother && count < TCP_MAX_ATTEMPTS)
+			list[count++] = other[i];
+	}
+	return count;
+}
+
+/* Start a non blocking connect, returns the socket or -1 if it failed at once */
+static int
+tcp_connect_start(struct addrinfo * ai)
+{
+	int sck;
+
+	sck = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sck < 0)
+		return -1;
+
+	tcp_set_nonblocking(sck);
+	if (connect(sck, ai->ai_addr, ai->ai_addrlen) == 0 || TCP_CONNECTING)
+		return sck;
+
+	TCP_CLOSE(sck);
+	return -1;
+}
+
+/* Staggered parallel connection attempts ("Happy Eyeballs", RFC 8305).
+   A new attempt starts every TCP_ATTEMPT_DELAY ms, or as soon as one fails,
+   and the first socket to connect wins. timeout is the deadline for all of
+   them in ms, 0 for none. Returns the connected socket or -1. */
+static int
+tcp_connect_race(struct addrinfo ** list, int count, uint32 timeout, int * winner)
+{
+	int socks[TCP_MAX_ATTEMPTS];
+	int next;
+	int pending;
+	int maxfd;
+	int sck;
+	int i;
+	uint32 start;
+	uint32 now;
+	uint32 next_start;
+	uint32 wait;
+	fd_set wfds;
+	struct timeval tv;
+
+	start = rd_get_ticks();
+	next_start = start;
+	next = 0;
+	pending = 0;
+	sck = -1;
+
+	while (sck == -1)
+	{
+		now = rd_get_ticks();
+		if (timeout > 0 && now - start >= timeout)
+			break;
+
+		if (next < count && (pending == 0 || (int) (now - next_start) >= 0))
+		{
+			socks[next] = tcp_connect_start(list[next]);
+			if (socks[next] != -1)
+			{
+				pending++;
+				next_start = now + TCP_ATTEMPT_DELAY;
+			}
+			next++;
+			continue;
+		}
+
+		if (pending == 0)
+			break;
+
+		wait = 0xffffffff;
+		if (next < count)
+			wait = next_start - now;
+		if (timeout > 0 && timeout - (now - start) < wait)
+			wait = timeout - (now - start);
+
+		FD_ZERO(&wfds);
+		maxfd = 0;
+		for (i = 0; i < next; i++)
+		{
+			if (socks[i] != -1)
+			{
+				FD_SET(socks[i], &wfds);
+				if (socks[i] > maxfd)
+					maxfd = socks[i];
+			}
+		}
+
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		if (select(maxfd + 1, NULL, &wfds, NULL, wait == 0xffffffff ? NULL : &tv) <= 0)
+			continue;
+
+		for (i = 0; i < next; i++)
+		{
+			if (socks[i] == -1 || !FD_ISSET(socks[i], &wfds))
+				continue;
+
+			if (tcp_socket_ok(socks[i]))
+			{
+				sck = socks[i];
+				socks[i] = -1;
+				*winner = i;
+				break;
+			}
+
+			/* refused or unreachable, don't wait for the next slot */
+			TCP_CLOSE(socks[i]);
+			socks[i] = -1;
+			pending--;
+			next_start = now;
+		}
+	}
+
+	for (i = 0; i < next; i++)
+	{
+		if (socks[i] != -1)
+			TCP_CLOSE(socks[i]);
+	}
+	return sck;
+}
+
+#endif /* IPv6 */
+
 /* Establish a connection on the TCP layer */
 RD_BOOL
 tcp_connect(rdpTcp * tcp, char * server, int port)
@@ -255,10 +438,16 @@ tcp_connect(rdpTcp * tcp, char * server, int port)
 	uint32 option_value;
 	int sock;
 
+	tcp->dropped = False;
+	memset(tcp->server_addr, 0, sizeof(tcp->server_addr));
+
 #ifdef IPv6
 
 	int n;
-	struct addrinfo hints, *res, *ressave;
+	int count;
+	int winner;
+	struct addrinfo hints, *res;
+	struct addrinfo * list[TCP_MAX_ATTEMPTS];
 	char tcp_port_rdp_s[10];
 
 	snprintf(tcp_port_rdp_s, 10, "%d", port);
@@ -273,21 +462,18 @@ tcp_connect(rdpTcp * tcp, char * server, int port)
 		return False;
 	}
 
-	ressave = res;
-	sock = -1;
-	while (res)
+	count = tcp_sort_addresses(res, list);
+	sock = tcp_connect_race(list, count,
+		tcp->iso->mcs->sec->rdp->settings->tcp_connect_timeout, &winner);
+	if (sock != -1)
 	{
-		sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (!(sock < 0))
-		{
-			if (connect(sock, res->ai_addr, res->ai_addrlen) == 0)
-				break;
-			TCP_CLOSE(sock);
-			sock = -1;
-		}
-		res = res->ai_next;
+		if (getnameinfo(list[winner]->ai_addr, list[winner]->ai_addrlen,
+				tcp->server_addr, sizeof(tcp->server_addr), NULL, 0, NI_NUMERICHOST) != 0)
+			strncpy(tcp->server_addr, server, sizeof(tcp->server_addr) - 1);
+		DEBUG("connected to %s (%s), attempt %d of %d\n",
+			server, tcp->server_addr, winner + 1, count);
 	}
-	freeaddrinfo(ressave);
+	freeaddrinfo(res);
 
 	if (sock == -1)
 	{
@@ -325,23 +511,17 @@ tcp_connect(rdpTcp * tcp, char * server, int port)
 		TCP_CLOSE(sock);
 		return False;
 	}
+	strncpy(tcp->server_addr, inet_ntoa(servaddr.sin_addr), sizeof(tcp->server_addr) - 1);
 
 #endif /* IPv6 */
 
 	tcp->sock = sock;
 
 	/* set socket as non blocking */
+	tcp_set_nonblocking(tcp->sock);
 #ifdef _WIN32
-	{
-		u_long arg = 1;
-		ioctlsocket(tcp->sock, FIONBIO, &arg);
-		tcp->wsa_event = WSACreateEvent();
-		WSAEventSelect(tcp->sock, tcp->wsa_event, FD_READ);
-	}
-#else
-	option_value = fcntl(tcp->sock, F_GETFL);
-	option_value = option_value | O_NONBLOCK;
-	fcntl(tcp->sock, F_SETFL, option_value);
+	tcp->wsa_event = WSACreateEvent();
+	WSAEventSelect(tcp->sock, tcp->wsa_event, FD_READ);
 #endif
 
 	option_value = 1;
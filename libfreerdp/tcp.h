@@ -29,10 +29,12 @@ struct rdp_tcp
 {
 	struct rdp_iso * iso;
 	int sock;
+	RD_BOOL dropped; /* the connection broke rather than being closed */
 	struct stream in;
 	struct stream out;
 	int tcp_port_rdp;
 	char ipaddr[32];
+	char server_addr[64]; /* numeric address tcp_connect ended up using */
 #ifdef _WIN32
 	WSAEVENT wsa_event;
 #endif
@@ -210,12 +210,18 @@ tls_create_context()
 
 	SSL_CTX_set_options(ctx, SSL_OP_ALL);
 
+	/*
+	 * Sessions are handed back to tls_connect() by the caller, OpenSSL only
+	 * has to keep them resumable.
+	 */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
 	return ctx;
 }
 
-/* Initiate TLS handshake on socket */
+/* Initiate TLS handshake on socket, resuming session if it is not NULL */
 SSL*
-tls_connect(SSL_CTX *ctx, int sockfd, char *server)
+tls_connect(SSL_CTX *ctx, int sockfd, char *server, SSL_SESSION *session)
 {
 	SSL *ssl;
 	int connection_status;
@@ -231,25 +237,41 @@ tls_connect(SSL_CTX *ctx, int sockfd, char *server)
 	if (SSL_set_fd(ssl, sockfd) < 1)
 	{
 		printf("SSL_set_fd failed\n");
+		SSL_free(ssl);
 		return NULL;
 	}
 
-	do
+	if (session != NULL && SSL_set_session(ssl, session) < 1)
+		printf("SSL_set_session failed, doing a full handshake\n");
+
+	while (True)
 	{
-		/* SSL_WANT_READ errors are normal, just try again if it happens */
 		connection_status = SSL_connect(ssl);
+		if (SSL_get_error(ssl, connection_status) != SSL_ERROR_WANT_READ)
+			break;
+		/* SSL_WANT_READ errors are normal, wait for the server and retry */
+		tcp_can_recv(sockfd, 100);
 	}
-	while (SSL_get_error(ssl, connection_status) == SSL_ERROR_WANT_READ);
 
 	if (connection_status < 0)
 	{
 		if (tls_printf("SSL_connect", ssl, connection_status))
+		{
+			SSL_free(ssl);
 			return NULL;
+		}
 	}
 
-	tls_verify(ssl, server);
-
-	printf("TLS connection established\n");
+	if (SSL_session_reused(ssl))
+	{
+		/* the certificate was checked when the session was first made */
+		printf("TLS session resumed\n");
+	}
+	else
+	{
+		tls_verify(ssl, server);
+		printf("TLS connection established\n");
+	}
 
 	return ssl;
 }
@@ -275,6 +297,21 @@ tls_disconnect(SSL *ssl)
 	ssl = NULL;
 }
 
+/* Get a reference to the session of an established connection for later resumption */
+SSL_SESSION*
+tls_get_session(SSL *ssl)
+{
+	return SSL_get1_session(ssl);
+}
+
+/* Release a session reference obtained with tls_get_session */
+void
+tls_free_session(SSL_SESSION *session)
+{
+	if (session != NULL)
+		SSL_SESSION_free(session);
+}
+
 /* Send data over TLS connection */
 int tls_write(SSL *ssl, char* b, int size)
 {
@@ -304,32 +341,24 @@ int tls_write(SSL *ssl, char* b, int size)
 int tls_read(SSL *ssl, char* b, int size)
 {
 	int read_status;
-	int bytesRead = 0;
-
-	read_status = SSL_read(ssl, b, size);
 
-	switch (SSL_get_error(ssl, read_status))
+	while (True)
 	{
-		case SSL_ERROR_NONE:
-			bytesRead += read_status;
-			break;
-
-		case SSL_ERROR_WANT_READ:
-
-			if (size - bytesRead < 128)
-			{
-					/* the buffer is almost full, allocate more memory */
-					size += 1024;
-					xrealloc(b, size);
-			}
-
-			bytesRead += tls_read(ssl, &b[bytesRead], size - bytesRead);
-			break;
-
-		default:
-			tls_printf("SSL_read", ssl, read_status);
-			break;
+		read_status = SSL_read(ssl, b, size);
+
+		switch (SSL_get_error(ssl, read_status))
+		{
+			case SSL_ERROR_NONE:
+				return read_status;
+
+			case SSL_ERROR_WANT_READ:
+				/* record not complete yet, wait for the rest of it */
+				tcp_can_recv(SSL_get_fd(ssl), 100);
+				break;
+
+			default:
+				tls_printf("SSL_read", ssl, read_status);
+				return 0;
+		}
 	}
-
-	return bytesRead;
 }
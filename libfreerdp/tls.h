@@ -33,9 +33,13 @@
 SSL_CTX*
 tls_create_context();
 SSL*
-tls_connect(SSL_CTX *ctx, int sockfd, char *server);
+tls_connect(SSL_CTX *ctx, int sockfd, char *server, SSL_SESSION *session);
 void
 tls_disconnect(SSL *ssl);
+SSL_SESSION*
+tls_get_session(SSL *ssl);
+void
+tls_free_session(SSL_SESSION *session);
 int
 tls_write(SSL *ssl, char* b, int size);
 int